@@ -0,0 +1,151 @@
+/*
+ * arena.c : GeeXboX uShare bump allocator.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+/* Anything bigger gets a chunk of its own rather than wasting the end of
+ * the current one */
+#define ARENA_BIG (ARENA_CHUNK_SIZE / 4)
+
+#define ARENA_ROUND(x, n) (((x) + (n) - 1) & ~((size_t) (n) - 1))
+
+/* Chunks are mapped rather than malloc'ed, so that freeing an arena
+ * always gives the memory back to the system, whatever the state the
+ * heap is left in. */
+struct arena_chunk_s {
+  arena_chunk_t *next;
+  size_t size;                  /* mapped, this header included */
+  size_t used;
+};
+
+#define ARENA_HEADER ARENA_ROUND (sizeof (arena_chunk_t), ARENA_ALIGN)
+
+static arena_chunk_t *
+arena_chunk_new (size_t size)
+{
+  arena_chunk_t *chunk;
+  long page = sysconf (_SC_PAGESIZE);
+
+  size = ARENA_ROUND (size, page > 0 ? (size_t) page : 4096);
+  chunk = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (chunk == MAP_FAILED)
+    return NULL;
+
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = ARENA_HEADER;
+
+  return chunk;
+}
+
+void
+arena_init (arena_t *arena)
+{
+  arena->chunks = NULL;
+  arena->used = 0;
+  arena->size = 0;
+}
+
+void
+arena_free (arena_t *arena)
+{
+  arena_chunk_t *chunk, *next;
+
+  for (chunk = arena->chunks; chunk; chunk = next)
+  {
+    next = chunk->next;
+    munmap (chunk, chunk->size);
+  }
+  arena_init (arena);
+}
+
+void *
+arena_alloc (arena_t *arena, size_t size)
+{
+  arena_chunk_t *chunk = arena->chunks;
+  void *ptr;
+
+  if (!size)
+    size = 1;
+  size = ARENA_ROUND (size, ARENA_ALIGN);
+
+  if (size > ARENA_BIG)
+  {
+    chunk = arena_chunk_new (ARENA_HEADER + size);
+    if (!chunk)
+      return NULL;
+    arena->size += chunk->size;
+
+    /* the current chunk keeps being filled */
+    if (arena->chunks)
+    {
+      chunk->next = arena->chunks->next;
+      arena->chunks->next = chunk;
+    }
+    else
+      arena->chunks = chunk;
+  }
+  else if (!chunk || chunk->used + size > chunk->size)
+  {
+    chunk = arena_chunk_new (ARENA_CHUNK_SIZE);
+    if (!chunk)
+      return NULL;
+    arena->size += chunk->size;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+  }
+
+  ptr = (char *) chunk + chunk->used;
+  chunk->used += size;
+  arena->used += size;
+
+  return ptr;
+}
+
+void
+arena_splice (arena_t *dst, arena_t *src)
+{
+  arena_chunk_t *last;
+
+  if (!src->chunks)
+    return;
+
+  for (last = src->chunks; last->next; last = last->next)
+    ;
+
+  if (dst->chunks)
+  {
+    last->next = dst->chunks->next;
+    dst->chunks->next = src->chunks;
+  }
+  else
+    dst->chunks = src->chunks;
+
+  dst->used += src->used;
+  dst->size += src->size;
+  arena_init (src);
+}
@@ -0,0 +1,45 @@
+/*
+ * arena.h : GeeXboX uShare bump allocator header.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+typedef struct arena_chunk_s arena_chunk_t;
+
+/* Memory handed out by bumping a pointer through chunks mapped from the
+ * system, and only given back all at once. Not thread safe : each thread
+ * fills its own, which are then spliced together. */
+typedef struct arena_s {
+  arena_chunk_t *chunks;        /* the one being filled first */
+  size_t used;                  /* bytes handed out */
+  size_t size;                  /* bytes mapped */
+} arena_t;
+
+void arena_init (arena_t *arena);
+void arena_free (arena_t *arena);
+
+/* Aligned as malloc () would, NULL if out of memory. */
+void *arena_alloc (arena_t *arena, size_t size);
+
+/* Move the chunks of src over to dst, src is left empty. */
+void arena_splice (arena_t *dst, arena_t *src);
+
+#endif /* _ARENA_H_ */
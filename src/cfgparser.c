@@ -107,6 +107,27 @@ ushare_set_interface (ushare_t *ut, const char *iface)
   ut->interface = strdup_trim (iface);
 }
 
+static content_list_t *
+content_add_dirlist (content_list_t *list, const char *dirlist)
+{
+  char *x = NULL, *token = NULL;
+  char *buffer;
+
+  x = strdup_trim (dirlist);
+  if (x)
+  {
+    token = strtok_r (x, USHARE_DIR_DELIM, &buffer);
+    while (token)
+    {
+      list = content_add (list, token);
+      token = strtok_r (NULL, USHARE_DIR_DELIM, &buffer);
+    }
+    free (x);
+  }
+
+  return list;
+}
+
 static void
 ushare_add_contentdir (ushare_t *ut, const char *dir)
 {
@@ -128,27 +149,48 @@ ushare_set_cfg_file (ushare_t *ut, const char *file)
 static void
 ushare_set_dir (ushare_t *ut, const char *dirlist)
 {
-  char *x = NULL, *token = NULL;
-  char *m_buffer = NULL, *buffer;
+  if (!ut || !dirlist)
+    return;
 
+  ut->contentlist = content_add_dirlist (ut->contentlist, dirlist);
+}
+
+static void
+ushare_set_lazy_dir (ushare_t *ut, const char *dirlist)
+{
   if (!ut || !dirlist)
     return;
 
-  x = strdup_trim (dirlist);
+  ut->lazylist = content_add_dirlist (ut->lazylist, dirlist);
+}
+
+static void
+ushare_set_lazy_depth (ushare_t *ut, const char *depth)
+{
+  if (!ut || !depth)
+    return;
+
+  ut->lazy_depth = atoi (depth);
+  if (ut->lazy_depth < 0 || ut->lazy_depth > MAX_USHARE_LAZY_DEPTH)
+  {
+    fprintf (stderr, _("Warning: lazy depth must be between 0 and %d.\n"),
+             MAX_USHARE_LAZY_DEPTH);
+    ut->lazy_depth = DEFAULT_USHARE_LAZY_DEPTH;
+  }
+}
+
+static void
+ushare_add_policy (ushare_t *ut, const char *line)
+{
+  char *x;
+
+  if (!ut || !line)
+    return;
+
+  x = strdup_trim (line);
   if (x)
   {
-    m_buffer = (char*) malloc (strlen (x) * sizeof (char));
-    if (m_buffer)
-    {
-      buffer = m_buffer;
-      token = strtok_r (x, USHARE_DIR_DELIM, &buffer);
-      while (token)
-      {
-        ushare_add_contentdir (ut, token);
-        token = strtok_r (NULL, USHARE_DIR_DELIM, &buffer);
-      }
-      free (m_buffer);
-    }
+    ut->policies = share_policy_add (ut->policies, x);
     free (x);
   }
 }
@@ -232,6 +274,157 @@ ushare_set_override_iconv_err (ushare_t *ut, const char *arg)
     ut->override_iconv_err = true;
 }
 
+static void
+ushare_set_scan_threads (ushare_t *ut, const char *threads)
+{
+  if (!ut || !threads)
+    return;
+
+  ut->scan_threads = atoi (threads);
+  if (ut->scan_threads < 0 || ut->scan_threads > MAX_USHARE_SCAN_THREADS)
+  {
+    fprintf (stderr, _("Warning: scan threads must be between 0 and %d.\n"),
+             MAX_USHARE_SCAN_THREADS);
+    ut->scan_threads = DEFAULT_USHARE_SCAN_THREADS;
+  }
+}
+
+static void
+ushare_set_scan_queue_depth (ushare_t *ut, const char *depth)
+{
+  if (!ut || !depth)
+    return;
+
+  ut->scan_queue_depth = atoi (depth);
+  if (ut->scan_queue_depth < 0
+      || ut->scan_queue_depth > MAX_USHARE_SCAN_QUEUE_DEPTH)
+  {
+    fprintf (stderr, _("Warning: scan queue depth must be between 0 and %d.\n"),
+             MAX_USHARE_SCAN_QUEUE_DEPTH);
+    ut->scan_queue_depth = DEFAULT_USHARE_SCAN_QUEUE_DEPTH;
+  }
+}
+
+static void
+ushare_set_index_file (ushare_t *ut, const char *file)
+{
+  if (!ut || !file)
+    return;
+
+  if (ut->index_file)
+  {
+    free (ut->index_file);
+    ut->index_file = NULL;
+  }
+
+  ut->index_file = strdup_trim (file);
+}
+
+static void
+ushare_set_checkpoint_interval (ushare_t *ut, const char *interval)
+{
+  if (!ut || !interval)
+    return;
+
+  ut->checkpoint_interval = atoi (interval);
+  if (ut->checkpoint_interval < 0
+      || ut->checkpoint_interval > MAX_USHARE_CHECKPOINT_INTERVAL)
+  {
+    fprintf (stderr, _("Warning: checkpoint interval must be between "
+                       "0 and %d seconds.\n"), MAX_USHARE_CHECKPOINT_INTERVAL);
+    ut->checkpoint_interval = DEFAULT_USHARE_CHECKPOINT_INTERVAL;
+  }
+}
+
+static void
+ushare_use_deferred_probe (ushare_t *ut, const char *val)
+{
+  if (!ut || !val)
+    return;
+
+  ut->probes.deferred = (!strcmp (val, "yes")) ? true : false;
+}
+
+static void
+ushare_use_scan_idle_io (ushare_t *ut, const char *val)
+{
+  if (!ut || !val)
+    return;
+
+  ut->scan_io.idle = (!strcmp (val, "yes")) ? true : false;
+}
+
+static void
+ushare_use_mmap_read (ushare_t *ut, const char *val)
+{
+  if (!ut || !val)
+    return;
+
+  ut->mmap_read = (!strcmp (val, "yes")) ? true : false;
+}
+
+static void
+ushare_set_stream_pool (ushare_t *ut, const char *count)
+{
+  if (!ut || !count)
+    return;
+
+  ut->stream_pool = atoi (count);
+  if (ut->stream_pool < 0 || ut->stream_pool > MAX_USHARE_STREAM_POOL)
+  {
+    fprintf (stderr, _("Warning: stream pool must be between 0 and %d.\n"),
+             MAX_USHARE_STREAM_POOL);
+    ut->stream_pool = DEFAULT_USHARE_STREAM_POOL;
+  }
+}
+
+static void
+ushare_set_read_cache (ushare_t *ut, const char *size)
+{
+  if (!ut || !size)
+    return;
+
+  ut->read_cache_size = atoi (size);
+  if (ut->read_cache_size < 0 || ut->read_cache_size > MAX_USHARE_READ_CACHE)
+  {
+    fprintf (stderr, _("Warning: read cache must be between 0 and %d MB.\n"),
+             MAX_USHARE_READ_CACHE);
+    ut->read_cache_size = DEFAULT_USHARE_READ_CACHE;
+  }
+}
+
+static void
+ushare_set_scan_rate (ushare_t *ut, const char *rate)
+{
+  if (!ut || !rate)
+    return;
+
+  ut->scan_io.rate = atoi (rate);
+  if (ut->scan_io.rate < 0 || ut->scan_io.rate > MAX_USHARE_SCAN_RATE)
+  {
+    fprintf (stderr, _("Warning: scan rate must be between 0 and %d.\n"),
+             MAX_USHARE_SCAN_RATE);
+    ut->scan_io.rate = DEFAULT_USHARE_SCAN_RATE;
+  }
+}
+
+static void
+ushare_set_scan_stream_rate (ushare_t *ut, const char *rate)
+{
+  if (!ut || !rate)
+    return;
+
+  ut->scan_io.stream_rate = atoi (rate);
+  if (ut->scan_io.stream_rate < 0
+      || ut->scan_io.stream_rate > MAX_USHARE_SCAN_RATE)
+  {
+    fprintf (stderr,
+             _("Warning: scan stream rate must be between 0 and %d.\n"),
+             MAX_USHARE_SCAN_RATE);
+    ut->scan_io.stream_rate = DEFAULT_USHARE_SCAN_STREAM_RATE;
+  }
+}
+
 static u_configline_t configline[] = {
   { USHARE_NAME,                 ushare_set_name                },
   { USHARE_IFACE,                ushare_set_interface           },
@@ -243,6 +436,20 @@ static u_configline_t configline[] = {
   { USHARE_ENABLE_TELNET,        ushare_use_telnet              },
   { USHARE_ENABLE_XBOX,          ushare_use_xbox                },
   { USHARE_ENABLE_DLNA,          ushare_use_dlna                },
+  { USHARE_SCAN_THREADS,         ushare_set_scan_threads        },
+  { USHARE_INDEX_FILE,           ushare_set_index_file          },
+  { USHARE_SCAN_QUEUE_DEPTH,     ushare_set_scan_queue_depth    },
+  { USHARE_LAZY_DIR,             ushare_set_lazy_dir            },
+  { USHARE_LAZY_DEPTH,           ushare_set_lazy_depth          },
+  { USHARE_DEFERRED_PROBE,       ushare_use_deferred_probe      },
+  { USHARE_SCAN_IDLE_IO,         ushare_use_scan_idle_io        },
+  { USHARE_SCAN_RATE,            ushare_set_scan_rate           },
+  { USHARE_SCAN_STREAM_RATE,     ushare_set_scan_stream_rate    },
+  { USHARE_POLICY,               ushare_add_policy              },
+  { USHARE_CHECKPOINT_INTERVAL,  ushare_set_checkpoint_interval },
+  { USHARE_MMAP_READ,            ushare_use_mmap_read           },
+  { USHARE_STREAM_POOL,          ushare_set_stream_pool         },
+  { USHARE_READ_CACHE,           ushare_set_read_cache          },
   { NULL,                        NULL                           },
 };
 
@@ -332,6 +539,7 @@ display_usage (void)
   printf (_(" -x, --xbox\t\tUse XboX 360 compliant profile\n"));
   printf (_(" -d, --dlna\t\tUse DLNA compliant profile (PlayStation3 needs this)\n"));
   printf (_(" -D, --daemon\t\tRun as a daemon\n"));
+  printf (_(" -b, --benchmark-scan\tScan the shares without serving them, and report how fast\n"));
   printf (_(" -V, --version\t\tDisplay the version of uShare and exit\n"));
   printf (_(" -h, --help\t\tDisplay this help\n"));
 }
@@ -340,12 +548,13 @@ int
 parse_command_line (ushare_t *ut, int argc, char **argv)
 {
   int c, index;
-  char short_options[] = "VhvDowtxdn:i:p:q:c:f:";
+  char short_options[] = "VhvDbowtxdn:i:p:q:c:f:";
   struct option long_options [] = {
     {"version", no_argument, 0, 'V' },
     {"help", no_argument, 0, 'h' },
     {"verbose", no_argument, 0, 'v' },
     {"daemon", no_argument, 0, 'D' },
+    {"benchmark-scan", no_argument, 0, 'b' },
     {"override-iconv-err", no_argument, 0, 'o' },
     {"name", required_argument, 0, 'n' },
     {"interface", required_argument, 0, 'i' },
@@ -391,6 +600,10 @@ parse_command_line (ushare_t *ut, int argc, char **argv)
       ut->daemon = true;
       break;
 
+    case 'b':
+      ut->benchmark = true;
+      break;
+
     case 'o':
       ut->override_iconv_err = true;
       break;
@@ -33,9 +33,38 @@
 #define USHARE_ENABLE_TELNET      "USHARE_ENABLE_TELNET"
 #define USHARE_ENABLE_XBOX        "USHARE_ENABLE_XBOX"
 #define USHARE_ENABLE_DLNA        "USHARE_ENABLE_DLNA"
+#define USHARE_SCAN_THREADS       "USHARE_SCAN_THREADS"
+#define USHARE_INDEX_FILE         "USHARE_INDEX_FILE"
+#define USHARE_SCAN_QUEUE_DEPTH   "USHARE_SCAN_QUEUE_DEPTH"
+#define USHARE_LAZY_DIR           "USHARE_LAZY_DIR"
+#define USHARE_LAZY_DEPTH         "USHARE_LAZY_DEPTH"
+#define USHARE_DEFERRED_PROBE     "USHARE_DEFERRED_PROBE"
+#define USHARE_SCAN_IDLE_IO       "USHARE_SCAN_IDLE_IO"
+#define USHARE_SCAN_RATE          "USHARE_SCAN_RATE"
+#define USHARE_SCAN_STREAM_RATE   "USHARE_SCAN_STREAM_RATE"
+#define USHARE_POLICY             "USHARE_POLICY"
+#define USHARE_CHECKPOINT_INTERVAL "USHARE_CHECKPOINT_INTERVAL"
+#define USHARE_MMAP_READ          "USHARE_MMAP_READ"
+#define USHARE_STREAM_POOL        "USHARE_STREAM_POOL"
+#define USHARE_READ_CACHE         "USHARE_READ_CACHE"
 
 #define USHARE_CONFIG_FILE        "ushare.conf"
 #define DEFAULT_USHARE_NAME       "uShare"
+#define DEFAULT_USHARE_SCAN_THREADS 0
+#define MAX_USHARE_SCAN_THREADS   64
+#define DEFAULT_USHARE_SCAN_QUEUE_DEPTH 32
+#define MAX_USHARE_SCAN_QUEUE_DEPTH 4096
+#define DEFAULT_USHARE_LAZY_DEPTH 1
+#define MAX_USHARE_LAZY_DEPTH     16
+#define DEFAULT_USHARE_SCAN_RATE  0
+#define DEFAULT_USHARE_SCAN_STREAM_RATE 50
+#define MAX_USHARE_SCAN_RATE      100000
+#define DEFAULT_USHARE_CHECKPOINT_INTERVAL 300
+#define MAX_USHARE_CHECKPOINT_INTERVAL 86400
+#define DEFAULT_USHARE_STREAM_POOL 32
+#define MAX_USHARE_STREAM_POOL    4096
+#define DEFAULT_USHARE_READ_CACHE 0
+#define MAX_USHARE_READ_CACHE     4096
 
 #if (defined(BSD) || defined(__FreeBSD__))
 #define DEFAULT_USHARE_IFACE      "lnc0"
@@ -21,8 +21,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 
 #include "content.h"
+#include "gettext.h"
 
 content_list_t *
 content_add (content_list_t *list, const char *item)
@@ -73,6 +75,81 @@ content_del (content_list_t *list, int n)
   return list;
 }
 
+content_list_t *
+content_dup (const content_list_t *list)
+{
+  content_list_t *dup;
+  int i;
+
+  if (!list)
+    return NULL;
+
+  dup = content_add (NULL, NULL);
+  for (i = 0 ; i < list->count ; i++)
+    dup = content_add (dup, list->content[i]);
+
+  return dup;
+}
+
+/*
+ * Remove the contents lying within another one, or the same as another
+ * one, whose files would otherwise be published twice. Contents which
+ * can't be resolved yet are kept as they are.
+ */
+content_list_t *
+content_drop_nested (content_list_t *list)
+{
+  char **real;
+  int i, j;
+
+  if (!list || list->count < 2)
+    return list;
+
+  real = calloc (list->count, sizeof (char *));
+  if (!real)
+    return list;
+
+  for (i = 0 ; i < list->count ; i++)
+  {
+    char path[PATH_MAX];
+
+    if (realpath (list->content[i], path))
+      real[i] = strdup (path);
+  }
+
+  for (i = list->count - 1 ; i >= 0 ; i--)
+    for (j = 0 ; j < list->count && real[i] ; j++)
+    {
+      size_t len;
+
+      if (j == i || !real[j])
+        continue;
+
+      /* the first of identical contents stays */
+      len = strlen (real[j]);
+      if (strncmp (real[i], real[j], len)
+          || (real[i][len] != '/' && real[i][len] != '\0'
+              && strcmp (real[j], "/"))
+          || (real[i][len] == '\0' && j > i))
+        continue;
+
+      fprintf (stderr, _("Warning: %s is shared as part of %s already.\n"),
+               list->content[i], list->content[j]);
+      free (real[i]);
+      memmove (&real[i], &real[i + 1], (list->count - i - 1) * sizeof (char *));
+      real[list->count - 1] = NULL;
+      content_del (list, i);
+      break;
+    }
+
+  for (i = 0 ; i < list->count ; i++)
+    if (real[i])
+      free (real[i]);
+  free (real);
+
+  return list;
+}
+
 void
 content_free (content_list_t *list)
 {
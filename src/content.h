@@ -30,6 +30,9 @@ content_list_t *content_add (content_list_t *list, const char *item)
     __attribute__ ((malloc));
 content_list_t *content_del (content_list_t *list, int n)
     __attribute__ ((nonnull));
+content_list_t *content_dup (const content_list_t *list)
+    __attribute__ ((malloc));
+content_list_t *content_drop_nested (content_list_t *list);
 void content_free (content_list_t *list)
     __attribute__ ((nonnull));
 
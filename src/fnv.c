@@ -0,0 +1,34 @@
+/*
+ * fnv.c : GeeXboX uShare FNV-1a hash.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "fnv.h"
+
+uint32_t
+fnv1a (uint32_t hash, const void *data, size_t len)
+{
+  const unsigned char *p = data;
+
+  while (len--)
+  {
+    hash ^= *p++;
+    hash *= FNV_PRIME;
+  }
+
+  return hash;
+}
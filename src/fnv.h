@@ -0,0 +1,32 @@
+/*
+ * fnv.h : GeeXboX uShare FNV-1a hash header.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _FNV_H_
+#define _FNV_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FNV_OFFSET_BASIS 2166136261U
+#define FNV_PRIME        16777619U
+
+/* Hash len bytes of data on top of hash, FNV_OFFSET_BASIS to start. */
+uint32_t fnv1a (uint32_t hash, const void *data, size_t len);
+
+#endif /* _FNV_H_ */
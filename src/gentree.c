@@ -0,0 +1,386 @@
+/*
+ * gentree.c : GeeXboX uShare synthetic media tree generator.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Builds a reproducible directory tree to compare scanner changes on,
+ * along with ushare --benchmark-scan. The same options and seed always
+ * give the same tree, whatever the platform.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define GENTREE_DEFAULT_EXTENSIONS "mp3,flac,avi,mkv,mp4,jpg,txt"
+#define GENTREE_NAME_CHARS "abcdefghijklmnopqrstuvwxyz0123456789 _-"
+#define GENTREE_NAME_MAX 255
+#define GENTREE_RETRIES 8
+
+typedef enum {
+  NAMES_UNIFORM,                /* any length between min and max */
+  NAMES_SHORT,                  /* mostly close to min */
+  NAMES_LONG,                   /* mostly close to max */
+} name_dist_t;
+
+typedef struct gentree_s {
+  int depth;                    /* levels of sub-directories */
+  int fanout;                   /* sub-directories per directory */
+  int files;                    /* files per directory */
+  int min_len;
+  int max_len;
+  name_dist_t dist;
+  char **extensions;
+  int nr_extensions;
+  off_t size;                   /* of every file, sparse */
+  uint64_t state;               /* of the random generator */
+  unsigned long nr_dirs;
+  unsigned long nr_files;
+} gentree_t;
+
+/* xorshift64*, so that the tree doesn't depend on the libc's rand (). */
+static uint64_t
+gentree_random (gentree_t *g)
+{
+  g->state ^= g->state >> 12;
+  g->state ^= g->state << 25;
+  g->state ^= g->state >> 27;
+
+  return g->state * 2685821657736338717ULL;
+}
+
+static int
+gentree_range (gentree_t *g, int min, int max)
+{
+  return min + (int) (gentree_random (g) % (uint64_t) (max - min + 1));
+}
+
+static int
+gentree_name_len (gentree_t *g)
+{
+  int a, b;
+
+  a = gentree_range (g, g->min_len, g->max_len);
+  if (g->dist == NAMES_UNIFORM)
+    return a;
+
+  b = gentree_range (g, g->min_len, g->max_len);
+  if (g->dist == NAMES_SHORT)
+    return a < b ? a : b;
+
+  return a > b ? a : b;
+}
+
+/* Random name of len characters, not starting or ending with a space,
+ * and not starting with a dot, which the scanner would skip. */
+static void
+gentree_name (gentree_t *g, char *name, int len, const char *ext)
+{
+  static const char chars[] = GENTREE_NAME_CHARS;
+  int i;
+
+  for (i = 0; i < len; i++)
+  {
+    char c = chars[gentree_random (g) % (sizeof (chars) - 1)];
+
+    if (c == ' ' && (i == 0 || i == len - 1))
+      c = 'x';
+    name[i] = c;
+  }
+  name[len] = '\0';
+
+  if (ext)
+  {
+    strcat (name, ".");
+    strcat (name, ext);
+  }
+}
+
+static bool
+gentree_file (gentree_t *g, const char *path)
+{
+  int fd;
+
+  fd = open (path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd < 0)
+    return false;
+
+  if (g->size && ftruncate (fd, g->size) < 0)
+    perror (path);
+  close (fd);
+  g->nr_files++;
+
+  return true;
+}
+
+static int
+gentree_dir (gentree_t *g, char *path, size_t len, int level)
+{
+  char name[GENTREE_NAME_MAX + 1];
+  int i, retry;
+
+  for (i = 0; i < g->files; i++)
+  {
+    const char *ext = g->extensions[gentree_random (g) % g->nr_extensions];
+    int max = GENTREE_NAME_MAX - strlen (ext) - 1;
+
+    for (retry = 0; retry < GENTREE_RETRIES; retry++)
+    {
+      int name_len = gentree_name_len (g);
+
+      gentree_name (g, name, name_len < max ? name_len : max, ext);
+      if (len + strlen (name) + 2 > PATH_MAX)
+        break;
+      sprintf (path + len, "/%s", name);
+      if (gentree_file (g, path))
+        break;
+      if (errno != EEXIST)
+      {
+        perror (path);
+        return -1;
+      }
+    }
+  }
+
+  if (level == g->depth)
+    return 0;
+
+  for (i = 0; i < g->fanout; i++)
+  {
+    for (retry = 0; retry < GENTREE_RETRIES; retry++)
+    {
+      gentree_name (g, name, gentree_name_len (g), NULL);
+      if (len + strlen (name) + 2 > PATH_MAX)
+        break;
+      sprintf (path + len, "/%s", name);
+      if (!mkdir (path, 0755))
+        break;
+      if (errno != EEXIST)
+      {
+        perror (path);
+        return -1;
+      }
+    }
+    if (retry == GENTREE_RETRIES || len + strlen (name) + 2 > PATH_MAX)
+      continue;
+
+    g->nr_dirs++;
+    if (gentree_dir (g, path, len + strlen (name) + 1, level + 1) < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+static bool
+gentree_set_extensions (gentree_t *g, const char *list)
+{
+  char *copy, *token, *buffer;
+
+  copy = strdup (list);
+  if (!copy)
+    return false;
+
+  for (token = strtok_r (copy, ",", &buffer); token;
+       token = strtok_r (NULL, ",", &buffer))
+  {
+    char **extensions;
+
+    extensions = realloc (g->extensions,
+                          (g->nr_extensions + 1) * sizeof (char *));
+    if (!extensions)
+      break;
+    g->extensions = extensions;
+    g->extensions[g->nr_extensions] = strdup (*token == '.' ? token + 1 : token);
+    if (g->extensions[g->nr_extensions])
+      g->nr_extensions++;
+  }
+  free (copy);
+
+  return g->nr_extensions > 0;
+}
+
+static off_t
+gentree_parse_size (const char *value)
+{
+  char *end;
+  long long size;
+
+  size = strtoll (value, &end, 10);
+  if (end == value || size < 0)
+    return -1;
+
+  switch (*end)
+  {
+  case 'G': case 'g':
+    size *= 1024;
+    /* fall through */
+  case 'M': case 'm':
+    size *= 1024;
+    /* fall through */
+  case 'K': case 'k':
+    size *= 1024;
+    end++;
+  }
+
+  return *end ? -1 : (off_t) size;
+}
+
+static void
+display_usage (void)
+{
+  printf ("Usage: gentree [options] directory\n");
+  printf ("Options:\n");
+  printf (" -d, --depth=N\t\tLevels of sub-directories (default 3)\n");
+  printf (" -f, --fanout=N\t\tSub-directories per directory (default 4)\n");
+  printf (" -n, --files=N\t\tFiles per directory (default 50)\n");
+  printf (" -l, --length=MIN-MAX\tName lengths, extension left out "
+          "(default 8-32)\n");
+  printf (" -D, --dist=DIST\tName lengths distribution : uniform, short "
+          "or long\n");
+  printf (" -e, --ext=LIST\t\tFile extensions, picked at random (default "
+          "%s)\n", GENTREE_DEFAULT_EXTENSIONS);
+  printf (" -s, --size=SIZE\tSize of every file, sparse, with an optional "
+          "K, M or G suffix\n");
+  printf (" -r, --seed=N\t\tSeed of the random names (default 1)\n");
+  printf (" -h, --help\t\tDisplay this help\n");
+}
+
+int
+main (int argc, char **argv)
+{
+  gentree_t g;
+  char path[PATH_MAX];
+  const char *extensions = GENTREE_DEFAULT_EXTENSIONS;
+  unsigned long long seed = 1;
+  int c, i, err;
+  struct option long_options [] = {
+    {"depth", required_argument, 0, 'd' },
+    {"fanout", required_argument, 0, 'f' },
+    {"files", required_argument, 0, 'n' },
+    {"length", required_argument, 0, 'l' },
+    {"dist", required_argument, 0, 'D' },
+    {"ext", required_argument, 0, 'e' },
+    {"size", required_argument, 0, 's' },
+    {"seed", required_argument, 0, 'r' },
+    {"help", no_argument, 0, 'h' },
+    {0, 0, 0, 0 }
+  };
+
+  memset (&g, 0, sizeof (g));
+  g.depth = 3;
+  g.fanout = 4;
+  g.files = 50;
+  g.min_len = 8;
+  g.max_len = 32;
+  g.dist = NAMES_UNIFORM;
+
+  while ((c = getopt_long (argc, argv, "d:f:n:l:D:e:s:r:h",
+                           long_options, NULL)) != EOF)
+  {
+    switch (c)
+    {
+    case 'd':
+      g.depth = atoi (optarg);
+      break;
+    case 'f':
+      g.fanout = atoi (optarg);
+      break;
+    case 'n':
+      g.files = atoi (optarg);
+      break;
+    case 'l':
+      if (sscanf (optarg, "%d-%d", &g.min_len, &g.max_len) != 2)
+        g.min_len = g.max_len = atoi (optarg);
+      break;
+    case 'D':
+      if (!strcmp (optarg, "short"))
+        g.dist = NAMES_SHORT;
+      else if (!strcmp (optarg, "long"))
+        g.dist = NAMES_LONG;
+      else if (!strcmp (optarg, "uniform"))
+        g.dist = NAMES_UNIFORM;
+      else
+      {
+        fprintf (stderr, "Unknown name length distribution %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'e':
+      extensions = optarg;
+      break;
+    case 's':
+      g.size = gentree_parse_size (optarg);
+      if (g.size < 0)
+      {
+        fprintf (stderr, "Invalid size %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'r':
+      seed = strtoull (optarg, NULL, 10);
+      break;
+    default:
+      display_usage ();
+      return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if (optind != argc - 1 || g.depth < 0 || g.fanout < 0 || g.files < 0
+      || g.min_len < 1 || g.max_len < g.min_len
+      || g.max_len > GENTREE_NAME_MAX - 8)
+  {
+    display_usage ();
+    return EXIT_FAILURE;
+  }
+
+  if (!gentree_set_extensions (&g, extensions))
+  {
+    fprintf (stderr, "No file extension given\n");
+    return EXIT_FAILURE;
+  }
+
+  /* a zero state would stay zero */
+  g.state = seed ? seed : 1;
+
+  snprintf (path, sizeof (path), "%s", argv[optind]);
+  if (mkdir (path, 0755) < 0 && errno != EEXIST)
+  {
+    perror (path);
+    return EXIT_FAILURE;
+  }
+
+  err = gentree_dir (&g, path, strlen (path), 0);
+  printf ("Created %lu directories and %lu files under %s\n",
+          g.nr_dirs, g.nr_files, argv[optind]);
+
+  for (i = 0; i < g.nr_extensions; i++)
+    free (g.extensions[i]);
+  free (g.extensions);
+
+  return err < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
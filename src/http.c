@@ -24,12 +24,16 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/mman.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 
+#include "http.h"
 #include "metadata.h"
+#include "readcache.h"
 #include "minmax.h"
 #include "trace.h"
 #include "presentation.h"
@@ -39,11 +43,26 @@
 #define PROTOCOL_TYPE_PRE_SZ  11   /* for the str length of "http-get:*:" */
 #define PROTOCOL_TYPE_SUFF_SZ 2    /* for the str length of ":*" */
 
+/* Span of a media file mapped at once, and how far ahead of the
+ * playback position the kernel is asked to read */
+#define HTTP_MAP_WINDOW (8 * 1024 * 1024)
+#define HTTP_MAP_AHEAD (2 * 1024 * 1024)
+
+/* Pooled buffers hold the pages built in memory, those bigger are
+ * allocated */
+#define HTTP_BUFFER_SIZE (64 * 1024)
+
 typedef struct web_file_s {
-  char *fullpath;
+  char fullpath[PATH_MAX];
   off_t pos;
-  char *contents;
+  char *contents;               /* NULL for a media file */
   off_t len;
+  int fd;                       /* of a media file, -1 otherwise */
+  read_key_t key;
+  char *map;                    /* window of a media file, if mapped */
+  off_t map_start;
+  size_t map_len;
+  off_t advised;                /* readahead asked for up to there */
 } web_file_t;
 
 static inline void
@@ -88,26 +107,172 @@ http_get_info (const char *filename, dlna_http_file_info_t *info)
   return 1;
 }
 
+static off_t
+http_page_size (void)
+{
+  static off_t page;
+
+  if (!page)
+  {
+    long size = sysconf (_SC_PAGESIZE);
+    page = size > 0 ? size : 4096;
+  }
+
+  return page;
+}
+
+static void
+http_unmap (web_file_t *file)
+{
+  if (file->map)
+    munmap (file->map, file->map_len);
+  file->map = NULL;
+  file->map_len = 0;
+}
+
+/* Handles come from the pool while there are some left, so that opening
+ * a file doesn't allocate. */
+static web_file_t *
+web_file_new (void)
+{
+  extern ushare_t *ut;
+  web_file_t *file;
+
+  file = pool_get (&ut->stream_handles);
+  if (!file)
+    file = malloc (sizeof (web_file_t));
+  if (!file)
+    return NULL;
+
+  *file->fullpath = '\0';
+  file->pos = 0;
+  file->contents = NULL;
+  file->len = 0;
+  file->fd = -1;
+  file->map = NULL;
+  file->map_len = 0;
+
+  return file;
+}
+
+static void
+web_file_free (web_file_t *file)
+{
+  extern ushare_t *ut;
+
+  if (file->contents)
+  {
+    if (pool_owns (&ut->stream_buffers, file->contents))
+      pool_put (&ut->stream_buffers, file->contents);
+    else
+      free (file->contents);
+  }
+  http_unmap (file);
+  if (file->fd >= 0)
+    close (file->fd);
+
+  if (pool_owns (&ut->stream_handles, file))
+    pool_put (&ut->stream_handles, file);
+  else
+    free (file);
+}
+
 static dlna_http_file_handler_t *
 get_file_memory (const char *fullpath, const char *description,
                  const size_t length)
 {
+  extern ushare_t *ut;
   dlna_http_file_handler_t *dhdl;
   web_file_t *file;
 
-  file = malloc (sizeof (web_file_t));
-  file->fullpath = strdup (fullpath);
-  file->pos = 0;
-  file->contents = strdup (description);
+  file = web_file_new ();
+  if (!file)
+    return NULL;
+
+  snprintf (file->fullpath, sizeof (file->fullpath), "%s", fullpath);
+  if (length < HTTP_BUFFER_SIZE)
+    file->contents = pool_get (&ut->stream_buffers);
+  if (!file->contents)
+    file->contents = malloc (length + 1);
+  if (!file->contents)
+  {
+    web_file_free (file);
+    return NULL;
+  }
+  memcpy (file->contents, description, length);
+  file->contents[length] = '\0';
   file->len = length;
 
+  /* libdlna frees it along with the request */
   dhdl                       = malloc (sizeof (dlna_http_file_handler_t));
+  if (!dhdl)
+  {
+    web_file_free (file);
+    return NULL;
+  }
   dhdl->external             = 1;
   dhdl->priv                 = file;
   
   return ((dlna_http_file_handler_t *) dhdl);
 }
 
+/* Media files are read by uShare itself rather than by libdlna, the id in
+ * the URL leading to the path the file was published from. NULL if the
+ * file is left to libdlna, while a scan holds the tree for instance. */
+static dlna_http_file_handler_t *
+get_file_media (const char *filename)
+{
+  extern ushare_t *ut;
+  dlna_http_file_handler_t *dhdl;
+  web_file_t *file;
+  const char *id;
+  char *end;
+  struct stat st;
+
+  file = web_file_new ();
+  if (!file)
+    return NULL;
+
+  id = filename + strlen (VIRTUAL_DIR) + 1;
+  if (!metadata_resource_path (ut, strtoul (id, &end, 10),
+                               file->fullpath, sizeof (file->fullpath)))
+  {
+    web_file_free (file);
+    return NULL;
+  }
+
+  file->fd = open (file->fullpath, O_RDONLY | O_CLOEXEC);
+  if (file->fd < 0 || fstat (file->fd, &st) < 0 || !S_ISREG (st.st_mode))
+  {
+    log_verbose ("%s: cannot open: %s\n", file->fullpath, strerror (errno));
+    web_file_free (file);
+    return NULL;
+  }
+  file->len = st.st_size;
+  file->key.dev = st.st_dev;
+  file->key.ino = st.st_ino;
+  file->key.mtime = st.st_mtime;
+  file->key.size = st.st_size;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+  /* a larger readahead window, players read on from where they are */
+  posix_fadvise (file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif /* POSIX_FADV_SEQUENTIAL */
+
+  /* libdlna frees it along with the request */
+  dhdl = malloc (sizeof (dlna_http_file_handler_t));
+  if (!dhdl)
+  {
+    web_file_free (file);
+    return NULL;
+  }
+
+  dhdl->external = 1;
+  dhdl->priv = file;
+
+  return dhdl;
+}
+
 static dlna_http_file_handler_t *
 http_open (const char *filename)
 {
@@ -123,9 +288,90 @@ http_open (const char *filename)
     return get_file_memory (USHARE_PRESENTATION_PAGE, ut->presentation->buf,
                             ut->presentation->len);
 
+  if (!strncmp (filename, VIRTUAL_DIR "/", strlen (VIRTUAL_DIR) + 1))
+  {
+    scan_io_stream (&ut->scan_io);
+    return get_file_media (filename);
+  }
+
   return NULL;
 }
 
+/* Map the window starting at the page the position is on. Windows slide
+ * along with playback, what is behind being let go with the previous
+ * one. */
+static bool
+http_map (web_file_t *file)
+{
+  off_t start;
+  size_t len;
+  void *map;
+
+  http_unmap (file);
+
+  start = file->pos & ~(http_page_size () - 1);
+  len = (size_t) MIN (HTTP_MAP_WINDOW, file->len - start);
+  map = mmap (NULL, len, PROT_READ, MAP_SHARED, file->fd, start);
+  if (map == MAP_FAILED)
+  {
+    log_verbose ("%s: cannot map: %s\n", file->fullpath, strerror (errno));
+    return false;
+  }
+
+#ifdef MADV_SEQUENTIAL
+  madvise (map, len, MADV_SEQUENTIAL);
+#endif /* MADV_SEQUENTIAL */
+
+  file->map = map;
+  file->map_start = start;
+  file->map_len = len;
+  file->advised = start;
+
+  return true;
+}
+
+/* Copy from the mapped window, -1 if it cannot be mapped. */
+static ssize_t
+http_read_map (web_file_t *file, char *buf, size_t buflen)
+{
+  off_t page = http_page_size ();
+  off_t at, end, ahead;
+
+  if (file->pos >= file->len)
+    return 0;
+
+  /* a new window once the readahead would go past the end of this one,
+   * or when seeked out of it */
+  end = file->map_start + file->map_len;
+  if (!file->map || file->pos < file->map_start || file->pos >= end
+      || (file->pos + HTTP_MAP_AHEAD > end && end < file->len))
+  {
+    if (!http_map (file))
+      return -1;
+    end = file->map_start + file->map_len;
+  }
+
+  /* readahead is asked for a piece at a time, not on every read */
+  at = file->pos & ~(page - 1);
+  if (file->advised < at || file->advised > file->pos + HTTP_MAP_AHEAD)
+    file->advised = at;
+  if (file->pos + HTTP_MAP_AHEAD / 2 > file->advised)
+  {
+    ahead = MIN ((file->pos + HTTP_MAP_AHEAD) & ~(page - 1), end);
+#ifdef MADV_WILLNEED
+    if (ahead > file->advised)
+      madvise (file->map + (file->advised - file->map_start),
+               (size_t) (ahead - file->advised), MADV_WILLNEED);
+#endif /* MADV_WILLNEED */
+    file->advised = ahead;
+  }
+
+  buflen = (size_t) MIN ((off_t) buflen, end - file->pos);
+  memcpy (buf, file->map + (file->pos - file->map_start), buflen);
+
+  return buflen;
+}
+
 static int
 http_read (void *hdl, char *buf, size_t buflen)
 {
@@ -137,8 +383,25 @@ http_read (void *hdl, char *buf, size_t buflen)
   if (!file)
     return -1;
 
-  len = (size_t) MIN (buflen, file->len - file->pos);
-  memcpy (buf, file->contents + file->pos, (size_t) len);
+  if (file->fd >= 0)
+  {
+    extern ushare_t *ut;
+
+    if (__atomic_load_n (&ut->mmap_read, __ATOMIC_RELAXED))
+      len = http_read_map (file, buf, buflen);
+
+    /* straight to the buffer of the web server, at whatever size it
+     * reads by, through the chunks shared by the streams of the file */
+    if (len < 0)
+      len = read_cache_read (&ut->read_cache, file->fd, &file->key,
+                             buf, buflen, file->pos);
+    scan_io_stream_alive (&ut->scan_io);
+  }
+  else
+  {
+    len = (size_t) MIN (buflen, file->len - file->pos);
+    memcpy (buf, file->contents + file->pos, (size_t) len);
+  }
 
   if (len >= 0)
     file->pos += len;
@@ -200,16 +463,22 @@ http_close (void *hdl)
   if (!file)
     return -1;
 
-  if (file->contents)
-    free (file->contents);
-
-  if (file->fullpath)
-    free (file->fullpath);
-  free (file);
+  web_file_free (file);
 
   return 0;
 }
 
+/**
+ * http_pools_init: allocate the stream handles and buffers, count of
+ *  each, as configured. Opening files allocates once they are all in use.
+ */
+bool
+http_pools_init (ushare_t *ut, unsigned int count)
+{
+  return pool_init (&ut->stream_handles, sizeof (web_file_t), count)
+    && pool_init (&ut->stream_buffers, HTTP_BUFFER_SIZE, count);
+}
+
 dlna_http_callback_t ushare_http_callbacks = {
   http_get_info,
   http_open,
@@ -0,0 +1,29 @@
+/*
+ * http.h : GeeXboX uShare HTTP callbacks header.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _HTTP_H_
+#define _HTTP_H_
+
+#include <stdbool.h>
+
+#include "ushare.h"
+
+bool http_pools_init (ushare_t *ut, unsigned int count);
+
+#endif /* _HTTP_H_ */
@@ -0,0 +1,135 @@
+/*
+ * inoset.c : GeeXboX uShare set of (device, inode) pairs.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "inoset.h"
+
+#define INO_SET_DEFAULT_SIZE 64
+
+void
+ino_set_init (ino_set_t *set)
+{
+  set->slots = NULL;
+  set->size = 0;
+  set->count = 0;
+}
+
+void
+ino_set_free (ino_set_t *set)
+{
+  if (set->slots)
+    free (set->slots);
+  ino_set_init (set);
+}
+
+static size_t
+ino_set_hash (dev_t dev, ino_t ino)
+{
+  uint64_t h = (uint64_t) ino * 0x9e3779b97f4a7c15ULL;
+
+  return (size_t) ((h ^ (h >> 29)) + (uint64_t) dev * 0xff51afd7ed558ccdULL);
+}
+
+/* Slot of (dev, ino), or the free one it would go to. */
+static ino_slot_t *
+ino_set_lookup (ino_slot_t *slots, size_t size, dev_t dev, ino_t ino)
+{
+  size_t i = ino_set_hash (dev, ino) & (size - 1);
+
+  while (slots[i].ino && (slots[i].ino != ino || slots[i].dev != dev))
+    i = (i + 1) & (size - 1);
+
+  return &slots[i];
+}
+
+static bool
+ino_set_grow (ino_set_t *set)
+{
+  size_t size = set->size ? 2 * set->size : INO_SET_DEFAULT_SIZE;
+  ino_slot_t *slots;
+  size_t i;
+
+  slots = calloc (size, sizeof (ino_slot_t));
+  if (!slots)
+    return false;
+
+  for (i = 0; i < set->size; i++)
+    if (set->slots[i].ino)
+      *ino_set_lookup (slots, size, set->slots[i].dev, set->slots[i].ino) =
+        set->slots[i];
+
+  if (set->slots)
+    free (set->slots);
+  set->slots = slots;
+  set->size = size;
+
+  return true;
+}
+
+/* Slot (dev, ino) is in, added if need be, NULL if there's no room. */
+static ino_slot_t *
+ino_set_insert (ino_set_t *set, dev_t dev, ino_t ino, bool *added)
+{
+  ino_slot_t *slot;
+
+  /* keep the load under 3/4 */
+  if (4 * (set->count + 1) > 3 * set->size && !ino_set_grow (set))
+    return NULL;
+
+  slot = ino_set_lookup (set->slots, set->size, dev, ino);
+  *added = !slot->ino;
+  if (*added)
+  {
+    slot->dev = dev;
+    slot->ino = ino;
+    slot->owner = NULL;
+    set->count++;
+  }
+
+  return slot;
+}
+
+bool
+ino_set_add (ino_set_t *set, dev_t dev, ino_t ino)
+{
+  bool added;
+
+  /* no such inode, and nothing to tell apart without memory */
+  if (!ino || !ino_set_insert (set, dev, ino, &added))
+    return true;
+
+  return added;
+}
+
+void *
+ino_set_claim (ino_set_t *set, dev_t dev, ino_t ino, void *owner)
+{
+  ino_slot_t *slot;
+  bool added;
+
+  if (!ino || !(slot = ino_set_insert (set, dev, ino, &added)))
+    return owner;
+
+  if (added)
+    slot->owner = owner;
+
+  return slot->owner;
+}
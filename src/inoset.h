@@ -0,0 +1,50 @@
+/*
+ * inoset.h : GeeXboX uShare set of (device, inode) pairs header.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _INOSET_H_
+#define _INOSET_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+typedef struct ino_slot_s {
+  dev_t dev;
+  ino_t ino;                    /* 0 for a free slot */
+  void *owner;                  /* see ino_set_claim () */
+} ino_slot_t;
+
+/* Open addressed hash set, telling files and directories apart whatever
+ * the path they are reached through. */
+typedef struct ino_set_s {
+  ino_slot_t *slots;
+  size_t size;                  /* a power of two, or 0 */
+  size_t count;
+} ino_set_t;
+
+void ino_set_init (ino_set_t *set);
+void ino_set_free (ino_set_t *set);
+
+/* Add (dev, ino) to set, false if it was in already. */
+bool ino_set_add (ino_set_t *set, dev_t dev, ino_t ino);
+
+/* Add (dev, ino) to set on behalf of owner, unless it was in already.
+ * Returns who holds it, owner itself when nothing could be recorded. */
+void *ino_set_claim (ino_set_t *set, dev_t dev, ino_t ino, void *owner);
+
+#endif /* _INOSET_H_ */
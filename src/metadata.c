@@ -26,6 +26,17 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sched.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#endif /* __linux__ */
 
 #include "mime.h"
 #include "metadata.h"
@@ -33,80 +44,3754 @@
 #include "content.h"
 #include "gettext.h"
 #include "trace.h"
+#include "metaindex.h"
+#include "uring.h"
+#include "scanio.h"
+#include "prefetch.h"
+#include "inoset.h"
+#include "objpath.h"
+#include "fnv.h"
+#include "sortkey.h"
+#include "profile.h"
+#include "minmax.h"
 
 #ifdef HAVE_FAM
 #include "ufam.h"
 #endif /* HAVE_FAM */
 
+#define SCAN_DEQUE_DEFAULT_CAPACITY 64
+#define SCAN_DENTS_SIZE (32 * 1024)
+/* Entries of a directory stat'ed at once while reading it */
+#define SCAN_BATCH 4096
+#define PROBE_BATCH 16
+/* Containers ask for object ids from there on, out of the way of the ones
+ * libdlna numbers resources with from 1 */
+#define OBJECT_ID_BASE   0x80000000U
+#define OBJECT_ID_MASK   0x7fffffffU
+#define OBJECT_ID_PROBES 16
+/* Devices entries keep the index of, by chunks never moved once allocated */
+#define META_DEV_CHUNK  256
+#define META_DEV_CHUNKS (META_DEV_NONE / META_DEV_CHUNK + 1)
+
+#ifdef __linux__
+/* getdents64 () returns these, but glibc doesn't export the structure */
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+#endif /* __linux__ */
+
+typedef struct scan_s scan_t;
+
+typedef struct scan_stats_s {
+  unsigned long dirs;           /* directories opened */
+  unsigned long reads;          /* getdents () or readdir () calls */
+  unsigned long entries;        /* entries kept */
+  unsigned long stats;          /* fstatat () calls */
+  unsigned long batched;        /* statx () queued to io_uring */
+  unsigned long submits;        /* io_uring_enter () calls */
+  unsigned long skipped;        /* fstatat () avoided thanks to d_type */
+  unsigned long loops;          /* links leading back into the shares */
+  unsigned long duplicates;     /* directories and files met already */
+  unsigned long filtered;       /* entries the share policies left out */
+  unsigned long sorted;         /* entries sorted */
+  double sort_time;             /* seconds spent sorting them */
+} scan_stats_t;
+
+/* Directories and multiply linked files met by a scan : each one is only
+ * listed or published once, whatever the path it is reached through. The
+ * workers list a directory under the first path they meet it through, the
+ * walk then publishes it under the first path it reaches it through. */
+typedef struct scan_seen_s {
+  pthread_mutex_t lock;
+  ino_set_t dirs;               /* listed */
+  ino_set_t walked;             /* walked, along with the meta_dir_t */
+  ino_set_t files;              /* walked */
+  char **roots;                 /* real paths of the shares */
+  int nr_roots;
+} scan_seen_t;
+
+/* Shared directory a scan goes through, as configured. */
+typedef struct scan_share_s {
+  char *path;                   /* the paths listed start with it */
+  size_t len;                   /* without trailing slashes */
+  const share_policy_t *policy; /* NULL when anything goes */
+} scan_share_t;
+
+/* Listing state of a thread, reused from one directory to the next. */
+typedef struct scan_ctx_s {
+  scan_stats_t stats;
+  char *dents;
+  unsigned int depth;           /* io_uring queue depth, 0 for none */
+  scan_io_t *io;                /* optional, paces the disk accesses */
+  scan_t *scan;
+  const char *path;             /* directory being listed */
+  const share_policy_t *policy; /* of the share path lies in */
+  int level;                    /* of path below the share */
+  arena_t arena;                /* listings kept, when building a tree */
+  meta_entry_t *entries;        /* listing buffers, reused from one */
+  int max_entries;              /* directory to the next */
+  char *names;
+  size_t max_names;
+#ifdef HAVE_IO_URING
+  uring_t *ring;
+  bool no_ring;                 /* io_uring turned out to be unusable */
+  struct statx *stx;            /* one result slot per request in flight */
+  unsigned int *slots;          /* free result slots */
+  unsigned int nr_slots;
+#endif /* HAVE_IO_URING */
+} scan_ctx_t;
+
+/* Path of the directory being walked, extended and truncated in place
+ * while going down and up the tree. */
+typedef struct scan_path_s {
+  char buf[PATH_MAX];
+  size_t len;
+  const char *root;             /* name of the root entry it starts from */
+} scan_path_t;
+
+/* Each worker owns a deque of directories still to be listed : the owner
+ * pushes and pops at the bottom (depth-first, cache friendly) while idle
+ * workers steal the oldest entries from the top. */
+typedef struct scan_worker_s {
+  scan_t *scan;
+  pthread_t thread;
+  bool running;
+  scan_ctx_t ctx;
+  pthread_mutex_t lock;
+  meta_dir_t **deque;
+  int capacity;
+  int top;
+  int bottom;
+} scan_worker_t;
+
+struct scan_s {
+  scan_worker_t *workers;
+  int nr_workers;
+  pthread_mutex_t lock;
+  pthread_cond_t listed_cond;   /* a directory reached META_DIR_LISTED */
+  pthread_cond_t work_cond;     /* a directory has been queued */
+  int queued;
+  bool stop;
+  const bool *cancel;           /* optional, aborts the walk when set */
+  bool lazy;                    /* don't list ahead of the walk */
+  bool breadth_first;           /* workers list the oldest queued first */
+  scan_progress_t *progress;    /* optional, updated by the walk */
+  probe_t *probes;        /* optional, updated when publishing */
+  pthread_mutex_t *publish_lock; /* optional, held while publishing */
+  bool defer_probes;            /* leave files to probe_pending () */
+  scan_ctx_t ctx;               /* the walking thread's own */
+  scan_path_t path;             /* the walking thread's own */
+  prefetch_t prefetch;          /* files the walk is about to probe */
+  scan_seen_t seen;
+  scan_share_t *shares;
+  int nr_shares;
+  share_policy_list_t *policies; /* the scan's own copy */
+  meta_tree_t *tree;            /* being built, owns the listings */
+  meta_dir_t **dropped;         /* left out by the walk, see scan_drop () */
+  int nr_dropped;
+  int max_dropped;
+  const char *checkpoint_file;  /* optional, where to checkpoint to */
+  int checkpoint_interval;
+  time_t checkpointed;
+  struct timeval start;
+};
+
+/* Directory being read. Its entries are stat'ed in batches as they are
+ * read, and sorted once it is all read. */
+typedef struct scan_listing_s {
+  meta_dir_t *dir;
+  size_t pathlen;
+  int max_entries;
+  size_t names_size;
+  size_t max_names;
+  int added;                    /* entries added, some dropped since */
+  int first;                    /* first entry of the current batch */
+} scan_listing_t;
+
+meta_dir_t *
+meta_dir_new (meta_dir_state_t state)
+{
+  meta_dir_t *dir;
+
+  dir = calloc (1, sizeof (meta_dir_t));
+  if (!dir)
+    return NULL;
+
+  dir->state = state;
+
+  return dir;
+}
+
+/* Devices files are on, which entries only keep the index of. The table
+ * only ever grows and is shared by every tree, so that indexes compare
+ * across scans : it is looked up without locking, and the count is only
+ * raised once the new device is in place. */
+static dev_t *meta_devs[META_DEV_CHUNKS];
+static int nr_meta_devs;
+static pthread_mutex_t meta_devs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+meta_dev_find (dev_t dev, int count)
+{
+  int i;
+
+  for (i = 0; i < count; i++)
+    if (meta_devs[i / META_DEV_CHUNK][i % META_DEV_CHUNK] == dev)
+      return i;
+
+  return -1;
+}
+
+uint16_t
+meta_dev_index (dev_t dev)
+{
+  int i;
+
+  i = meta_dev_find (dev, __atomic_load_n (&nr_meta_devs, __ATOMIC_ACQUIRE));
+  if (i >= 0)
+    return i;
+
+  pthread_mutex_lock (&meta_devs_lock);
+  i = meta_dev_find (dev, nr_meta_devs);
+  if (i < 0 && nr_meta_devs < META_DEV_NONE)
+  {
+    dev_t **chunk = &meta_devs[nr_meta_devs / META_DEV_CHUNK];
+
+    if (!*chunk)
+      *chunk = malloc (META_DEV_CHUNK * sizeof (dev_t));
+    if (*chunk)
+    {
+      i = nr_meta_devs;
+      (*chunk)[i % META_DEV_CHUNK] = dev;
+      __atomic_store_n (&nr_meta_devs, i + 1, __ATOMIC_RELEASE);
+    }
+  }
+  pthread_mutex_unlock (&meta_devs_lock);
+
+  return i < 0 ? META_DEV_NONE : i;
+}
+
+dev_t
+meta_dev (uint16_t index)
+{
+  if (index == META_DEV_NONE)
+    return 0;
+
+  return meta_devs[index / META_DEV_CHUNK][index % META_DEV_CHUNK];
+}
+
+/* Objects published to the VFS, for those serving them to find their path
+ * without going through the tree, and so without waiting for the metadata
+ * lock, held along scans. */
+static objpath_t published;
+static pthread_rwlock_t published_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Remember object id, published in container parent, as the entry which
+ * path is in path. The names of the tree are used as they are, wherever
+ * they move to has to be told with published_rename (). */
+static void
+published_add (uint32_t id, uint32_t parent, const meta_entry_t *entry,
+               const scan_path_t *path)
+{
+  pthread_rwlock_wrlock (&published_lock);
+  objpath_add (&published, id, parent, path->root, entry->name);
+  pthread_rwlock_unlock (&published_lock);
+}
+
+/* Follow the names of the published entries of dir, and of whatever is
+ * below it when asked to, to where they are now, root being that of its
+ * share. Called with published_lock held for writing. */
+static void
+published_rename_entries (const meta_dir_t *dir, const char *root,
+                          bool recurse)
+{
+  int i;
+
+  for (i = 0; i < dir->count; i++)
+  {
+    const meta_entry_t *entry = &dir->entries[i];
+
+    if (recurse && entry->dir && entry->dir->state == META_DIR_LISTED)
+      published_rename_entries (entry->dir, root, true);
+    if (entry->id)
+      objpath_rename (&published, entry->id, root, entry->name);
+  }
+}
+
+/* A published entry now goes by the name of entry, in the tree of root. */
+static void
+published_rename (const meta_entry_t *entry, const char *root)
+{
+  pthread_rwlock_wrlock (&published_lock);
+  objpath_rename (&published, entry->id, root, entry->name);
+  pthread_rwlock_unlock (&published_lock);
+}
+
+/* Same for a whole published directory moved over to the tree of root. */
+static void
+published_rename_dir (const meta_dir_t *dir, const char *root)
+{
+  pthread_rwlock_wrlock (&published_lock);
+  published_rename_entries (dir, root, true);
+  pthread_rwlock_unlock (&published_lock);
+}
+
+static void
+published_forget_entry (const meta_entry_t *entry)
+{
+  int i;
+
+  if (entry->dir && entry->dir->state == META_DIR_LISTED)
+    for (i = 0; i < entry->dir->count; i++)
+      published_forget_entry (&entry->dir->entries[i]);
+  objpath_remove (&published, entry->id);
+}
+
+/* Forget entry, about to be removed from the VFS, along with whatever it
+ * contains. */
+static void
+published_forget (const meta_entry_t *entry)
+{
+  pthread_rwlock_wrlock (&published_lock);
+  published_forget_entry (entry);
+  pthread_rwlock_unlock (&published_lock);
+}
+
+static bool
+published_contains (uint32_t id)
+{
+  bool found;
+
+  pthread_rwlock_rdlock (&published_lock);
+  found = objpath_contains (&published, id);
+  pthread_rwlock_unlock (&published_lock);
+
+  return found;
+}
+
+static void
+meta_entry_free (meta_entry_t *entry)
+{
+  int i;
+
+  if (!entry->dir)
+    return;
+
+  for (i = 0; i < entry->dir->count; i++)
+    meta_entry_free (&entry->dir->entries[i]);
+  if (entry->dir->entries && !entry->dir->arena)
+    free (entry->dir->entries);
+  if (entry->dir->names)
+    free (entry->dir->names);
+  if (entry->dir->path)
+    free (entry->dir->path);
+  free (entry->dir);
+  entry->dir = NULL;
+}
+
+static void
+meta_root_free (meta_entry_t *root)
+{
+  meta_entry_free (root);
+  if (root->name)
+    free (root->name);
+  root->name = NULL;
+}
+
+meta_tree_t *
+meta_tree_new (int count)
+{
+  meta_tree_t *tree;
+
+  tree = malloc (sizeof (meta_tree_t));
+  if (!tree)
+    return NULL;
+
+  tree->roots = calloc (count, sizeof (meta_entry_t));
+  tree->count = count;
+  tree->scanned = time (NULL);
+  tree->strings = NULL;
+  arena_init (&tree->arena);
+
+  return tree;
+}
+
+void
+meta_tree_free (meta_tree_t *tree)
+{
+  int i;
+
+  if (!tree)
+    return;
+
+  for (i = 0; i < tree->count; i++)
+    meta_root_free (&tree->roots[i]);
+  if (tree->roots)
+    free (tree->roots);
+  if (tree->strings)
+    free (tree->strings);
+  arena_free (&tree->arena);
+  free (tree);
+}
+
+/* Same file with the same contents, names aside. */
+static bool
+meta_entry_unchanged (const meta_entry_t *a, const meta_entry_t *b)
+{
+  return a->dev == b->dev && a->ino == b->ino && a->size == b->size
+    && a->mtime == b->mtime && !a->dir == !b->dir
+    && (a->dir || a->dev != META_DEV_NONE);
+}
+
+static int
+meta_entry_cmp (const void *a, const void *b)
+{
+  return sort_cmp (SORT_LOCALE, ((const meta_entry_t *) a)->name,
+                   ((const meta_entry_t *) b)->name);
+}
+
+static int
+meta_entry_natural_cmp (const void *a, const void *b)
+{
+  return sort_cmp (SORT_NATURAL, ((const meta_entry_t *) a)->name,
+                   ((const meta_entry_t *) b)->name);
+}
+
+/* Sort count entries, from keys computed once per entry, or comparing
+ * names pair by pair when out of memory. */
+static void
+meta_entries_sort (meta_entry_t *entries, int count, sort_mode_t mode)
+{
+  const char **names;
+  meta_entry_t *sorted = NULL;
+  int *order = NULL;
+  int i;
+
+  if (count < 2)
+    return;
+
+  names = malloc (count * sizeof (char *));
+  if (names)
+  {
+    for (i = 0; i < count; i++)
+      names[i] = entries[i].name;
+    order = sort_names (mode, names, count);
+    free (names);
+  }
+  if (order)
+    sorted = malloc (count * sizeof (meta_entry_t));
+
+  if (!sorted)
+    qsort (entries, count, sizeof (meta_entry_t),
+           mode == SORT_NATURAL ? meta_entry_natural_cmp : meta_entry_cmp);
+  else
+  {
+    for (i = 0; i < count; i++)
+      sorted[i] = entries[order[i]];
+    memcpy (entries, sorted, count * sizeof (meta_entry_t));
+    free (sorted);
+  }
+
+  if (order)
+    free (order);
+}
+
+static void
+meta_dir_sort (meta_dir_t *dir, sort_mode_t mode)
+{
+  meta_entries_sort (dir->entries, dir->count, mode);
+}
+
+static size_t
+meta_dir_names_size (const meta_dir_t *dir)
+{
+  size_t size = 0;
+  int i;
+
+  for (i = 0; i < dir->count; i++)
+    size += strlen (dir->entries[i].name) + 1;
+
+  return size;
+}
+
+/* Copy the names of the entries of a directory one after the other to
+ * names, where the entries then find them. */
+static void
+meta_dir_move_names (meta_dir_t *dir, char *names)
+{
+  int i;
+
+  for (i = 0; i < dir->count; i++)
+  {
+    size_t len = strlen (dir->entries[i].name) + 1;
+
+    memcpy (names, dir->entries[i].name, len);
+    dir->entries[i].name = names;
+    names += len;
+  }
+}
+
+/* Gather the names of a directory, which may be spread over several name
+ * blocks or lie among the names of dropped entries, into a block of its
+ * own. False if out of memory, the names being left where they were. */
+static bool
+meta_dir_pack_names (meta_dir_t *dir)
+{
+  size_t size = meta_dir_names_size (dir);
+  char *names;
+
+  names = malloc (size ? size : 1);
+  if (!names)
+    return false;
+
+  meta_dir_move_names (dir, names);
+  if (dir->names)
+    free (dir->names);
+  dir->names = names;
+
+  return true;
+}
+
+/* Give a directory, and whatever is below it, entries and names of its
+ * own, before it is moved over to another tree than the one whose arena
+ * or index they are in. Out of memory, it is left empty rather than
+ * pointing to memory about to be freed. */
+static void
+meta_dir_own (meta_dir_t *dir)
+{
+  int i;
+
+  for (i = 0; i < dir->count; i++)
+    if (dir->entries[i].dir)
+      meta_dir_own (dir->entries[i].dir);
+
+  if (dir->arena && dir->count)
+  {
+    meta_entry_t *entries;
+
+    entries = malloc (dir->count * sizeof (meta_entry_t));
+    if (entries)
+    {
+      memcpy (entries, dir->entries, dir->count * sizeof (meta_entry_t));
+      dir->entries = entries;
+      dir->arena = false;
+    }
+  }
+
+  if (dir->count && !dir->arena && (dir->names || meta_dir_pack_names (dir)))
+    return;
+
+  for (i = 0; i < dir->count; i++)
+    meta_entry_free (&dir->entries[i]);
+  if (dir->entries && !dir->arena)
+    free (dir->entries);
+  dir->entries = NULL;
+  dir->count = 0;
+  dir->arena = false;
+}
+
+/* Bring a published directory to the order of its share, which may have
+ * changed since it was sorted, before merging it with a new listing. */
+static void
+meta_dir_resort (meta_dir_t *dir, sort_mode_t mode)
+{
+  int i;
+
+  for (i = 1; i < dir->count; i++)
+    if (sort_cmp (mode, dir->entries[i - 1].name, dir->entries[i].name) > 0)
+    {
+      meta_dir_sort (dir, mode);
+      return;
+    }
+}
+
+static bool
+scan_path_set (scan_path_t *path, const char *name)
+{
+  size_t len = strlen (name);
+
+  if (len >= sizeof (path->buf))
+    return false;
+
+  memcpy (path->buf, name, len + 1);
+  path->len = len;
+  path->root = name;
+
+  return true;
+}
+
+static bool
+scan_path_push (scan_path_t *path, const char *name)
+{
+  size_t len = strlen (name);
+
+  if (path->len + len + 2 > sizeof (path->buf))
+    return false;
+
+  path->buf[path->len] = '/';
+  memcpy (path->buf + path->len + 1, name, len + 1);
+  path->len += len + 1;
+
+  return true;
+}
+
+static void
+scan_path_pop (scan_path_t *path, size_t len)
+{
+  path->len = len;
+  path->buf[len] = '\0';
+}
+
+/* Queue a directory to be listed by the workers, false if out of memory,
+ * in which case it is left to the walking thread, still queued. */
+static bool
+scan_worker_push (scan_worker_t *worker, meta_dir_t *dir)
+{
+  scan_t *scan = worker->scan;
+
+  pthread_mutex_lock (&worker->lock);
+  if (worker->bottom - worker->top == worker->capacity)
+  {
+    meta_dir_t **deque;
+    int i;
+
+    deque = malloc (2 * worker->capacity * sizeof (meta_dir_t *));
+    if (!deque)
+    {
+      pthread_mutex_unlock (&worker->lock);
+      return false;
+    }
+    for (i = worker->top; i < worker->bottom; i++)
+      deque[i - worker->top] = worker->deque[i % worker->capacity];
+    free (worker->deque);
+    worker->deque = deque;
+    worker->bottom -= worker->top;
+    worker->top = 0;
+    worker->capacity *= 2;
+  }
+  worker->deque[worker->bottom++ % worker->capacity] = dir;
+  pthread_mutex_unlock (&worker->lock);
+
+  pthread_mutex_lock (&scan->lock);
+  scan->queued++;
+  pthread_cond_signal (&scan->work_cond);
+  pthread_mutex_unlock (&scan->lock);
+
+  return true;
+}
+
+static meta_dir_t *
+scan_worker_take (scan_worker_t *worker, bool steal)
+{
+  meta_dir_t *dir = NULL;
+
+  pthread_mutex_lock (&worker->lock);
+  if (worker->bottom > worker->top)
+  {
+    if (steal)
+      dir = worker->deque[worker->top++ % worker->capacity];
+    else
+      dir = worker->deque[--worker->bottom % worker->capacity];
+  }
+  pthread_mutex_unlock (&worker->lock);
+
+  if (dir)
+  {
+    pthread_mutex_lock (&worker->scan->lock);
+    worker->scan->queued--;
+    pthread_mutex_unlock (&worker->scan->lock);
+  }
+
+  return dir;
+}
+
+static bool
+scan_cancelled (scan_t *scan)
+{
+  return scan->cancel && __atomic_load_n (scan->cancel, __ATOMIC_RELAXED);
+}
+
+/* The flags of the metadata thread are looked at from other threads,
+ * without the metadata lock. */
+static bool
+metadata_cancelled (ushare_t *ut)
+{
+  return __atomic_load_n (&ut->metadata_cancel, __ATOMIC_RELAXED);
+}
+
+static void
+metadata_cancel (ushare_t *ut, bool cancel)
+{
+  __atomic_store_n (&ut->metadata_cancel, cancel, __ATOMIC_RELAXED);
+}
+
+static bool
+metadata_thread_running (ushare_t *ut)
+{
+  return __atomic_load_n (&ut->metadata_thread_running, __ATOMIC_ACQUIRE);
+}
+
+static void
+metadata_thread_set_running (ushare_t *ut, bool running)
+{
+  __atomic_store_n (&ut->metadata_thread_running, running, __ATOMIC_RELEASE);
+}
+
+/* A scan publishing a tree nobody else sees yet only holds the metadata
+ * lock while it updates the VFS and the probes, one entry at a time, so
+ * that whoever else needs it doesn't wait for the whole scan. */
+static void
+scan_publish_begin (scan_t *scan)
+{
+  if (scan->publish_lock)
+    pthread_mutex_lock (scan->publish_lock);
+}
+
+static void
+scan_publish_end (scan_t *scan)
+{
+  if (scan->publish_lock)
+    pthread_mutex_unlock (scan->publish_lock);
+}
+
+/* Whether files are left pending rather than probed as they are
+ * published : in deferred mode, or when the metadata lock is held for
+ * the whole scan, which isn't to be held while waiting for the I/O
+ * budget. */
+static bool
+scan_defers_probes (scan_t *scan)
+{
+  return scan->defer_probes || (scan->probes && scan->probes->deferred);
+}
+
+/* Atomically move a directory from QUEUED to LISTING, so that it gets
+ * listed exactly once, either by a worker or by the walking thread. Once
+ * the walk is over, whatever is still queued was left out and stays so. */
+static bool
+scan_dir_claim (scan_t *scan, meta_dir_t *dir)
+{
+  bool claimed = false;
+
+  pthread_mutex_lock (&scan->lock);
+  if (dir->state == META_DIR_QUEUED && !scan->stop)
+  {
+    dir->state = META_DIR_LISTING;
+    claimed = true;
+  }
+  pthread_mutex_unlock (&scan->lock);
+
+  return claimed;
+}
+
+/* Add (dev, ino) to the directories, or files, met so far, false if it
+ * was met already. */
+static bool
+scan_seen_add (scan_seen_t *seen, bool dir, dev_t dev, ino_t ino)
+{
+  bool added;
+
+  if (!seen)
+    return true;
+
+  pthread_mutex_lock (&seen->lock);
+  added = ino_set_add (dir ? &seen->dirs : &seen->files, dev, ino);
+  pthread_mutex_unlock (&seen->lock);
+
+  return added;
+}
+
+/* Claim (dev, ino) for the directory the walk reaches it as, returns
+ * the one it reached it as first. */
+static meta_dir_t *
+scan_seen_claim (scan_seen_t *seen, dev_t dev, ino_t ino, meta_dir_t *dir)
+{
+  meta_dir_t *owner;
+
+  pthread_mutex_lock (&seen->lock);
+  owner = ino_set_claim (&seen->walked, dev, ino, dir);
+  pthread_mutex_unlock (&seen->lock);
+
+  return owner;
+}
+
+/* Keep a directory the walk left out until the end of the scan, the
+ * workers may still be listing it or its sub-directories. */
+static void
+scan_drop (scan_t *scan, meta_dir_t *dir)
+{
+  if (scan->nr_dropped == scan->max_dropped)
+  {
+    int max = scan->max_dropped ? 2 * scan->max_dropped : 16;
+    meta_dir_t **dropped;
+
+    /* leaked rather than freed under the feet of a worker */
+    dropped = realloc (scan->dropped, max * sizeof (meta_dir_t *));
+    if (!dropped)
+      return;
+    scan->dropped = dropped;
+    scan->max_dropped = max;
+  }
+  scan->dropped[scan->nr_dropped++] = dir;
+}
+
+/* Whether the link name, in the directory being listed, leads back into
+ * the shares, where whatever it points to is published already. */
+static bool
+scan_link_shared (scan_ctx_t *ctx, const char *name)
+{
+  scan_seen_t *seen = &ctx->scan->seen;
+  char path[PATH_MAX], real[PATH_MAX];
+  int i;
+
+  if (!seen->nr_roots || !ctx->path
+      || snprintf (path, PATH_MAX, "%s/%s", ctx->path, name) >= PATH_MAX
+      || !realpath (path, real))
+    return false;
+
+  for (i = 0; i < seen->nr_roots; i++)
+  {
+    const char *root = seen->roots[i];
+    size_t len = strlen (root);
+
+    if (!strncmp (real, root, len)
+        && (real[len] == '/' || real[len] == '\0' || !strcmp (root, "/")))
+      return true;
+  }
+
+  return false;
+}
+
+/* Share path lies in, NULL if none. */
+static const scan_share_t *
+scan_share_find (const scan_t *scan, const char *path)
+{
+  int i;
+
+  for (i = 0; i < scan->nr_shares; i++)
+  {
+    const scan_share_t *share = &scan->shares[i];
+
+    if (!strncmp (path, share->path, share->len)
+        && (path[share->len] == '/' || path[share->len] == '\0'))
+      return share;
+  }
+
+  return NULL;
+}
+
+static sort_mode_t
+scan_sort_mode (const scan_t *scan, const char *path)
+{
+  const scan_share_t *share = scan_share_find (scan, path);
+
+  return share && share->policy ? share->policy->sort : SORT_LOCALE;
+}
+
+/* Set the directory about to be listed, and find out which share it lies
+ * in, and how deep. */
+static void
+scan_ctx_enter (scan_ctx_t *ctx, const char *path)
+{
+  const scan_share_t *share = scan_share_find (ctx->scan, path);
+  const char *p;
+
+  ctx->path = path;
+  ctx->policy = share ? share->policy : NULL;
+  ctx->level = 0;
+
+  for (p = share ? path + share->len : ""; *p; p++)
+    if (*p == '/' && p[1] && p[1] != '/')
+      ctx->level++;
+}
+
+/* Whether the policy of the share lets an entry of the directory being
+ * listed in, from its name and d_type alone, before it gets stat'ed. */
+static bool
+scan_entry_allowed (scan_ctx_t *ctx, const char *name, unsigned char type)
+{
+  const share_policy_t *policy = ctx->policy;
+
+  if (!policy)
+    return true;
+
+  if ((type == DT_LNK && !policy->follow_links)
+      || (type == DT_DIR && policy->max_depth >= 0
+          && ctx->level >= policy->max_depth)
+      || !share_policy_name (policy, name, type != DT_REG))
+  {
+    ctx->stats.filtered++;
+    return false;
+  }
+
+  return true;
+}
+
+/* Fill in a listed entry from its stat (), false if it is no media, if
+ * the policy of the share leaves it out, or if it leads back into the
+ * shares. */
+static bool
+scan_entry_set_stat (scan_ctx_t *ctx, meta_entry_t *entry,
+                     const struct stat *st)
+{
+  if (!S_ISDIR (st->st_mode) && !S_ISREG (st->st_mode))
+    return false;
+
+  /* sizes, and whatever d_type couldn't tell a directory from a file */
+  if (ctx->policy
+      && (S_ISDIR (st->st_mode)
+          ? ctx->policy->max_depth >= 0 && ctx->level >= ctx->policy->max_depth
+          : !share_policy_name (ctx->policy, entry->name, false)
+          || !share_policy_size (ctx->policy, st->st_size)))
+  {
+    ctx->stats.filtered++;
+    return false;
+  }
+
+  if (entry->link && scan_link_shared (ctx, entry->name))
+  {
+    log_verbose (_("%s/%s leads back into the shares, not followed\n"),
+                 ctx->path, entry->name);
+    ctx->stats.loops++;
+    return false;
+  }
+
+  if (S_ISDIR (st->st_mode))
+  {
+    entry->dir = meta_dir_new (META_DIR_QUEUED);
+    if (!entry->dir)
+      return false;
+    if (entry->link)
+    {
+      entry->dir->dev = st->st_dev;
+      entry->dir->ino = st->st_ino;
+    }
+    return true;
+  }
+
+  entry->hardlink = st->st_nlink > 1;
+  entry->dev = meta_dev_index (st->st_dev);
+  entry->ino = st->st_ino;
+  entry->size = st->st_size;
+  entry->mtime = st->st_mtime;
+
+  return true;
+}
+
+/* Resize the name block of a directory being listed, which the names of
+ * its entries are moved along with. */
+static bool
+scan_dir_names_resize (meta_dir_t *dir, size_t size)
+{
+  uintptr_t old = (uintptr_t) dir->names;
+  char *names;
+  int i;
+
+  names = realloc (dir->names, size);
+  if (!names)
+    return false;
+  dir->names = names;
+
+  for (i = 0; i < dir->count; i++)
+    dir->entries[i].name = names + ((uintptr_t) dir->entries[i].name - old);
+
+  return true;
+}
+
+static void
+scan_dir_add (scan_ctx_t *ctx, scan_listing_t *l,
+              const char *name, unsigned char type)
+{
+  meta_dir_t *dir = l->dir;
+  meta_entry_t *entry;
+  size_t len;
+
+  if (name[0] == '.')
+    return;
+
+  /* fifos, sockets and devices */
+  if (type != DT_DIR && type != DT_REG && type != DT_LNK
+      && type != DT_UNKNOWN)
+    return;
+
+  if (!scan_entry_allowed (ctx, name, type))
+    return;
+
+  len = strlen (name) + 1;
+  if (l->pathlen + len + 1 > PATH_MAX)
+    return;
+
+  if (dir->count == l->max_entries)
+  {
+    meta_entry_t *entries;
+    int max = l->max_entries ? 2 * l->max_entries : 16;
+
+    entries = realloc (dir->entries, max * sizeof (meta_entry_t));
+    if (!entries)
+      return;
+    dir->entries = entries;
+    l->max_entries = max;
+  }
+
+  if (l->names_size + len > l->max_names)
+  {
+    size_t max = 2 * (l->max_names + len);
+
+    if (!scan_dir_names_resize (dir, max))
+      return;
+    l->max_names = max;
+  }
+
+  entry = &dir->entries[dir->count];
+  memset (entry, 0, sizeof (meta_entry_t));
+
+  /* the directory gets its own fstat () once it is opened, anything
+   * else is stat'ed by scan_dir_stat () : regular files still need
+   * their size, and links are followed */
+  if (type == DT_DIR)
+  {
+    entry->dir = meta_dir_new (META_DIR_QUEUED);
+    if (!entry->dir)
+      return;
+    ctx->stats.skipped++;
+  }
+  else if (type == DT_LNK)
+    entry->link = true;
+
+  entry->name = dir->names + l->names_size;
+  memcpy (entry->name, name, len);
+  l->names_size += len;
+  l->added++;
+  dir->count++;
+}
+
+static void
+scan_dir_stat_sync (scan_ctx_t *ctx, meta_dir_t *dir, int fd, int first)
+{
+  int i;
+
+  for (i = first; i < dir->count; i++)
+  {
+    meta_entry_t *entry = &dir->entries[i];
+    struct timespec start;
+    struct stat st;
+
+    if (entry->dir || !entry->name)
+      continue;
+
+    ctx->stats.stats++;
+    scan_io_begin (ctx->io, 1, &start);
+    if (fstatat (fd, entry->name, &st, 0) < 0
+        || !scan_entry_set_stat (ctx, entry, &st))
+      entry->name = NULL;
+    scan_io_end (ctx->io, &start);
+  }
+}
+
+#ifdef HAVE_IO_URING
+static bool
+scan_ctx_ring (scan_ctx_t *ctx)
+{
+  unsigned int i;
+
+  if (ctx->ring)
+    return true;
+  if (ctx->no_ring)
+    return false;
+
+  ctx->ring = uring_new (ctx->depth);
+  if (!ctx->ring)
+  {
+    log_verbose (_("io_uring is not available, using stat () instead\n"));
+    ctx->no_ring = true;
+    return false;
+  }
+
+  ctx->stx = malloc (ctx->depth * sizeof (struct statx));
+  ctx->slots = malloc (ctx->depth * sizeof (unsigned int));
+  if (!ctx->stx || !ctx->slots)
+  {
+    ctx->no_ring = true;
+    return false;
+  }
+
+  for (i = 0; i < ctx->depth; i++)
+    ctx->slots[i] = i;
+  ctx->nr_slots = ctx->depth;
+
+  return true;
+}
+
+/* Keep up to depth statx () in flight, so that the device queue stays
+ * busy on high latency storage. Returns false if the ring can't be used,
+ * in which case whatever is left is to be stat'ed synchronously. */
+static bool
+scan_dir_stat_uring (scan_ctx_t *ctx, meta_dir_t *dir, int fd, int first)
+{
+  int next = first, inflight = 0;
+  struct timespec start;
+
+  if (!scan_ctx_ring (ctx))
+    return false;
+
+  while (next < dir->count || inflight)
+  {
+    uint64_t data;
+    int res;
+
+    for (; next < dir->count && ctx->nr_slots; next++)
+    {
+      meta_entry_t *entry = &dir->entries[next];
+      unsigned int slot;
+
+      if (entry->dir)
+        continue;
+
+      scan_io_begin (ctx->io, 1, NULL);
+      slot = ctx->slots[--ctx->nr_slots];
+      uring_prep_statx (ctx->ring, fd, entry->name, &ctx->stx[slot],
+                        (uint64_t) next << 32 | slot);
+      ctx->stats.batched++;
+      inflight++;
+    }
+
+    if (!inflight)
+      break;
+
+    ctx->stats.submits++;
+    scan_io_begin (ctx->io, 0, &start);
+    if (uring_submit (ctx->ring, 1) < 0)
+    {
+      /* requests in flight keep their slots until the ring goes away */
+      perror ("io_uring_enter");
+      ctx->no_ring = true;
+      return false;
+    }
+    scan_io_end (ctx->io, &start);
+
+    while (uring_reap (ctx->ring, &data, &res))
+    {
+      meta_entry_t *entry = &dir->entries[data >> 32];
+      unsigned int slot = data & 0xffffffff;
+      const struct statx *stx = &ctx->stx[slot];
+      struct stat st;
+
+      if (res == 0)
+      {
+        st.st_mode = stx->stx_mode;
+        st.st_dev = makedev (stx->stx_dev_major, stx->stx_dev_minor);
+        st.st_ino = stx->stx_ino;
+        st.st_size = stx->stx_size;
+        st.st_mtime = stx->stx_mtime.tv_sec;
+        st.st_nlink = stx->stx_nlink;
+        if (!scan_entry_set_stat (ctx, entry, &st))
+          entry->name = NULL;
+      }
+      else if (fstatat (fd, entry->name, &st, 0) < 0
+               || !scan_entry_set_stat (ctx, entry, &st))
+        entry->name = NULL;
+
+      ctx->slots[ctx->nr_slots++] = slot;
+      inflight--;
+    }
+  }
+
+  return true;
+}
+#endif /* HAVE_IO_URING */
+
+/* Stat whatever d_type left unknown from first on, and drop entries
+ * which vanished meanwhile or aren't media. */
+static void
+scan_dir_stat (scan_ctx_t *ctx, meta_dir_t *dir, int fd, int first)
+{
+  int i, n;
+
+#ifdef HAVE_IO_URING
+  int pending = 0;
+
+  for (i = first; i < dir->count; i++)
+    if (!dir->entries[i].dir)
+      pending++;
+
+  /* a single request isn't worth a round trip through the ring */
+  if (pending < 2 || !ctx->depth
+      || !scan_dir_stat_uring (ctx, dir, fd, first))
+#endif /* HAVE_IO_URING */
+    scan_dir_stat_sync (ctx, dir, fd, first);
+
+  for (i = first, n = first; i < dir->count; i++)
+    if (dir->entries[i].name)
+      dir->entries[n++] = dir->entries[i];
+  dir->count = n;
+}
+
+/* Claim the inodes of the entries of a directory the walk is about to
+ * publish, and drop those met already. Only ever called from the walking
+ * thread, so that the first path in publishing order wins, whichever
+ * worker happened to list what first. */
+static void
+scan_dir_dedup (scan_ctx_t *ctx, meta_dir_t *dir)
+{
+  scan_seen_t *seen = &ctx->scan->seen;
+  int i, n;
+
+  /* a directory claims its inode once walked, unless reached through a
+   * link, in which case the first link to it wins, as does the first name
+   * of a linked file */
+  for (i = 0; i < dir->count; i++)
+  {
+    meta_entry_t *entry = &dir->entries[i];
+
+    if (entry->dir ? !entry->link || !entry->dir->ino
+        || scan_seen_claim (seen, entry->dir->dev, entry->dir->ino,
+                            entry->dir) == entry->dir
+        : (!entry->hardlink && !entry->link) || entry->dev == META_DEV_NONE
+        || scan_seen_add (seen, false, entry->dev, entry->ino))
+      continue;
+
+    if (entry->dir)
+    {
+      scan_drop (ctx->scan, entry->dir);
+      entry->dir = NULL;
+    }
+    meta_entry_free (entry);
+    entry->name = NULL;
+    ctx->stats.duplicates++;
+  }
+
+  for (i = 0, n = 0; i < dir->count; i++)
+    if (dir->entries[i].name)
+      dir->entries[n++] = dir->entries[i];
+  dir->count = n;
+  ctx->stats.entries += n;
+}
+
+/* Stat the entries read since the previous batch, dropping those which
+ * vanished meanwhile or aren't media before reading on. */
+static void
+scan_dir_batch (scan_ctx_t *ctx, scan_listing_t *l, int fd)
+{
+  scan_dir_stat (ctx, l->dir, fd, l->first);
+  l->first = l->dir->count;
+}
+
+/* The listing stays in memory as long as it is published : give back
+ * what was left aside for growing, and the names of the entries dropped
+ * on the way. */
+static void
+scan_dir_trim (meta_dir_t *dir, const scan_listing_t *l)
+{
+  if (!dir->count)
+  {
+    if (dir->entries)
+      free (dir->entries);
+    if (dir->names)
+      free (dir->names);
+    dir->entries = NULL;
+    dir->names = NULL;
+    return;
+  }
+
+  if (dir->count < l->added)
+    meta_dir_pack_names (dir);
+  else if (l->names_size < l->max_names)
+    scan_dir_names_resize (dir, l->names_size);
+
+  if (dir->count < l->max_entries)
+  {
+    meta_entry_t *entries;
+
+    entries = realloc (dir->entries, dir->count * sizeof (meta_entry_t));
+    if (entries)
+      dir->entries = entries;
+  }
+}
+
+/* Copy a complete listing, made in the buffers of ctx, to the arena of
+ * the tree being built, the buffers going back to ctx for the next
+ * directory. False if there is no such arena or it is out of memory, in
+ * which case the buffers are left to the directory. */
+static bool
+scan_dir_keep (scan_ctx_t *ctx, meta_dir_t *dir, const scan_listing_t *l)
+{
+  meta_entry_t *entries = NULL;
+  char *names = NULL;
+
+  if (!ctx->scan->tree)
+    return false;
+
+  if (dir->count)
+  {
+    entries = arena_alloc (&ctx->arena, dir->count * sizeof (meta_entry_t));
+    if (entries)
+      names = arena_alloc (&ctx->arena, meta_dir_names_size (dir));
+    if (!names)
+      return false;
+    memcpy (entries, dir->entries, dir->count * sizeof (meta_entry_t));
+  }
+
+  ctx->entries = dir->entries;
+  ctx->max_entries = l->max_entries;
+  ctx->names = dir->names;
+  ctx->max_names = l->max_names;
+
+  dir->entries = entries;
+  dir->names = NULL;
+  dir->arena = true;
+  meta_dir_move_names (dir, names);
+
+  return true;
+}
+
+/* Read the entries of an opened directory, whose fstat () is st. Entries
+ * are looked up relative to the directory fd, and only when d_type can't
+ * tell what they are. Giant directories are stat'ed by batches as they
+ * are read, so that what isn't kept doesn't pile up, and sorted once
+ * they are all read : they are only published in order, and are all
+ * held in the tree anyway. */
+static void
+scan_dir_read (scan_ctx_t *ctx, meta_dir_t *dir, int fd,
+               const struct stat *st, size_t pathlen)
+{
+  scan_listing_t l;
+  struct timespec start;
+  sort_mode_t mode = ctx->policy ? ctx->policy->sort : SORT_LOCALE;
+
+  dir->dev = st->st_dev;
+  dir->ino = st->st_ino;
+  dir->mtime = st->st_mtime;
+
+  memset (&l, 0, sizeof (l));
+  l.dir = dir;
+  l.pathlen = pathlen;
+
+  /* a tree being built gets a copy of the listing in its arena, which is
+   * made in the same buffers from one directory to the next */
+  if (ctx->scan->tree)
+  {
+    dir->entries = ctx->entries;
+    l.max_entries = ctx->max_entries;
+    dir->names = ctx->names;
+    l.max_names = ctx->max_names;
+    ctx->entries = NULL;
+    ctx->names = NULL;
+  }
+
+#ifdef __linux__
+  if (!ctx->dents)
+    ctx->dents = malloc (SCAN_DENTS_SIZE);
+
+  while (ctx->dents)
+  {
+    long n, off;
+
+    scan_io_begin (ctx->io, 1, &start);
+    n = syscall (SYS_getdents64, fd, ctx->dents, SCAN_DENTS_SIZE);
+    scan_io_end (ctx->io, &start);
+    ctx->stats.reads++;
+    if (n <= 0)
+      break;
+
+    for (off = 0; off < n;)
+    {
+      struct linux_dirent64 *d = (struct linux_dirent64 *) (ctx->dents + off);
+
+      scan_dir_add (ctx, &l, d->d_name, d->d_type);
+      off += d->d_reclen;
+    }
+    if (dir->count - l.first >= SCAN_BATCH)
+      scan_dir_batch (ctx, &l, fd);
+  }
+#else
+  {
+    DIR *dirp;
+    struct dirent *d;
+    int dfd;
+
+    dfd = dup (fd);
+    dirp = dfd < 0 ? NULL : fdopendir (dfd);
+    if (!dirp)
+    {
+      if (dfd >= 0)
+        close (dfd);
+      if (!scan_dir_keep (ctx, dir, &l))
+        scan_dir_trim (dir, &l);
+      return;
+    }
+
+    /* readdir () reads ahead, the directory counts as one operation */
+    scan_io_begin (ctx->io, 1, &start);
+    while ((d = readdir (dirp)))
+    {
+      ctx->stats.reads++;
+      scan_dir_add (ctx, &l, d->d_name, d->d_type);
+      if (dir->count - l.first >= SCAN_BATCH)
+      {
+        scan_io_end (ctx->io, &start);
+        scan_dir_batch (ctx, &l, fd);
+        scan_io_begin (ctx->io, 1, &start);
+      }
+    }
+    scan_io_end (ctx->io, &start);
+    closedir (dirp);
+  }
+#endif /* __linux__ */
+
+  scan_dir_batch (ctx, &l, fd);
+
+  if (dir->count > 1)
+  {
+    struct timespec begin, end;
+
+    clock_gettime (CLOCK_MONOTONIC, &begin);
+    meta_dir_sort (dir, mode);
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    ctx->stats.sorted += dir->count;
+    ctx->stats.sort_time += (end.tv_sec - begin.tv_sec)
+      + (end.tv_nsec - begin.tv_nsec) / 1e9;
+  }
+
+  if (!scan_dir_keep (ctx, dir, &l))
+    scan_dir_trim (dir, &l);
+}
+
+static void
+scan_dir_list (scan_t *scan, scan_ctx_t *ctx, scan_worker_t *worker,
+               meta_dir_t *dir, const char *path)
+{
+  struct timespec start;
+  struct stat st;
+  int fd, i;
+
+  scan_io_begin (ctx->io, 1, &start);
+  fd = open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  scan_io_end (ctx->io, &start);
+  if (fd < 0 || fstat (fd, &st) < 0)
+    perror (path);
+  /* reached through another path, a bind mount or a link : the walk
+   * tells which one keeps it, and lists it again if that's this one */
+  else if (!dir->twin
+           && !scan_seen_add (&scan->seen, true, st.st_dev, st.st_ino))
+    dir->twin = true;
+  else
+  {
+    ctx->stats.dirs++;
+    scan_ctx_enter (ctx, path);
+    scan_dir_read (ctx, dir, fd, &st, strlen (path));
+    ctx->path = NULL;
+
+    /* queue sub-directories in the order they are going to be published :
+     * reversed when the owner pops them back depth-first */
+    if (worker)
+      for (i = 0; i < dir->count; i++)
+      {
+        meta_entry_t *entry =
+          &dir->entries[scan->breadth_first ? i : dir->count - 1 - i];
+
+        if (!entry->dir)
+          continue;
+
+        entry->dir->path = malloc (strlen (path) + strlen (entry->name) + 2);
+        if (!entry->dir->path)
+          continue;
+        sprintf (entry->dir->path, "%s/%s", path, entry->name);
+        if (!scan_worker_push (worker, entry->dir))
+        {
+          free (entry->dir->path);
+          entry->dir->path = NULL;
+        }
+      }
+  }
+
+  if (fd >= 0)
+    close (fd);
+
+  pthread_mutex_lock (&scan->lock);
+  if (dir->path)
+    free (dir->path);
+  dir->path = NULL;
+  dir->state = META_DIR_LISTED;
+  pthread_cond_broadcast (&scan->listed_cond);
+  pthread_mutex_unlock (&scan->lock);
+}
+
+static void *
+scan_worker_thread (void *arg)
+{
+  scan_worker_t *worker = (scan_worker_t *) arg;
+  scan_t *scan = worker->scan;
+  int self = worker - scan->workers;
+
+  scan_io_thread (worker->ctx.io);
+
+  while (true)
+  {
+    meta_dir_t *dir;
+    int i;
+
+    dir = scan_worker_take (worker, __atomic_load_n (&scan->breadth_first,
+                                                     __ATOMIC_RELAXED));
+    for (i = 1; !dir && i < scan->nr_workers; i++)
+      dir = scan_worker_take (&scan->workers[(self + i) % scan->nr_workers],
+                              true);
+
+    if (dir)
+    {
+      if (!scan_cancelled (scan) && scan_dir_claim (scan, dir))
+        scan_dir_list (scan, &worker->ctx, worker, dir, dir->path);
+      continue;
+    }
+
+    pthread_mutex_lock (&scan->lock);
+    while (!scan->stop && !scan->queued)
+      pthread_cond_wait (&scan->work_cond, &scan->lock);
+    if (scan->stop)
+    {
+      pthread_mutex_unlock (&scan->lock);
+      break;
+    }
+    pthread_mutex_unlock (&scan->lock);
+  }
+
+  return NULL;
+}
+
+static void
+scan_ctx_init (scan_ctx_t *ctx, unsigned int depth, scan_io_t *io,
+               scan_t *scan)
+{
+  memset (ctx, 0, sizeof (scan_ctx_t));
+  ctx->depth = depth;
+  ctx->io = io;
+  ctx->scan = scan;
+  arena_init (&ctx->arena);
+}
+
+static void
+scan_ctx_free (scan_ctx_t *ctx)
+{
+  if (ctx->dents)
+    free (ctx->dents);
+  if (ctx->entries)
+    free (ctx->entries);
+  if (ctx->names)
+    free (ctx->names);
+
+  /* the listings kept belong to the tree built, if it still wants them */
+  if (ctx->scan->tree)
+    arena_splice (&ctx->scan->tree->arena, &ctx->arena);
+  arena_free (&ctx->arena);
+#ifdef HAVE_IO_URING
+  /* closing the ring waits for whatever is still in flight */
+  uring_free (ctx->ring);
+  if (ctx->stx)
+    free (ctx->stx);
+  if (ctx->slots)
+    free (ctx->slots);
+#endif /* HAVE_IO_URING */
+}
+
+static void
+scan_init (scan_t *scan, int nr_workers, int depth, const bool *cancel,
+           scan_io_t *io)
+{
+  int i;
+
+  pthread_mutex_init (&scan->lock, NULL);
+  pthread_cond_init (&scan->listed_cond, NULL);
+  pthread_cond_init (&scan->work_cond, NULL);
+  scan->queued = 0;
+  scan->stop = false;
+  scan->cancel = cancel;
+  scan->lazy = false;
+  scan->breadth_first = false;
+  scan->progress = NULL;
+  scan->probes = NULL;
+  scan->publish_lock = NULL;
+  scan->defer_probes = false;
+  scan->nr_workers = 0;
+  scan->workers = NULL;
+  pthread_mutex_init (&scan->seen.lock, NULL);
+  ino_set_init (&scan->seen.dirs);
+  ino_set_init (&scan->seen.walked);
+  ino_set_init (&scan->seen.files);
+  scan->seen.roots = NULL;
+  scan->seen.nr_roots = 0;
+  scan->shares = NULL;
+  scan->nr_shares = 0;
+  scan->policies = NULL;
+  scan->tree = NULL;
+  scan->dropped = NULL;
+  scan->nr_dropped = 0;
+  scan->max_dropped = 0;
+  scan->checkpoint_file = NULL;
+  scan->checkpoint_interval = 0;
+  scan->checkpointed = 0;
+  scan_ctx_init (&scan->ctx, depth, io, scan);
+  scan_path_pop (&scan->path, 0);
+  prefetch_init (&scan->prefetch, io);
+  gettimeofday (&scan->start, NULL);
+
+  if (nr_workers <= 1)
+    return;
+
+  scan->workers = malloc (nr_workers * sizeof (scan_worker_t));
+  if (!scan->workers)
+    return;
+
+  for (i = 0; i < nr_workers; i++)
+  {
+    scan_worker_t *worker = &scan->workers[i];
+
+    worker->scan = scan;
+    worker->running = false;
+    scan_ctx_init (&worker->ctx, depth, io, scan);
+    pthread_mutex_init (&worker->lock, NULL);
+    worker->capacity = SCAN_DEQUE_DEFAULT_CAPACITY;
+    worker->deque = malloc (worker->capacity * sizeof (meta_dir_t *));
+    worker->top = 0;
+    worker->bottom = 0;
+    if (!worker->deque)
+      break;
+  }
+
+  /* short of memory, the walking thread lists everything on its own */
+  if (i < nr_workers)
+  {
+    while (i >= 0)
+    {
+      if (scan->workers[i].deque)
+        free (scan->workers[i].deque);
+      pthread_mutex_destroy (&scan->workers[i].lock);
+      i--;
+    }
+    free (scan->workers);
+    scan->workers = NULL;
+    return;
+  }
+  scan->nr_workers = nr_workers;
+
+  /* a worker which failed to start simply keeps an empty deque,
+   * the walking thread lists whatever nobody else did */
+  for (i = 0; i < nr_workers; i++)
+  {
+    if (pthread_create (&scan->workers[i].thread, NULL,
+                        scan_worker_thread, &scan->workers[i]))
+    {
+      perror ("Failed to create scan thread");
+      break;
+    }
+    scan->workers[i].running = true;
+  }
+}
+
+/* Account for the headers read ahead through pf. */
+static void
+probe_prefetched (probe_t *probes, prefetch_t *pf)
+{
+  if (probes && pf->files)
+  {
+    probes->prefetched += pf->files;
+    probes->located += pf->mapped;
+  }
+  pf->files = 0;
+  pf->mapped = 0;
+}
+
+static void
+scan_stats_add (scan_stats_t *total, const scan_ctx_t *ctx)
+{
+  total->dirs += ctx->stats.dirs;
+  total->reads += ctx->stats.reads;
+  total->entries += ctx->stats.entries;
+  total->stats += ctx->stats.stats;
+  total->batched += ctx->stats.batched;
+  total->submits += ctx->stats.submits;
+  total->skipped += ctx->stats.skipped;
+  total->loops += ctx->stats.loops;
+  total->duplicates += ctx->stats.duplicates;
+  total->filtered += ctx->stats.filtered;
+  total->sorted += ctx->stats.sorted;
+  total->sort_time += ctx->stats.sort_time;
+}
+
+static void
+scan_finish (scan_t *scan)
+{
+  scan_stats_t total;
+  struct timeval end;
+  double elapsed;
+  int i;
+
+  pthread_mutex_lock (&scan->lock);
+  scan->stop = true;
+  pthread_cond_broadcast (&scan->work_cond);
+  pthread_mutex_unlock (&scan->lock);
+
+  memset (&total, 0, sizeof (total));
+  scan_stats_add (&total, &scan->ctx);
+  scan_ctx_free (&scan->ctx);
+
+  /* workers steal from one another until they are all done */
+  for (i = 0; i < scan->nr_workers; i++)
+    if (scan->workers[i].running)
+      pthread_join (scan->workers[i].thread, NULL);
+
+  for (i = 0; i < scan->nr_workers; i++)
+  {
+    pthread_mutex_destroy (&scan->workers[i].lock);
+    free (scan->workers[i].deque);
+    scan_stats_add (&total, &scan->workers[i].ctx);
+    scan_ctx_free (&scan->workers[i].ctx);
+  }
+
+  if (scan->workers)
+    free (scan->workers);
+
+  for (i = 0; i < scan->nr_dropped; i++)
+  {
+    meta_entry_t dropped;
+
+    memset (&dropped, 0, sizeof (meta_entry_t));
+    dropped.dir = scan->dropped[i];
+    meta_entry_free (&dropped);
+  }
+  if (scan->dropped)
+    free (scan->dropped);
+
+  pthread_cond_destroy (&scan->work_cond);
+  pthread_cond_destroy (&scan->listed_cond);
+  pthread_mutex_destroy (&scan->lock);
+
+  scan_publish_begin (scan);
+  probe_prefetched (scan->probes, &scan->prefetch);
+  scan_publish_end (scan);
+  prefetch_free (&scan->prefetch);
+
+  ino_set_free (&scan->seen.dirs);
+  ino_set_free (&scan->seen.walked);
+  ino_set_free (&scan->seen.files);
+  for (i = 0; i < scan->seen.nr_roots; i++)
+    free (scan->seen.roots[i]);
+  if (scan->seen.roots)
+    free (scan->seen.roots);
+  pthread_mutex_destroy (&scan->seen.lock);
+
+  for (i = 0; i < scan->nr_shares; i++)
+    free (scan->shares[i].path);
+  if (scan->shares)
+    free (scan->shares);
+  share_policy_free (scan->policies);
+
+  gettimeofday (&end, NULL);
+  elapsed = (end.tv_sec - scan->start.tv_sec)
+    + (end.tv_usec - scan->start.tv_usec) / 1000000.0;
+  log_verbose (_("Scanned %lu directories, %lu entries in %.3f s, "
+                 "%.0f entries/s (%lu reads, %lu stat, %lu stat avoided, "
+                 "%lu statx in %lu io_uring submissions)\n"),
+               total.dirs, total.entries, elapsed,
+               elapsed > 0 ? total.entries / elapsed : 0.0,
+               total.reads, total.stats, total.skipped,
+               total.batched, total.submits);
+  if (total.loops || total.duplicates)
+    log_verbose (_("Skipped %lu links back into the shares, and %lu "
+                   "directories or files met under another path\n"),
+                 total.loops, total.duplicates);
+  if (total.filtered)
+    log_verbose (_("Left out %lu entries as the share policies tell\n"),
+                 total.filtered);
+  if (total.sorted)
+    log_verbose (_("Sorted %lu entries in %.3f s\n"),
+                 total.sorted, total.sort_time);
+}
+
+/* Tell the scan about the shares content, and their policies. Links are
+ * checked against the real paths of the shares. */
+static void
+scan_shares (scan_t *scan, content_list_t *content,
+             const share_policy_list_t *policies)
+{
+  char real[PATH_MAX];
+  int i;
+
+  if (!content || !content->count)
+    return;
+
+  scan->policies = share_policy_dup (policies);
+  scan->shares = malloc (content->count * sizeof (scan_share_t));
+  scan->seen.roots = malloc (content->count * sizeof (char *));
+  if (!scan->shares || !scan->seen.roots)
+    return;
+
+  for (i = 0; i < content->count; i++)
+  {
+    scan_share_t *share = &scan->shares[scan->nr_shares];
+
+    if (realpath (content->content[i], real)
+        && (scan->seen.roots[scan->seen.nr_roots] = strdup (real)))
+      scan->seen.nr_roots++;
+
+    share->path = strdup (content->content[i]);
+    if (!share->path)
+      continue;
+    for (share->len = strlen (share->path);
+         share->len && share->path[share->len - 1] == '/'; share->len--)
+      ;
+    share->policy = share_policy_lookup (scan->policies, share->path);
+    scan->nr_shares++;
+  }
+}
+
+/* Object id a container first asks for, from a FNV-1a hash of its path,
+ * that is of its share and its path within it. */
+static uint32_t
+object_id_hash (const char *path)
+{
+  uint32_t hash = fnv1a (FNV_OFFSET_BASIS, path, strlen (path));
+
+  /* libdlna gives UINT_MAX - 1 out when short of ids */
+  hash = OBJECT_ID_BASE | (hash & OBJECT_ID_MASK);
+  return hash >= UINT_MAX - 1 ? OBJECT_ID_BASE : hash;
+}
+
+static uint32_t
+object_id_next (uint32_t oid)
+{
+  oid = OBJECT_ID_BASE | ((oid + 1) & OBJECT_ID_MASK);
+  return oid >= UINT_MAX - 1 ? OBJECT_ID_BASE : oid;
+}
+
+/* Publish a directory under the object id it had so far, or one derived
+ * from its path, so that control points may keep using what they cached.
+ * Ids taken are told from the published objects, without trying them on
+ * the VFS : adding and removing a container would be notified to control
+ * points. The id is kept in the tree, and in the index along with it, so
+ * that the same directory gets the same id again, however collisions were
+ * sorted out. */
+static uint32_t
+publish_container (dlna_t *dlna, meta_entry_t *entry, const scan_path_t *path,
+                   uint32_t id)
+{
+  uint32_t oid, got = 0;
+  int i;
+
+  oid = entry->dir->oid ? entry->dir->oid : object_id_hash (path->buf);
+  for (i = 0; i < OBJECT_ID_PROBES; i++, oid = object_id_next (oid))
+  {
+    if (published_contains (oid))
+      continue;
+
+    got = dlna_vfs_add_container (dlna, entry->name, oid, id);
+    if (got == oid)
+    {
+      entry->dir->oid = oid;
+      break;
+    }
+    if (!got)
+      break;
+
+    /* only when it couldn't be told, libdlna numbered it on its own */
+    dlna_vfs_remove_item_by_id (dlna, got);
+    got = 0;
+  }
+
+  if (i == OBJECT_ID_PROBES)
+  {
+    log_verbose (_("No free object id for %s, numbered by libdlna\n"),
+                 path->buf);
+    got = dlna_vfs_add_container (dlna, entry->name, 0, id);
+  }
+
+  if (got)
+    published_add (got, id, entry, path);
+
+  return got;
+}
+
+/* Whether entry may be published from what libdlna found when it was
+ * probed before, without probing it again. */
+static bool
+entry_profiled (const meta_entry_t *entry)
+{
+  return !entry->dir && entry->profile != PROFILE_NONE && !entry->guessed
+    && profile_publish_known ();
+}
+
+/* Publish a file, which libdlna profiles right away unless it did before.
+ * Files it finds no media profile for are given no object id, and
+ * remembered as rejected so that they aren't probed again as long as they
+ * don't change. A file published on its extension is replaced by what
+ * libdlna found, under a new object id. The caller books the I/O budget
+ * beforehand, without the metadata lock, for the files entry_profiled ()
+ * doesn't tell. */
+static void
+probe_resource (dlna_t *dlna, probe_t *probes, scan_io_t *io,
+                meta_entry_t *entry, scan_path_t *path, uint32_t id)
+{
+  bool known = entry_profiled (entry);
+  profile_info_t info = { PROFILE_NONE, 0, 0 };
+  struct timespec start;
+  uint32_t got;
+
+  if (known)
+  {
+    info.profile = entry->profile;
+    info.duration = entry->duration;
+    info.bitrate = entry->bitrate;
+  }
+
+  if (!known)
+    scan_io_begin (io, 0, &start);
+  got = profile_publish (dlna, entry->name, path->buf, entry->size, id,
+                         &info);
+  if (!known)
+    scan_io_end (io, &start);
+
+  if (entry->guessed)
+  {
+    published_forget (entry);
+    dlna_vfs_remove_item_by_id (dlna, entry->id);
+    entry->guessed = false;
+  }
+
+  entry->id = got;
+
+  entry->rejected = !entry->id;
+  entry->profile = entry->id ? info.profile : PROFILE_NONE;
+  entry->duration = entry->id ? info.duration : 0;
+  entry->bitrate = entry->id ? info.bitrate : 0;
+  if (entry->id)
+    published_add (entry->id, id, entry, path);
+  if (!probes)
+    return;
+  if (known)
+    probes->cached++;
+  else
+    probes->probed++;
+}
+
+/* Publish a file as what its extension tells, until the probe thread
+ * finds out what it actually is. */
+static void
+publish_guessed (dlna_t *dlna, meta_entry_t *entry, scan_path_t *path,
+                 uint32_t id)
+{
+  profile_info_t info = { profile_guess (entry->name), 0, 0 };
+
+  if (info.profile == PROFILE_NONE)
+    return;
+
+  entry->id = profile_publish (dlna, entry->name, path->buf, entry->size, id,
+                               &info);
+  if (!entry->id)
+    return;
+
+  entry->profile = info.profile;
+  entry->duration = 0;
+  entry->bitrate = 0;
+  entry->guessed = true;
+  published_add (entry->id, id, entry, path);
+}
+
+/* Publish a file, or only leave it pending when defer is set : in
+ * deferred mode, its extension tells whether it is worth probing and the
+ * probe thread sees to it, otherwise probe_pending () does. When libdlna
+ * can be handed a profile, it is published right away in deferred mode,
+ * as what its extension tells. */
+static void
+publish_resource (dlna_t *dlna, probe_t *probes, scan_io_t *io, bool defer,
+                  meta_entry_t *entry, scan_path_t *path, uint32_t id)
+{
+  if (!defer || entry_profiled (entry))
+  {
+    probe_resource (dlna, probes, io, entry, path, id);
+    return;
+  }
+
+  entry->id = 0;
+  entry->rejected = probes && probes->deferred && !mime_lookup (entry->name);
+  if (!probes)
+    return;
+  if (entry->rejected)
+    probes->skipped++;
+  else
+  {
+    if (probes->deferred && profile_publish_known ())
+      publish_guessed (dlna, entry, path, id);
+    probes->pending++;
+    pthread_cond_signal (&probes->cond);
+  }
+}
+
+/* Account for a file of the index libdlna isn't asked to probe again. */
+static void
+probe_cached (probe_t *probes)
+{
+  if (probes)
+    probes->cached++;
+}
+
+/* Read the headers of the next PREFETCH_WINDOW files of dir libdlna is
+ * about to probe ahead, from entry first on, in disk order. The files
+ * after a sub-directory walked in between are left for later, the walk
+ * could well push their headers out of the cache. dir's path is in path.
+ * Returns the entry to read ahead from next. */
+static int
+probe_prefetch (prefetch_t *pf, scan_path_t *path, meta_dir_t *dir, int first,
+                bool walk_dirs)
+{
+  int i, n;
+
+  for (i = first, n = 0; i < dir->count && n < PREFETCH_WINDOW; i++)
+  {
+    meta_entry_t *entry = &dir->entries[i];
+    size_t len = path->len;
+
+    if (entry->dir)
+    {
+      if (walk_dirs && i > first)
+        break;
+      continue;
+    }
+
+    if (entry->rejected || entry_profiled (entry)
+        || !scan_path_push (path, entry->name))
+      continue;
+    if (prefetch_add (pf, path->buf, meta_dev (entry->dev), entry->ino))
+      n++;
+    scan_path_pop (path, len);
+  }
+
+  prefetch_run (pf);
+
+  return i;
+}
+
+/* Save what the scan found so far every so often, so that an interrupted
+ * scan resumes from there : the index is loaded as usual on the next
+ * start, and the directories which weren't listed yet get listed as it
+ * is revalidated. */
+static void
+scan_checkpoint (scan_t *scan)
+{
+  if (!scan->checkpoint_file
+      || time (NULL) - scan->checkpointed < scan->checkpoint_interval)
+    return;
+
+  if (metaindex_checkpoint (scan->tree, scan->checkpoint_file,
+                            &scan->lock) < 0)
+    log_error (_("Can't write metadata index %s\n"), scan->checkpoint_file);
+  scan->checkpointed = time (NULL);
+}
+
+/* Settle which path a directory reached through several ones is published
+ * under, once listed : the first the walk reaches it through, whichever
+ * the workers happened to list it under. It is listed again if that was
+ * another one, and left empty if the walk met it already. The directory
+ * path is in scan->path. */
+static void
+scan_walk_settle (scan_t *scan, meta_dir_t *dir)
+{
+  const char *path = scan->path.buf;
+  meta_dir_t *dropped;
+  struct stat st;
+
+  if (dir->twin)
+  {
+    if (stat (path, &st) < 0)
+    {
+      dir->twin = false;
+      return;
+    }
+
+    /* still a twin, so that it isn't skipped again */
+    if (scan_seen_claim (&scan->seen, st.st_dev, st.st_ino, dir) == dir)
+    {
+      scan_dir_list (scan, &scan->ctx, !scan->lazy && scan->nr_workers
+                     ? &scan->workers[0] : NULL, dir, path);
+      dir->twin = false;
+      return;
+    }
+
+    dir->twin = false;
+    dir->dev = st.st_dev;
+    dir->ino = st.st_ino;
+    dir->mtime = st.st_mtime;
+  }
+  else if (!dir->ino
+           || scan_seen_claim (&scan->seen, dir->dev, dir->ino, dir) == dir)
+    return;
+
+  log_verbose (_("%s is listed already under another path, skipped\n"),
+               path);
+  scan->ctx.stats.duplicates++;
+
+  /* the workers may still be listing its sub-directories */
+  dropped = meta_dir_new (META_DIR_LISTED);
+  if (!dropped)
+    return;
+  dropped->entries = dir->entries;
+  dropped->count = dir->count;
+  dropped->names = dir->names;
+  dropped->arena = dir->arena;
+  dir->entries = NULL;
+  dir->count = 0;
+  dir->names = NULL;
+  dir->arena = false;
+  scan_drop (scan, dropped);
+}
+
+/* Walk a directory once it is listed, publishing it to the VFS (unless
+ * dlna is NULL) in the exact order the serial scan would, whatever the
+ * order the workers listed the sub-directories in. The directory path
+ * is in scan->path. Walks levels sub-directories deep, the whole tree if
+ * negative : deeper ones are only published as empty containers, and
+ * left to the workers unless the scan is lazy. Returns the number of
+ * entries published. */
+static int
+scan_walk (scan_t *scan, dlna_t *dlna, meta_dir_t *dir, uint32_t id,
+           int levels)
+{
+  scan_path_t *path = &scan->path;
+  bool defer = scan_defers_probes (scan);
+  bool prefetch = dlna && !defer;
+  int i, count, next = 0;
+
+  if (scan_cancelled (scan))
+    return 0;
+
+  if (scan_dir_claim (scan, dir))
+    scan_dir_list (scan, &scan->ctx,
+                   !scan->lazy && scan->nr_workers ? &scan->workers[0] : NULL,
+                   dir, path->buf);
+  else
+  {
+    pthread_mutex_lock (&scan->lock);
+    while (dir->state != META_DIR_LISTED)
+      pthread_cond_wait (&scan->listed_cond, &scan->lock);
+    pthread_mutex_unlock (&scan->lock);
+  }
+  scan_walk_settle (scan, dir);
+  scan_dir_dedup (&scan->ctx, dir);
+
+  if (scan->progress)
+  {
+    __atomic_add_fetch (&scan->progress->dirs, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch (&scan->progress->pending, 1, __ATOMIC_RELAXED);
+  }
+  scan_checkpoint (scan);
+
+  count = dir->count;
+  for (i = 0; i < dir->count; i++)
+  {
+    meta_entry_t *entry = &dir->entries[i];
+    size_t len = path->len;
+
+    if (prefetch && i == next)
+      next = probe_prefetch (&scan->prefetch, path, dir, i, levels != 0);
+
+    if (!scan_path_push (path, entry->name))
+      continue;
+
+    if (dlna)
+    {
+      /* wait for the I/O budget before taking the lock */
+      if (!entry->dir && !defer)
+        scan_io_begin (scan->ctx.io, 1, NULL);
+      scan_publish_begin (scan);
+      if (entry->dir)
+        entry->id = publish_container (dlna, entry, path, id);
+      else
+        publish_resource (dlna, scan->probes, scan->ctx.io, defer, entry,
+                          path, id);
+      scan_publish_end (scan);
+    }
+
+    if (scan->progress)
+    {
+      __atomic_add_fetch (entry->dir ? &scan->progress->pending
+                          : &scan->progress->files, 1, __ATOMIC_RELAXED);
+    }
+
+    if (entry->dir && levels)
+      count += scan_walk (scan, dlna, entry->dir, entry->id,
+                          levels < 0 ? levels : levels - 1);
+
+    scan_path_pop (path, len);
+  }
+
+  return count;
+}
+
+static bool
+share_is_lazy (content_list_t *lazylist, const char *share)
+{
+  int i;
+
+  if (!lazylist)
+    return false;
+
+  for (i = 0; i < lazylist->count; i++)
+    if (!strcmp (lazylist->content[i], share))
+      return true;
+
+  return false;
+}
+
+/* Walk the directories found level sub-directories below dir, which is
+ * in the scan path, publishing their entries. Returns the number of
+ * entries published. */
+static int
+scan_walk_level (scan_t *scan, dlna_t *dlna, meta_dir_t *dir, uint32_t id,
+                 int level)
+{
+  scan_path_t *path = &scan->path;
+  int i, count = 0;
+
+  if (!level)
+    return scan_walk (scan, dlna, dir, id, 0);
+
+  for (i = 0; i < dir->count && !scan_cancelled (scan); i++)
+  {
+    meta_entry_t *entry = &dir->entries[i];
+    size_t len = path->len;
+
+    if (!entry->dir || !scan_path_push (path, entry->name))
+      continue;
+
+    count += scan_walk_level (scan, dlna, entry->dir, entry->id, level - 1);
+    scan_path_pop (path, len);
+  }
+
+  return count;
+}
+
+/* Scan the shared directories breadth-first : the top level of every
+ * share is published first, then the next level of all of them, and so
+ * on, so that clients browsing during the scan see the upper containers
+ * filled in first. Lazy shares stop after their top level. Called without
+ * the metadata lock, which is only taken to publish each entry. */
+static meta_tree_t *
+scan_content (ushare_t *ut, content_list_t *content, content_list_t *lazylist,
+              share_policy_list_t *policies, dlna_t *dlna, const bool *cancel)
+{
+  meta_tree_t *tree;
+  scan_t scan;
+  int i, level, count;
+
+  tree = meta_tree_new (content->count);
+  if (!tree)
+    return NULL;
+
+  scan_init (&scan, ut->scan_threads, ut->scan_queue_depth, cancel,
+             &ut->scan_io);
+  scan_shares (&scan, content, policies);
+  scan.probes = &ut->probes;
+  if (scan.nr_workers)
+    log_verbose (_("Scanning with %d threads\n"), scan.nr_workers);
+
+  /* read by the presentation page meanwhile */
+  __atomic_store_n (&ut->scan_progress.dirs, 0, __ATOMIC_RELAXED);
+  __atomic_store_n (&ut->scan_progress.pending, 0, __ATOMIC_RELAXED);
+  __atomic_store_n (&ut->scan_progress.files, 0, __ATOMIC_RELAXED);
+  __atomic_store_n (&ut->scan_progress.running, true, __ATOMIC_RELEASE);
+  scan.progress = &ut->scan_progress;
+  /* the workers are running already */
+  __atomic_store_n (&scan.breadth_first, true, __ATOMIC_RELAXED);
+  scan.tree = tree;
+  if (dlna)
+    scan.publish_lock = &ut->metadata_lock;
+  pthread_mutex_lock (&ut->metadata_lock);
+  if (dlna && ut->index_file && ut->checkpoint_interval)
+  {
+    scan.checkpoint_file = ut->index_file;
+    scan.checkpoint_interval = ut->checkpoint_interval;
+    scan.checkpointed = time (NULL);
+  }
+  pthread_mutex_unlock (&ut->metadata_lock);
+
+  for (i = 0 ; i < content->count ; i++)
+  {
+    meta_entry_t *root = &tree->roots[i];
+
+    root->name = strdup (content->content[i]);
+    root->dir = meta_dir_new (META_DIR_QUEUED);
+    if (!root->name || !root->dir)
+      continue;
+
+    __atomic_add_fetch (&ut->scan_progress.pending, 1, __ATOMIC_RELAXED);
+    if (scan.nr_workers && !share_is_lazy (lazylist, root->name))
+    {
+      root->dir->path = strdup (root->name);
+      if (root->dir->path
+          && !scan_worker_push (&scan.workers[i % scan.nr_workers],
+                                root->dir))
+      {
+        free (root->dir->path);
+        root->dir->path = NULL;
+      }
+    }
+  }
+
+  /* add files from content directory */
+  for (level = 0, count = 1; count && !scan_cancelled (&scan); level++)
+  {
+    for (i = 0, count = 0; i < content->count; i++)
+    {
+      meta_entry_t *root = &tree->roots[i];
+
+      if (!root->dir || !scan_path_set (&scan.path, root->name))
+        continue;
+
+      scan.lazy = share_is_lazy (lazylist, root->name);
+      if (level && scan.lazy)
+        continue;
+
+      if (!level && dlna)
+        log_info (_("Looking for files in content directory : %s\n"),
+                  root->name);
+
+      count += scan_walk_level (&scan, dlna, root->dir, 0, level);
+    }
+  }
+
+  scan_finish (&scan);
+  __atomic_store_n (&ut->scan_progress.running, false, __ATOMIC_RELEASE);
+
+  return tree;
+}
+
+/* Publish a tree loaded from the index : files libdlna rejected when
+ * they were scanned are left out, and those it profiled are published
+ * from what it found, without probing them again. Anything else is left
+ * pending, for probe_pending () or the probe thread to probe once the
+ * tree is in place, rather than holding its publication up. The metadata
+ * lock is only held while publishing each entry. */
+static void
+publish_dir (ushare_t *ut, scan_path_t *path, meta_dir_t *dir, uint32_t id)
+{
+  probe_t *probes = &ut->probes;
+  int i;
+
+  for (i = 0; i < dir->count && !metadata_cancelled (ut); i++)
+  {
+    meta_entry_t *entry = &dir->entries[i];
+    size_t len = path->len;
+
+    if (!entry->dir && entry->rejected)
+    {
+      pthread_mutex_lock (&ut->metadata_lock);
+      probe_cached (probes);
+      pthread_mutex_unlock (&ut->metadata_lock);
+      continue;
+    }
+
+    if (!scan_path_push (path, entry->name))
+      continue;
+
+    pthread_mutex_lock (&ut->metadata_lock);
+    if (entry->dir)
+      entry->id = publish_container (ut->dlna, entry, path, id);
+    else
+      publish_resource (ut->dlna, probes, &ut->scan_io, true, entry, path,
+                        id);
+    pthread_mutex_unlock (&ut->metadata_lock);
+
+    if (entry->dir)
+      publish_dir (ut, path, entry->dir, entry->id);
+
+    scan_path_pop (path, len);
+  }
+}
+
+/* Publish tree, which nobody else sees yet. */
+static void
+publish_tree (ushare_t *ut, meta_tree_t *tree)
+{
+  scan_path_t path;
+  int i;
+
+  for (i = 0; i < tree->count; i++)
+    if (tree->roots[i].dir && scan_path_set (&path, tree->roots[i].name))
+      publish_dir (ut, &path, tree->roots[i].dir, 0);
+}
+
+/* Take everything published back, called with the metadata lock held. */
+static void
+unpublish_all (ushare_t *ut)
+{
+  pthread_rwlock_wrlock (&published_lock);
+  objpath_free (&published);
+  pthread_rwlock_unlock (&published_lock);
+  dlna_vfs_remove_item_by_id (ut->dlna, 0);
+}
+
+static void
+probe_log (ushare_t *ut)
+{
+  probe_t *probes = &ut->probes;
+  unsigned long total = probes->probed + probes->cached;
+
+  log_info (_("Media profiling : %lu probed, %lu probes avoided "
+              "(%.1f%% avoided)\n"), probes->probed, probes->cached,
+            total ? 100.0 * probes->cached / total : 0.0);
+  if (probes->prefetched)
+    log_verbose (_("Media headers read ahead : %lu, %lu located on disk\n"),
+                 probes->prefetched, probes->located);
+}
+
+static bool
+meta_tree_match_content (const meta_tree_t *tree, content_list_t *content)
+{
+  int i;
+
+  if (tree->count != content->count)
+    return false;
+
+  for (i = 0; i < tree->count; i++)
+    if (!tree->roots[i].name
+        || strcmp (tree->roots[i].name, content->content[i]))
+      return false;
+
+  return true;
+}
+
+/* The published tree as the index is to be saved : laid out with the
+ * metadata lock held, and written once it is released. */
+typedef struct index_save_s {
+  metaindex_image_t *image;
+  char *file;
+} index_save_t;
+
+#define INDEX_SAVE_INIT { NULL, NULL }
+
+/* Lay the published tree out for write_metadata_index (), called with the
+ * metadata lock held. */
+static void
+save_metadata_index (ushare_t *ut, index_save_t *save)
+{
+  if (save->image || !ut->index_file || !ut->metadata)
+    return;
+
+  save->file = strdup (ut->index_file);
+  if (save->file)
+    save->image = metaindex_snapshot (ut->metadata);
+  if (!save->image)
+    log_error (_("Can't write metadata index %s\n"), ut->index_file);
+}
+
+/* Write what save_metadata_index () laid out, if anything, without the
+ * metadata lock : publishing and browsing don't wait for the disk. */
+static void
+write_metadata_index (index_save_t *save)
+{
+  if (save->image && metaindex_image_write (save->image, save->file) < 0)
+    log_error (_("Can't write metadata index %s\n"), save->file);
+
+  if (save->image)
+    metaindex_image_free (save->image);
+  if (save->file)
+    free (save->file);
+  save->image = NULL;
+  save->file = NULL;
+}
+
+typedef struct rescan_s {
+  scan_t scan;
+  dlna_t *dlna;
+  time_t since;
+  int added;
+  int removed;
+  int updated;
+} rescan_t;
+
+static void
+rescan_remove (rescan_t *rs, meta_entry_t *entry)
+{
+  published_forget (entry);
+  if (entry->id)
+    dlna_vfs_remove_item_by_id (rs->dlna, entry->id);
+  meta_entry_free (entry);
+  rs->removed++;
+}
+
+static void
+rescan_add (rescan_t *rs, meta_entry_t *entry, uint32_t id)
+{
+  scan_path_t *path = &rs->scan.path;
+  size_t len = path->len;
+
+  if (!scan_path_push (path, entry->name))
+    return;
+
+  if (entry->dir)
+  {
+    entry->id = publish_container (rs->dlna, entry, path, id);
+    if (!rs->scan.lazy)
+      scan_walk (&rs->scan, rs->dlna, entry->dir, entry->id, -1);
+  }
+  else
+    publish_resource (rs->dlna, rs->scan.probes, rs->scan.ctx.io,
+                      scan_defers_probes (&rs->scan), entry, path, id);
+  rs->added++;
+
+  scan_path_pop (path, len);
+}
+
+static void rescan_dir (rescan_t *rs, meta_dir_t *dir, uint32_t id);
+static void probe_pending (ushare_t *ut);
+
+/* Merge a fresh listing of a directory into the published one : both are
+ * sorted the same way, so a single pass finds removed, added and modified
+ * entries. Untouched entries are moved over and keep their object id. */
+static void
+rescan_merge (rescan_t *rs, meta_dir_t *dir, meta_dir_t *fresh, uint32_t id)
+{
+  scan_path_t *path = &rs->scan.path;
+  meta_entry_t *entries;
+  sort_mode_t mode = scan_sort_mode (&rs->scan, path->buf);
+  bool foreign = false;
+  int i = 0, j = 0, n = 0;
+
+  entries = malloc (fresh->count * sizeof (meta_entry_t));
+  if (fresh->count && !entries)
+  {
+    for (j = 0; j < fresh->count; j++)
+      meta_entry_free (&fresh->entries[j]);
+    goto out;
+  }
+
+  while (i < dir->count || j < fresh->count)
+  {
+    meta_entry_t *old = i < dir->count ? &dir->entries[i] : NULL;
+    meta_entry_t *new = j < fresh->count ? &fresh->entries[j] : NULL;
+    int cmp;
+
+    if (!old)
+      cmp = 1;
+    else if (!new)
+      cmp = -1;
+    else
+      cmp = sort_cmp (mode, old->name, new->name);
+
+    if (cmp < 0)
+    {
+      rescan_remove (rs, old);
+      i++;
+    }
+    else if (cmp > 0)
+    {
+      rescan_add (rs, new, id);
+      entries[n++] = *new;
+      foreign = true;
+      j++;
+    }
+    else if (old->dir && new->dir)
+    {
+      size_t len = path->len;
+
+      if (scan_path_push (path, old->name))
+      {
+        rescan_dir (rs, old->dir, old->id);
+        scan_path_pop (path, len);
+      }
+      entries[n++] = *old;
+      meta_entry_free (new);
+      i++, j++;
+    }
+    else if (meta_entry_unchanged (old, new) && old->mtime < rs->since)
+    {
+      entries[n++] = *old;
+      meta_entry_free (new);
+      i++, j++;
+    }
+    else
+    {
+      rescan_remove (rs, old);
+      rescan_add (rs, new, id);
+      entries[n++] = *new;
+      foreign = true;
+      rs->removed--, rs->added--, rs->updated++;
+      i++, j++;
+    }
+  }
+
+  if (dir->entries && !dir->arena)
+    free (dir->entries);
+  dir->entries = entries;
+  dir->arena = false;
+  dir->count = n;
+  dir->dev = fresh->dev;
+  dir->ino = fresh->ino;
+  dir->mtime = fresh->mtime;
+
+  /* those serving the entries mustn't see their names move */
+  if (foreign)
+  {
+    pthread_rwlock_wrlock (&published_lock);
+    if (meta_dir_pack_names (dir))
+      published_rename_entries (dir, path->root, false);
+    pthread_rwlock_unlock (&published_lock);
+  }
+
+ out:
+  if (fresh->entries && !fresh->arena)
+    free (fresh->entries);
+  if (fresh->names)
+    free (fresh->names);
+  free (fresh);
+}
+
+/* Fresh listing made of the known entries, when the directory itself
+ * didn't change : files are stat'ed back, sub-directories are only
+ * looked at when recursing. Names are borrowed from dir. */
+static void
+rescan_dir_restat (scan_ctx_t *ctx, meta_dir_t *dir, meta_dir_t *fresh,
+                   int fd, const struct stat *st)
+{
+  int i;
+
+  fresh->dev = st->st_dev;
+  fresh->ino = st->st_ino;
+  fresh->mtime = st->st_mtime;
+
+  fresh->entries = malloc (dir->count * sizeof (meta_entry_t));
+  if (!fresh->entries)
+    return;
+
+  for (i = 0; i < dir->count; i++)
+  {
+    meta_entry_t *entry = &fresh->entries[fresh->count];
+
+    /* the share policy may have changed meanwhile */
+    if ((dir->entries[i].link
+         && !scan_entry_allowed (ctx, dir->entries[i].name, DT_LNK))
+        || !scan_entry_allowed (ctx, dir->entries[i].name,
+                                dir->entries[i].dir ? DT_DIR : DT_UNKNOWN))
+      continue;
+
+    memset (entry, 0, sizeof (meta_entry_t));
+    entry->name = dir->entries[i].name;
+    entry->link = dir->entries[i].link;
+
+    if (dir->entries[i].dir)
+    {
+      entry->dir = meta_dir_new (META_DIR_QUEUED);
+      if (!entry->dir)
+        continue;
+      ctx->stats.skipped++;
+    }
+    fresh->count++;
+  }
+
+  scan_dir_stat (ctx, fresh, fd, 0);
+  scan_dir_dedup (ctx, fresh);
+}
+
+/* Bring an already published directory, whose path is in the scan path,
+ * up to date. Its entries are only listed again when the directory itself
+ * changed, otherwise the known names are simply stat'ed back. */
+static void
+rescan_dir (rescan_t *rs, meta_dir_t *dir, uint32_t id)
+{
+  scan_t *scan = &rs->scan;
+  meta_dir_t *fresh;
+  struct stat st;
+  int fd;
+
+  if (scan_cancelled (scan))
+    return;
+
+  /* left aside by a lazy scan, and nothing to compare with */
+  if (dir->state == META_DIR_QUEUED)
+  {
+    if (!rs->scan.lazy)
+      rs->added += scan_walk (scan, rs->dlna, dir, id, -1);
+    return;
+  }
+
+  meta_dir_resort (dir, scan_sort_mode (scan, scan->path.buf));
+
+  fresh = meta_dir_new (META_DIR_LISTED);
+  if (!fresh)
+    return;
+
+  /* a directory which can't be opened any more just looks empty */
+  fd = open (scan->path.buf, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0 || fstat (fd, &st) < 0)
+    perror (scan->path.buf);
+  /* an entry modified within the second the previous scan started
+   * can't be told from its mtime, such racy entries are listed again */
+  else if (st.st_dev != dir->dev || st.st_ino != dir->ino
+           || st.st_mtime != dir->mtime || dir->mtime >= rs->since)
+  {
+    scan->ctx.stats.dirs++;
+    scan_ctx_enter (&scan->ctx, scan->path.buf);
+    scan_dir_read (&scan->ctx, fresh, fd, &st, scan->path.len);
+    scan_dir_dedup (&scan->ctx, fresh);
+  }
+  else
+  {
+    scan->ctx.stats.dirs++;
+    scan_ctx_enter (&scan->ctx, scan->path.buf);
+    rescan_dir_restat (&scan->ctx, dir, fresh, fd, &st);
+  }
+  scan->ctx.path = NULL;
+
+  if (fd >= 0)
+    close (fd);
+
+  rescan_merge (rs, dir, fresh, id);
+}
+
+static void
+rescan_content (rescan_t *rs, ushare_t *ut)
+{
+  meta_tree_t *tree = ut->metadata;
+  content_list_t *content = ut->contentlist;
+  meta_entry_t *roots;
+  int i, j;
+
+  roots = calloc (content->count, sizeof (meta_entry_t));
+  if (content->count && !roots)
+    return;
+
+  for (i = 0; i < content->count; i++)
+  {
+    meta_entry_t *root = &roots[i];
+    meta_entry_t *old = NULL;
+
+    for (j = 0; j < tree->count && !old; j++)
+      if (tree->roots[j].name && tree->roots[j].dir
+          && !strcmp (tree->roots[j].name, content->content[i]))
+        old = &tree->roots[j];
+
+    /* the published subtree is kept, and updated in place */
+    if (old)
+    {
+      *root = *old;
+      memset (old, 0, sizeof (meta_entry_t));
+    }
+    else
+    {
+      root->name = strdup (content->content[i]);
+      root->dir = meta_dir_new (META_DIR_QUEUED);
+    }
+
+    /* published names are those of the tree, the share's included */
+    if (!root->name || !root->dir
+        || !scan_path_set (&rs->scan.path, root->name))
+      continue;
+    rs->scan.lazy = share_is_lazy (ut->lazylist, root->name);
+
+    if (old)
+      rescan_dir (rs, root->dir, 0);
+    else
+    {
+      log_info (_("Looking for files in content directory : %s\n"),
+                root->name);
+      scan_walk (&rs->scan, rs->dlna, root->dir, 0, rs->scan.lazy ? 0 : -1);
+    }
+  }
+
+  /* whatever is left belongs to shares which are gone */
+  for (i = 0; i < tree->count; i++)
+  {
+    if (tree->roots[i].dir)
+    {
+      for (j = 0; j < tree->roots[i].dir->count; j++)
+        rescan_remove (rs, &tree->roots[i].dir->entries[j]);
+      tree->roots[i].dir->count = 0;
+    }
+    meta_root_free (&tree->roots[i]);
+  }
+
+  if (tree->roots)
+    free (tree->roots);
+  tree->roots = roots;
+  tree->count = content->count;
+}
+
+/**
+ * rescan_metadata_list: update the published metadata with what changed
+ *  on disk since the last scan, leaving untouched entries (and thus their
+ *  object ids) as they are.
+ */
+void
+rescan_metadata_list (ushare_t *ut)
+{
+  index_save_t save = INDEX_SAVE_INIT;
+  unsigned long probed;
+  rescan_t rs;
+  int prio;
+
+  pthread_mutex_lock (&ut->metadata_lock);
+
+  /* the first scan publishes without the lock, rather than waiting for
+   * it the update is made once it is done */
+  if (!ut->metadata && metadata_thread_running (ut)
+      && !pthread_equal (pthread_self (), ut->metadata_thread))
+  {
+    ut->metadata_rescan = true;
+    pthread_mutex_unlock (&ut->metadata_lock);
+    log_verbose (_("Metadata update left for after the scan\n"));
+    return;
+  }
+
+  if (!ut->metadata)
+  {
+    pthread_mutex_unlock (&ut->metadata_lock);
+    build_metadata_list (ut);
+    return;
+  }
+
+  log_info (_("Updating Metadata List ...\n"));
+
+  /* run from whichever thread noticed the change, for the time being */
+  prio = scan_io_thread (&ut->scan_io);
+
+  scan_init (&rs.scan, ut->scan_threads, ut->scan_queue_depth,
+             &ut->metadata_cancel, &ut->scan_io);
+  scan_shares (&rs.scan, ut->contentlist, ut->policies);
+  rs.scan.probes = &ut->probes;
+  rs.scan.defer_probes = true;
+  rs.dlna = ut->dlna;
+  rs.since = ut->metadata->scanned;
+  ut->metadata->scanned = time (NULL);
+  rs.added = 0;
+  rs.removed = 0;
+  rs.updated = 0;
+  probed = ut->probes.probed;
+
+  rescan_content (&rs, ut);
+  scan_finish (&rs.scan);
+  probe_pending (ut);
+  ut->metadata_generation++;
+
+  log_info (_("Metadata updated : %d added, %d removed, %d modified\n"),
+            rs.added, rs.removed, rs.updated);
+  probe_log (ut);
+
+  /* what files left pending were found to be is worth keeping as well */
+  if (!metadata_cancelled (ut) && (rs.added || rs.removed || rs.updated
+                                   || ut->probes.probed != probed))
+    save_metadata_index (ut, &save);
+
+  pthread_mutex_unlock (&ut->metadata_lock);
+
+  write_metadata_index (&save);
+  scan_io_thread_restore (prio);
+}
+
+/* Carry what didn't change in a published directory over to its new
+ * generation, whose path is in the scan path, and publish the difference.
+ * Both are sorted the same way, as in rescan_merge (). Kept entries keep
+ * their object id, anything else of the published generation is removed
+ * from the VFS. */
+static void
+generation_merge (rescan_t *rs, meta_dir_t *dir, meta_dir_t *fresh,
+                  uint32_t id)
+{
+  scan_path_t *path = &rs->scan.path;
+  sort_mode_t mode = scan_sort_mode (&rs->scan, path->buf);
+  int i = 0, j = 0;
+
+  /* the new generation was sorted as the policies were when it started */
+  meta_dir_resort (dir, mode);
+  meta_dir_resort (fresh, mode);
+
+  while (i < dir->count || j < fresh->count)
+  {
+    meta_entry_t *old = i < dir->count ? &dir->entries[i] : NULL;
+    meta_entry_t *new = j < fresh->count ? &fresh->entries[j] : NULL;
+    size_t len = path->len;
+    int cmp;
+
+    if (!old)
+      cmp = 1;
+    else if (!new)
+      cmp = -1;
+    else
+      cmp = sort_cmp (mode, old->name, new->name);
+
+    if (cmp < 0)
+    {
+      rescan_remove (rs, old);
+      i++;
+    }
+    else if (cmp > 0)
+    {
+      rescan_add (rs, new, id);
+      j++;
+    }
+    else if (old->dir && new->dir)
+    {
+      new->id = old->id;
+      new->dir->oid = old->dir->oid;
+      published_rename (new, path->root);
+
+      /* a lazy directory the new generation didn't list is kept as is,
+       * out of the memory of the published generation */
+      if (new->dir->state != META_DIR_LISTED)
+      {
+        meta_entry_free (new);
+        meta_dir_own (old->dir);
+        new->dir = old->dir;
+        old->dir = NULL;
+        published_rename_dir (new->dir, path->root);
+      }
+      else if (scan_path_push (path, new->name))
+      {
+        if (old->dir->state != META_DIR_LISTED)
+          rs->added += scan_walk (&rs->scan, rs->dlna, new->dir, new->id,
+                                  rs->scan.lazy ? 0 : -1);
+        else
+          generation_merge (rs, old->dir, new->dir, new->id);
+        scan_path_pop (path, len);
+      }
+      i++, j++;
+    }
+    else if (meta_entry_unchanged (old, new) && old->mtime < rs->since)
+    {
+      new->id = old->id;
+      new->rejected = old->rejected;
+      new->profile = old->profile;
+      new->duration = old->duration;
+      new->bitrate = old->bitrate;
+      new->guessed = old->guessed;
+      if (new->id)
+        published_rename (new, path->root);
+      i++, j++;
+    }
+    else
+    {
+      rescan_remove (rs, old);
+      rescan_add (rs, new, id);
+      rs->removed--, rs->added--, rs->updated++;
+      i++, j++;
+    }
+  }
+}
+
+/* Bring the published generation up to date with tree, scanned without
+ * being published : the difference is applied to the VFS entry by entry,
+ * as a rescan does, then tree replaces the published one as the mirror.
+ * Called with the metadata lock held, so that uShare's own readers see
+ * either tree, whereas control points browsing meanwhile see the VFS
+ * change progressively. */
 static void
-add_container (dlna_t *dlna, char *dir, uint32_t id)
+generation_merge_tree (ushare_t *ut, meta_tree_t *tree, content_list_t *lazylist)
 {
-  struct dirent **namelist;
-  int n, i;
-  
-  n = scandir (dir, &namelist, 0, alphasort);
-  if (n < 0)
+  meta_tree_t *old = ut->metadata;
+  rescan_t rs;
+  int i, j;
+
+  scan_init (&rs.scan, 0, ut->scan_queue_depth, NULL, &ut->scan_io);
+  scan_shares (&rs.scan, ut->contentlist, ut->policies);
+  rs.scan.probes = &ut->probes;
+  rs.scan.defer_probes = true;
+  rs.dlna = ut->dlna;
+  /* what the published generation was profiled from is only known to be
+   * right for files it saw modified before it started, as in a rescan */
+  rs.since = old->scanned;
+  rs.added = 0;
+  rs.removed = 0;
+  rs.updated = 0;
+
+  for (i = 0; i < tree->count; i++)
   {
-    perror ("scandir");
-    return;
+    meta_entry_t *root = &tree->roots[i];
+    meta_entry_t *prev = NULL;
+
+    if (!root->name || !root->dir || !scan_path_set (&rs.scan.path, root->name))
+      continue;
+    rs.scan.lazy = share_is_lazy (lazylist, root->name);
+
+    for (j = 0; j < old->count && !prev; j++)
+      if (old->roots[j].name && old->roots[j].dir
+          && !strcmp (old->roots[j].name, root->name))
+        prev = &old->roots[j];
+
+    if (!prev || prev->dir->state != META_DIR_LISTED)
+      rs.added += scan_walk (&rs.scan, rs.dlna, root->dir, 0,
+                             rs.scan.lazy ? 0 : -1);
+    else if (root->dir->state == META_DIR_LISTED)
+      generation_merge (&rs, prev->dir, root->dir, 0);
+    else
+    {
+      meta_entry_free (root);
+      meta_dir_own (prev->dir);
+      root->dir = prev->dir;
+      prev->dir = NULL;
+      published_rename_dir (root->dir, root->name);
+    }
   }
 
-  for (i = 0; i < n; i++)
+  /* whatever is left belongs to shares which are gone */
+  for (i = 0; i < old->count; i++)
+    if (old->roots[i].dir)
+    {
+      for (j = 0; j < tree->count; j++)
+        if (tree->roots[j].name && old->roots[i].name
+            && !strcmp (tree->roots[j].name, old->roots[i].name))
+          break;
+      if (j < tree->count)
+        continue;
+      for (j = 0; j < old->roots[i].dir->count; j++)
+        rescan_remove (&rs, &old->roots[i].dir->entries[j]);
+      old->roots[i].dir->count = 0;
+    }
+
+  scan_finish (&rs.scan);
+
+  meta_tree_free (old);
+  ut->metadata = tree;
+
+  log_info (_("Metadata rebuilt : %d added, %d removed, %d modified\n"),
+            rs.added, rs.removed, rs.updated);
+  probe_log (ut);
+}
+
+/* Probe and publish up to max files left pending in dir, published as
+ * id and whose path is in path, or only add them to pf when not NULL.
+ * Returns how many more could be probed. */
+static int
+probe_dir (dlna_t *dlna, probe_t *probes, scan_io_t *io, prefetch_t *pf,
+           scan_path_t *path, meta_dir_t *dir, uint32_t id, int max)
+{
+  int i;
+
+  for (i = 0; i < dir->count && max; i++)
   {
-    struct stat st;
-    char *fullpath = NULL;
+    meta_entry_t *entry = &dir->entries[i];
+    size_t len = path->len;
+
+    /* containers which didn't make it to the VFS, and files done with */
+    if (entry->dir ? !entry->id
+        : (entry->id && !entry->guessed) || entry->rejected)
+      continue;
 
-    if (namelist[i]->d_name[0] == '.')
+    if (!scan_path_push (path, entry->name))
     {
-      free (namelist[i]);
+      entry->rejected = !entry->dir;
       continue;
     }
 
-    fullpath = malloc (strlen (dir) + strlen (namelist[i]->d_name) + 2);
-    sprintf (fullpath, "%s/%s", dir, namelist[i]->d_name);
+    if (entry->dir)
+      max = probe_dir (dlna, probes, io, pf, path, entry->dir, entry->id,
+                       max);
+    else if (pf)
+    {
+      if (prefetch_add (pf, path->buf, meta_dev (entry->dev), entry->ino))
+        max--;
+    }
+    else
+    {
+      probe_resource (dlna, probes, io, entry, path, id);
+      if (probes->pending)
+        probes->pending--;
+      max--;
+    }
+
+    scan_path_pop (path, len);
+  }
+
+  return max;
+}
+
+/* Probe and publish up to max pending files of the published tree, or
+ * only add them to pf. Returns how many more could be probed. */
+static int
+probe_tree (ushare_t *ut, prefetch_t *pf, int max)
+{
+  scan_path_t path;
+  int i;
+
+  for (i = 0; i < ut->metadata->count && max; i++)
+  {
+    meta_entry_t *root = &ut->metadata->roots[i];
+
+    if (root->dir && scan_path_set (&path, root->name))
+      max = probe_dir (ut->dlna, &ut->probes, &ut->scan_io, pf, &path,
+                       root->dir, 0, max);
+  }
+
+  return max;
+}
+
+/* Probe the next PREFETCH_WINDOW pending files, PROBE_BATCH at a time.
+ * Called with the metadata lock held, which is released while reading
+ * ahead and while waiting for the I/O budget of each batch. Returns true
+ * once nothing is left pending. */
+static bool
+probe_window (ushare_t *ut, prefetch_t *pf)
+{
+  probe_t *probes = &ut->probes;
+  int n, left;
+
+  /* read the headers of the next files ahead without the lock, libdlna
+   * then finds them in the cache whatever the order it probes them in */
+  left = probe_tree (ut, pf, PREFETCH_WINDOW);
+  pthread_mutex_unlock (&ut->metadata_lock);
+  prefetch_run (pf);
+  pthread_mutex_lock (&ut->metadata_lock);
+  probe_prefetched (probes, pf);
+
+  for (n = PREFETCH_WINDOW - left; n > 0 && !probes->stop && ut->metadata;
+       n -= PROBE_BATCH)
+  {
+    /* whoever waits for the metadata gets it between batches */
+    pthread_mutex_unlock (&ut->metadata_lock);
+    scan_io_begin (&ut->scan_io, MIN (n, PROBE_BATCH), NULL);
+    sched_yield ();
+    pthread_mutex_lock (&ut->metadata_lock);
+
+    if (ut->metadata)
+      probe_tree (ut, NULL, MIN (n, PROBE_BATCH));
+  }
+
+  if (!ut->metadata)
+    return false;
+
+  /* files counted as pending may have gone with a rescan meanwhile */
+  if (left || !probes->pending)
+  {
+    probes->pending = 0;
+    return true;
+  }
+
+  return false;
+}
+
+/* Probe the files left pending by a scan which held the metadata lock
+ * all along, unless the probe thread sees to them. Called with the lock
+ * held, which is released while waiting for the I/O budget. */
+static void
+probe_pending (ushare_t *ut)
+{
+  prefetch_t pf;
+
+  if (ut->probes.deferred)
+  {
+    pthread_cond_signal (&ut->probes.cond);
+    return;
+  }
+
+  prefetch_init (&pf, &ut->scan_io);
+  while (ut->probes.pending && ut->metadata && !metadata_cancelled (ut))
+    if (probe_window (ut, &pf))
+      break;
+  prefetch_free (&pf);
+}
+
+/**
+ * probe_thread: publish the files deferred by the scans, a few at a time
+ *  and at the lowest priority, so that they neither hold the metadata
+ *  for long nor compete with streaming.
+ */
+static void *
+probe_thread (void *arg)
+{
+  ushare_t *ut = (ushare_t *) arg;
+  probe_t *probes = &ut->probes;
+  prefetch_t pf;
 
-    if (stat (fullpath, &st) < 0)
+  prefetch_init (&pf, &ut->scan_io);
+
+#ifdef __linux__
+  /* Linux applies the nice value to the calling thread only */
+  setpriority (PRIO_PROCESS, syscall (SYS_gettid), 19);
+#endif /* __linux__ */
+  scan_io_thread (&ut->scan_io);
+
+  pthread_mutex_lock (&ut->metadata_lock);
+  while (!probes->stop)
+  {
+    if (!ut->metadata || !probes->pending)
     {
-      free (namelist[i]);
-      free (fullpath);
+      pthread_cond_wait (&probes->cond, &ut->metadata_lock);
       continue;
     }
 
-    if (S_ISDIR (st.st_mode))
+    if (probe_window (ut, &pf))
     {
-      uint32_t cid;
-      cid = dlna_vfs_add_container (dlna, basename (fullpath), 0, id);
-      add_container (dlna, fullpath, cid);
+      index_save_t save = INDEX_SAVE_INIT;
+
+      log_verbose (_("Deferred media profiling done\n"));
+      probe_log (ut);
+      save_metadata_index (ut, &save);
+      pthread_mutex_unlock (&ut->metadata_lock);
+      write_metadata_index (&save);
+      pthread_mutex_lock (&ut->metadata_lock);
     }
-    else
-      dlna_vfs_add_resource (dlna, basename (fullpath),
-                                   fullpath, st.st_size, id);
-    
-    free (namelist[i]);
-    free (fullpath);
   }
-  free (namelist);
+  pthread_mutex_unlock (&ut->metadata_lock);
+
+  prefetch_free (&pf);
+
+  return NULL;
+}
+
+static void
+probe_thread_start (ushare_t *ut)
+{
+  if (!ut->probes.deferred || ut->probes.running)
+    return;
+
+  ut->probes.stop = false;
+  if (pthread_create (&ut->probes.thread, NULL, probe_thread, ut))
+    perror ("Failed to create thread");
+  else
+    ut->probes.running = true;
+}
+
+static void
+probe_thread_stop (ushare_t *ut)
+{
+  if (!ut->probes.running)
+    return;
+
+  pthread_mutex_lock (&ut->metadata_lock);
+  ut->probes.stop = true;
+  pthread_cond_signal (&ut->probes.cond);
+  pthread_mutex_unlock (&ut->metadata_lock);
+
+  pthread_join (ut->probes.thread, NULL);
+  ut->probes.running = false;
+}
+
+static void *(*metadata_thread_func) (void *);
+
+/* The background metadata thread only ever scans, its disk accesses
+ * give way to streaming from the start. */
+static void *
+metadata_thread_main (void *arg)
+{
+  ushare_t *ut = (ushare_t *) arg;
+
+  scan_io_thread (&ut->scan_io);
+
+  return metadata_thread_func (ut);
+}
+
+/* Run thread in the background, false if it can't be started. */
+static bool
+metadata_thread_start (ushare_t *ut, void *(*thread) (void *))
+{
+  if (metadata_thread_running (ut))
+    return false;
+
+  /* set first, a short lived thread could be over before it returns */
+  metadata_cancel (ut, false);
+  metadata_thread_func = thread;
+  metadata_thread_set_running (ut, true);
+  if (pthread_create (&ut->metadata_thread, NULL, metadata_thread_main, ut))
+  {
+    perror ("Failed to create thread");
+    metadata_thread_set_running (ut, false);
+    return false;
+  }
+
+  return true;
+}
+
+/* Stop the background metadata thread, unless called from it. */
+static void
+metadata_thread_stop (ushare_t *ut)
+{
+  if (!metadata_thread_running (ut)
+      || pthread_equal (pthread_self (), ut->metadata_thread))
+    return;
+
+  metadata_cancel (ut, true);
+  pthread_join (ut->metadata_thread, NULL);
+  metadata_thread_set_running (ut, false);
+  metadata_cancel (ut, false);
+}
+
+/* List the still queued directories found level sub-directories below
+ * dir, which is in the scan path. */
+static int
+expand_level (scan_t *scan, dlna_t *dlna, meta_dir_t *dir, uint32_t id,
+              int level)
+{
+  scan_path_t *path = &scan->path;
+  int i, count = 0;
+
+  if (scan_cancelled (scan))
+    return 0;
+
+  if (dir->state == META_DIR_QUEUED)
+    return level ? 0 : scan_walk (scan, dlna, dir, id, 0);
+
+  for (i = 0; level && i < dir->count; i++)
+  {
+    meta_entry_t *entry = &dir->entries[i];
+    size_t len = path->len;
+
+    if (!entry->dir || !scan_path_push (path, entry->name))
+      continue;
+
+    count += expand_level (scan, dlna, entry->dir, entry->id, level - 1);
+    scan_path_pop (path, len);
+  }
+
+  return count;
+}
+
+/* List what is still queued in dir, which is in the scan path, and down
+ * to levels sub-directories below it. */
+static int
+expand_dir (scan_t *scan, dlna_t *dlna, meta_dir_t *dir, uint32_t id,
+            int levels)
+{
+  scan_path_t *path = &scan->path;
+  int i, count = 0;
+
+  if (dir->state == META_DIR_QUEUED)
+    return scan_walk (scan, dlna, dir, id, levels);
+
+  for (i = 0; levels && i < dir->count; i++)
+  {
+    meta_entry_t *entry = &dir->entries[i];
+    size_t len = path->len;
+
+    if (!entry->dir || !scan_path_push (path, entry->name))
+      continue;
+
+    count += expand_dir (scan, dlna, entry->dir, entry->id, levels - 1);
+    scan_path_pop (path, len);
+  }
+
+  return count;
+}
+
+/**
+ * expand_thread: pre-expand lazy shares in the background, breadth-first
+ *  and one level at a time, down to USHARE_LAZY_DEPTH.
+ */
+static void *
+expand_thread (void *arg)
+{
+  ushare_t *ut = (ushare_t *) arg;
+  index_save_t save = INDEX_SAVE_INIT;
+  int level, count = 0;
+
+  for (level = 1; level <= ut->lazy_depth && !metadata_cancelled (ut);
+       level++)
+  {
+    scan_t scan;
+    int i;
+
+    pthread_mutex_lock (&ut->metadata_lock);
+    if (!ut->metadata)
+    {
+      pthread_mutex_unlock (&ut->metadata_lock);
+      break;
+    }
+
+    scan_init (&scan, 0, ut->scan_queue_depth, &ut->metadata_cancel,
+               &ut->scan_io);
+    scan_shares (&scan, ut->contentlist, ut->policies);
+    scan.probes = &ut->probes;
+    scan.defer_probes = true;
+    for (i = 0; i < ut->metadata->count; i++)
+    {
+      meta_entry_t *root = &ut->metadata->roots[i];
+
+      if (root->dir && share_is_lazy (ut->lazylist, root->name)
+          && scan_path_set (&scan.path, root->name))
+        count += expand_level (&scan, ut->dlna, root->dir, 0, level);
+    }
+    scan_finish (&scan);
+    probe_pending (ut);
+
+    pthread_mutex_unlock (&ut->metadata_lock);
+  }
+
+  pthread_mutex_lock (&ut->metadata_lock);
+  if (count && !metadata_cancelled (ut))
+  {
+    log_verbose (_("Lazy shares expanded : %d entries added\n"), count);
+    save_metadata_index (ut, &save);
+  }
+  pthread_mutex_unlock (&ut->metadata_lock);
+  write_metadata_index (&save);
+
+  return NULL;
+}
+
+/* Find the directory path points to, listing whatever lazy directory is
+ * on the way and adding what got published to count. Its own path is
+ * left in the scan path. */
+static meta_entry_t *
+expand_lookup (scan_t *scan, dlna_t *dlna, meta_tree_t *tree,
+               const char *path, int *count)
+{
+  meta_entry_t *entry = NULL;
+  const char *p = NULL;
+  int i;
+
+  for (i = 0; i < tree->count && !entry; i++)
+  {
+    size_t len;
+
+    if (!tree->roots[i].name || !tree->roots[i].dir)
+      continue;
+
+    len = strlen (tree->roots[i].name);
+    while (len > 1 && tree->roots[i].name[len - 1] == '/')
+      len--;
+    if (!strncmp (path, tree->roots[i].name, len)
+        && (path[len] == '/' || path[len] == '\0'))
+    {
+      entry = &tree->roots[i];
+      p = path + len;
+    }
+  }
+
+  if (!entry || !scan_path_set (&scan->path, entry->name))
+    return NULL;
+
+  while (*p)
+  {
+    meta_dir_t *dir = entry->dir;
+    size_t len;
+
+    while (*p == '/')
+      p++;
+    len = strcspn (p, "/");
+    if (!len)
+      break;
+
+    if (dir->state == META_DIR_QUEUED)
+      *count += scan_walk (scan, dlna, dir, entry->id, 0);
+
+    for (i = 0, entry = NULL; i < dir->count && !entry; i++)
+      if (dir->entries[i].dir && !strncmp (dir->entries[i].name, p, len)
+          && dir->entries[i].name[len] == '\0')
+        entry = &dir->entries[i];
+
+    if (!entry || !scan_path_push (&scan->path, entry->name))
+      return NULL;
+    p += len;
+  }
+
+  return entry;
+}
+
+/**
+ * expand_metadata_dir: list and publish a directory of a lazy share, along
+ *  with USHARE_LAZY_DEPTH levels below it. libdlna answers Browse requests
+ *  on its own, this is the entry point for anything which knows that a
+ *  container is about to be looked at.
+ *  Returns the number of entries published, 0 while the first scan runs,
+ *  -1 if path isn't shared.
+ */
+int
+expand_metadata_dir (ushare_t *ut, const char *path)
+{
+  index_save_t save = INDEX_SAVE_INIT;
+  meta_entry_t *entry;
+  scan_t scan;
+  int count = 0;
+
+  pthread_mutex_lock (&ut->metadata_lock);
+
+  if (ut->metadata)
+  {
+    /* asked for by someone waiting for it, not paced */
+    scan_init (&scan, 0, ut->scan_queue_depth, NULL, NULL);
+    scan_shares (&scan, ut->contentlist, ut->policies);
+    scan.probes = &ut->probes;
+    entry = expand_lookup (&scan, ut->dlna, ut->metadata, path, &count);
+    if (entry)
+      count += expand_dir (&scan, ut->dlna, entry->dir, entry->id,
+                           ut->lazy_depth);
+    scan_finish (&scan);
+  }
+  else
+    entry = NULL;
+
+  if (count > 0)
+  {
+    ut->metadata_generation++;
+    save_metadata_index (ut, &save);
+  }
+
+  /* the first scan lists it on its own, and expands it afterwards */
+  if (!ut->metadata && metadata_thread_running (ut))
+    count = 0;
+  else if (!entry)
+    count = -1;
+
+  pthread_mutex_unlock (&ut->metadata_lock);
+  write_metadata_index (&save);
+
+  return count;
+}
+
+/**
+ * build_thread: scan the shared directories from scratch, publishing
+ *  entries as they are found, then pre-expand lazy shares. The scan
+ *  works on its own copy of the configuration, and only holds the
+ *  metadata lock while publishing each entry.
+ */
+static void *
+build_thread (void *arg)
+{
+  ushare_t *ut = (ushare_t *) arg;
+  index_save_t save = INDEX_SAVE_INIT;
+  content_list_t *content, *lazylist;
+  share_policy_list_t *policies;
+  meta_tree_t *tree;
+  bool rescan;
+
+  pthread_mutex_lock (&ut->metadata_lock);
+  meta_tree_free (ut->metadata);
+  ut->metadata = NULL;
+  content = content_dup (ut->contentlist);
+  lazylist = content_dup (ut->lazylist);
+  policies = share_policy_dup (ut->policies);
+  pthread_mutex_unlock (&ut->metadata_lock);
+
+  tree = content ? scan_content (ut, content, lazylist, policies, ut->dlna,
+                                 &ut->metadata_cancel) : NULL;
+
+  pthread_mutex_lock (&ut->metadata_lock);
+  ut->metadata = tree;
+  ut->metadata_generation++;
+  if (ut->metadata && !metadata_cancelled (ut))
+  {
+    probe_log (ut);
+    save_metadata_index (ut, &save);
+  }
+  /* stopped halfway, what was found so far is resumed from next time */
+  else if (ut->metadata && ut->checkpoint_interval)
+    save_metadata_index (ut, &save);
+  rescan = ut->metadata_rescan;
+  ut->metadata_rescan = false;
+  /* files deferred meanwhile can be probed now */
+  pthread_cond_signal (&ut->probes.cond);
+  pthread_mutex_unlock (&ut->metadata_lock);
+  write_metadata_index (&save);
+
+  if (content)
+    content_free (content);
+  if (lazylist)
+    content_free (lazylist);
+  share_policy_free (policies);
+
+  /* changes noticed during the scan, or a reloaded configuration */
+  if (rescan && ut->metadata && !metadata_cancelled (ut))
+    rescan_metadata_list (ut);
+
+  if (ut->lazylist && ut->lazy_depth && !metadata_cancelled (ut))
+    expand_thread (ut);
+
+  return NULL;
+}
+
+/**
+ * rebuild_thread: scan the shared directories from scratch as a new
+ *  generation, while the published one keeps being served, then merge
+ *  the difference into it.
+ */
+static void *
+rebuild_thread (void *arg)
+{
+  ushare_t *ut = (ushare_t *) arg;
+  index_save_t save = INDEX_SAVE_INIT;
+  content_list_t *content, *lazylist;
+  share_policy_list_t *policies;
+  meta_tree_t *tree;
+
+  pthread_mutex_lock (&ut->metadata_lock);
+  content = content_dup (ut->contentlist);
+  lazylist = content_dup (ut->lazylist);
+  policies = share_policy_dup (ut->policies);
+  pthread_mutex_unlock (&ut->metadata_lock);
+
+  tree = content ? scan_content (ut, content, lazylist, policies, NULL,
+                                 &ut->metadata_cancel) : NULL;
+
+  pthread_mutex_lock (&ut->metadata_lock);
+  if (tree && ut->metadata && !metadata_cancelled (ut))
+  {
+    generation_merge_tree (ut, tree, lazylist);
+    probe_pending (ut);
+    ut->metadata_generation++;
+    save_metadata_index (ut, &save);
+  }
+  else
+    meta_tree_free (tree);
+  pthread_mutex_unlock (&ut->metadata_lock);
+  write_metadata_index (&save);
+
+  if (content)
+    content_free (content);
+  if (lazylist)
+    content_free (lazylist);
+  share_policy_free (policies);
+
+  if (ut->lazylist && ut->lazy_depth && !metadata_cancelled (ut))
+    expand_thread (ut);
+
+  return NULL;
+}
+
+/**
+ * index_thread: publish the tree saved in the index, then bring it up to
+ *  date with the shared directories. This only spares listing them again
+ *  before anything is published, and probing the files libdlna rejected :
+ *  libdlna has no way to be handed a media profile found before, it
+ *  probes every other file again as it is published. Falls back to a
+ *  full scan when the index doesn't match the shares.
+ */
+static void *
+index_thread (void *arg)
+{
+  ushare_t *ut = (ushare_t *) arg;
+  meta_tree_t *tree;
+  bool match;
+
+  tree = metaindex_load (ut->index_file);
+
+  pthread_mutex_lock (&ut->metadata_lock);
+  match = tree && meta_tree_match_content (tree, ut->contentlist);
+  pthread_mutex_unlock (&ut->metadata_lock);
+
+  if (!match)
+  {
+    if (tree)
+    {
+      log_verbose (_("Shared directories differ from index, ignoring it\n"));
+      meta_tree_free (tree);
+    }
+    return build_thread (ut);
+  }
+
+  log_info (_("Publishing metadata from index %s ...\n"), ut->index_file);
+  publish_tree (ut, tree);
+
+  pthread_mutex_lock (&ut->metadata_lock);
+  /* stopped halfway, a scan starts over from an empty VFS */
+  if (metadata_cancelled (ut))
+  {
+    unpublish_all (ut);
+    meta_tree_free (tree);
+    pthread_mutex_unlock (&ut->metadata_lock);
+    return NULL;
+  }
+  ut->metadata = tree;
+  /* made anyway right below */
+  ut->metadata_rescan = false;
+  probe_log (ut);
+  /* files left pending are probed by the probe thread, or at the end of
+   * the revalidation, once gone files are sorted out */
+  pthread_cond_signal (&ut->probes.cond);
+  pthread_mutex_unlock (&ut->metadata_lock);
+
+  rescan_metadata_list (ut);
+  log_verbose (_("Metadata index revalidated\n"));
+
+  return NULL;
 }
 
+/**
+ * build_metadata_list: publish the shared directories in the background,
+ *  from the index when there is one to start from, otherwise through a
+ *  full scan. Once something is published, the scan builds a
+ *  new generation off to the side, whose difference with the published
+ *  one is then applied to the VFS.
+ */
 void
 build_metadata_list (ushare_t *ut)
 {
-  int i;
-  
+  void *(*thread) (void *);
+
+  metadata_thread_stop (ut);
+  probe_thread_start (ut);
+
+  pthread_mutex_lock (&ut->metadata_lock);
+
   log_info (_("Building Metadata List ...\n"));
 
-  /* add files from content directory */
-  for (i = 0 ; i < ut->contentlist->count ; i++)
+  /* the index only stands in for the very first scan */
+  if (ut->index_file && !ut->metadata && !ut->metadata_generation)
   {
-    log_info (_("Looking for files in content directory : %s\n"),
-              ut->contentlist->content[i]);
-
-    add_container (ut->dlna, ut->contentlist->content[i], 0);
+    thread = index_thread;
+    ut->metadata_generation++;
   }
+  else
+    thread = ut->metadata ? rebuild_thread : build_thread;
+  pthread_mutex_unlock (&ut->metadata_lock);
+
+  /* from the metadata thread itself, the scan simply goes on there */
+  if (!metadata_thread_start (ut, thread))
+    thread (ut);
 }
 
 void
 free_metadata_list (ushare_t *ut)
 {
-  dlna_vfs_remove_item_by_id (ut->dlna, 0);
+  metadata_thread_stop (ut);
+
+  pthread_mutex_lock (&ut->metadata_lock);
+  unpublish_all (ut);
+  meta_tree_free (ut->metadata);
+  ut->metadata = NULL;
+  pthread_mutex_unlock (&ut->metadata_lock);
+}
+
+/**
+ * metadata_resource_path: full path of the published file id, copied to
+ *  buf of size bytes, for those serving it. It is looked up in the index
+ *  of the published objects, whatever the scan going on meanwhile.
+ *  Returns false if id is unknown, or its path doesn't fit.
+ */
+bool
+metadata_resource_path (ushare_t *ut __attribute__ ((unused)), uint32_t id,
+                        char *buf, size_t size)
+{
+  bool found;
+
+  pthread_rwlock_rdlock (&published_lock);
+  found = objpath_get (&published, id, buf, size);
+  pthread_rwlock_unlock (&published_lock);
+
+  return found;
+}
+
+/**
+ * wait_metadata_list: wait for the background scan, or revalidation, to
+ *  complete.
+ */
+void
+wait_metadata_list (ushare_t *ut)
+{
+  if (!metadata_thread_running (ut)
+      || pthread_equal (pthread_self (), ut->metadata_thread))
+    return;
+
+  pthread_join (ut->metadata_thread, NULL);
+  metadata_thread_set_running (ut, false);
+}
+
+void
+finish_metadata_list (ushare_t *ut)
+{
+  if (metadata_thread_running (ut))
+  {
+    metadata_cancel (ut, true);
+    pthread_join (ut->metadata_thread, NULL);
+    metadata_thread_set_running (ut, false);
+  }
+
+  /* only once the scan gave the metadata lock up */
+  probe_thread_stop (ut);
 }
@@ -21,10 +21,83 @@
 #ifndef _METADATA_H_
 #define _METADATA_H_
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <time.h>
+
 #include "ushare.h"
 #include "content.h"
+#include "arena.h"
+
+typedef enum {
+  META_DIR_QUEUED,
+  META_DIR_LISTING,
+  META_DIR_LISTED,
+} meta_dir_state_t;
+
+/* Device index of the files which devices couldn't be told apart */
+#define META_DEV_NONE 0xffff
+
+typedef struct meta_dir_s meta_dir_t;
+
+typedef struct meta_entry_s {
+  char *name;                   /* in the parent name block, or owned for roots */
+  meta_dir_t *dir;              /* set for directories only */
+  ino_t ino;                    /* dev, ino, size and mtime are set for files */
+  off_t size;                   /* only, a directory keeps its own in dir */
+  time_t mtime;
+  uint32_t id;                  /* VFS object id, 0 until published */
+  uint16_t dev;                 /* index of the device, see meta_dev_index () */
+  uint16_t profile : 12;        /* what libdlna found, see profile_intern () */
+  bool rejected : 1;            /* file libdlna found no media profile for */
+  bool link : 1;                /* listed as a symbolic link */
+  bool hardlink : 1;            /* file with other names */
+  bool guessed : 1;             /* published on its extension, not probed */
+  uint32_t duration;            /* milliseconds, as probed */
+  uint32_t bitrate;             /* bytes per second, as probed */
+} meta_entry_t;
+
+struct meta_dir_s {
+  meta_entry_t *entries;        /* strcoll order */
+  int count;
+  char *names;                  /* NUL separated entry names, NULL if borrowed */
+  char *path;                   /* set while queued to a scan worker */
+  dev_t dev;                    /* as found when the directory was listed */
+  ino_t ino;
+  time_t mtime;
+  uint32_t oid;                 /* object id asked for, kept across scans */
+  meta_dir_state_t state;
+  bool arena;                   /* entries in the arena of the tree */
+  bool twin;                    /* listed under another path, for now */
+};
+
+/* In-memory mirror of what has been published to the VFS,
+ * one root entry per shared content directory. */
+typedef struct meta_tree_s {
+  meta_entry_t *roots;
+  int count;
+  time_t scanned;               /* when the last (re)scan started */
+  char *strings;                /* names borrowed by an index loaded tree */
+  arena_t arena;                /* listings made along with the tree */
+} meta_tree_t;
+
+meta_tree_t *meta_tree_new (int count);
+void meta_tree_free (meta_tree_t *tree);
+meta_dir_t *meta_dir_new (meta_dir_state_t state);
+
+/* Entries keep a 16 bits index of their device rather than the dev_t,
+ * META_DEV_NONE once over 65535 different devices. */
+uint16_t meta_dev_index (dev_t dev);
+dev_t meta_dev (uint16_t index);
 
 void free_metadata_list (ushare_t *ut);
 void build_metadata_list (ushare_t *ut);
+void rescan_metadata_list (ushare_t *ut);
+void finish_metadata_list (ushare_t *ut);
+void wait_metadata_list (ushare_t *ut);
+int expand_metadata_dir (ushare_t *ut, const char *path);
+bool metadata_resource_path (ushare_t *ut, uint32_t id,
+                             char *buf, size_t size);
 
 #endif /* _METADATA_H_ */
@@ -0,0 +1,623 @@
+/*
+ * metaindex.c : GeeXboX uShare persistent metadata index.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "metadata.h"
+#include "metaindex.h"
+#include "fnv.h"
+#include "profile.h"
+#include "gettext.h"
+#include "trace.h"
+
+typedef struct metaindex_writer_s {
+  metaindex_profile_t *profiles;
+  uint16_t nr_profiles;         /* profiles known when the write started */
+  metaindex_node_t *nodes;
+  uint32_t nr_nodes;
+  uint32_t max_nodes;
+  char *strings;
+  uint64_t strings_size;
+  uint64_t max_strings;
+} metaindex_writer_t;
+
+typedef struct metaindex_reader_s {
+  uint16_t *profiles;           /* as interned, by index in the file */
+  uint32_t nr_profiles;
+  const metaindex_node_t *nodes;
+  uint32_t nr_nodes;
+  uint32_t next;
+  const char *strings;
+  uint64_t strings_size;
+  arena_t *arena;               /* of the tree, for the entries */
+} metaindex_reader_t;
+
+/* Append s to the names, its offset being set in offset. */
+static int
+writer_string (metaindex_writer_t *w, const char *s, uint32_t *offset)
+{
+  size_t len = strlen (s) + 1;
+
+  /* names are addressed by 32 bits offsets */
+  if (w->strings_size + len > UINT32_MAX)
+    return -1;
+  if (w->strings_size + len > w->max_strings)
+  {
+    char *strings;
+
+    w->max_strings = 2 * (w->max_strings + len);
+    strings = realloc (w->strings, w->max_strings);
+    if (!strings)
+      return -1;
+    w->strings = strings;
+  }
+
+  *offset = (uint32_t) w->strings_size;
+  memcpy (w->strings + w->strings_size, s, len);
+  w->strings_size += len;
+
+  return 0;
+}
+
+/* Describe the profiles known so far, those entries may refer to. Any
+ * profile met meanwhile is saved as not known. */
+static int
+writer_profiles (metaindex_writer_t *w)
+{
+  uint16_t i, count = profile_count ();
+
+  w->nr_profiles = count - 1;
+  if (!w->nr_profiles)
+    return 0;
+
+  w->profiles = calloc (w->nr_profiles, sizeof (metaindex_profile_t));
+  if (!w->profiles)
+    return -1;
+
+  for (i = 1; i < count; i++)
+  {
+    metaindex_profile_t *p = &w->profiles[i - 1];
+    const char *id, *mime;
+    unsigned int media_class;
+
+    p->id = METAINDEX_NONE;
+    if (!profile_get (i, &id, &mime, &media_class))
+      return -1;
+    if ((id && writer_string (w, id, &p->id) < 0)
+        || writer_string (w, mime, &p->mime) < 0)
+      return -1;
+    p->media_class = media_class;
+  }
+
+  return 0;
+}
+
+static int
+writer_add (metaindex_writer_t *w, const meta_entry_t *entry)
+{
+  metaindex_node_t *node;
+  uint32_t i;
+
+  if (w->nr_nodes == w->max_nodes)
+  {
+    metaindex_node_t *nodes;
+
+    w->max_nodes = w->max_nodes ? 2 * w->max_nodes : 1024;
+    nodes = realloc (w->nodes, w->max_nodes * sizeof (metaindex_node_t));
+    if (!nodes)
+      return -1;
+    w->nodes = nodes;
+  }
+
+  node = &w->nodes[w->nr_nodes];
+  memset (node, 0, sizeof (metaindex_node_t));
+  if (writer_string (w, entry->name, &node->name) < 0)
+    return -1;
+  w->nr_nodes++;
+  if (entry->dir)
+  {
+    /* a directory which isn't listed yet may be being listed meanwhile
+     * when checkpointing, only its object id is ours */
+    if (entry->dir->state == META_DIR_LISTED)
+    {
+      node->dev = entry->dir->dev;
+      node->ino = entry->dir->ino;
+      node->mtime = entry->dir->mtime;
+    }
+    node->oid = entry->dir->oid;
+  }
+  else
+  {
+    node->dev = meta_dev (entry->dev);
+    node->ino = entry->ino;
+    node->size = entry->size;
+    node->mtime = entry->mtime;
+    if (!entry->rejected && !entry->guessed
+        && entry->profile <= w->nr_profiles)
+    {
+      node->profile = entry->profile;
+      node->duration = entry->duration;
+      node->bitrate = entry->bitrate;
+    }
+  }
+  if (!entry->dir)
+    node->count = entry->rejected ? METAINDEX_REJECTED : METAINDEX_FILE;
+  else if (entry->dir->state != META_DIR_LISTED)
+    node->count = METAINDEX_UNLISTED;
+  else
+    node->count = entry->dir->count;
+
+  if (entry->dir && entry->dir->state == META_DIR_LISTED)
+    for (i = 0; i < (uint32_t) entry->dir->count; i++)
+      if (writer_add (w, &entry->dir->entries[i]) < 0)
+        return -1;
+
+  return 0;
+}
+
+static int
+write_all (int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+
+  while (len)
+  {
+    ssize_t n = write (fd, p, len);
+    if (n < 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+struct metaindex_image_s {
+  metaindex_writer_t w;
+  metaindex_header_t header;
+  uint64_t seq;
+};
+
+/* Writes go one at a time, through the same temporary file. */
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Snapshots taken, and the last one written : older ones are dropped. */
+static uint64_t snapshot_seq;
+static uint64_t written_seq;
+
+static void
+writer_free (metaindex_writer_t *w)
+{
+  if (w->profiles)
+    free (w->profiles);
+  if (w->nodes)
+    free (w->nodes);
+  if (w->strings)
+    free (w->strings);
+}
+
+/* Lay the tree out in w and header. With lock, the tree is only looked at
+ * while holding it. */
+static int
+writer_fill (metaindex_writer_t *w, metaindex_header_t *header,
+             meta_tree_t *tree, pthread_mutex_t *lock)
+{
+  int i;
+
+  memset (w, 0, sizeof (metaindex_writer_t));
+  if (writer_profiles (w) < 0)
+  {
+    log_error (_("Metadata index not saved, out of memory\n"));
+    return -1;
+  }
+  if (lock)
+    pthread_mutex_lock (lock);
+  for (i = 0; i < tree->count; i++)
+    if (writer_add (w, &tree->roots[i]) < 0)
+      break;
+  if (lock)
+    pthread_mutex_unlock (lock);
+  if (i < tree->count)
+  {
+    log_error (_("Metadata index not saved, out of memory or over 4GB of names\n"));
+    return -1;
+  }
+
+  memset (header, 0, sizeof (metaindex_header_t));
+  memcpy (header->magic, METAINDEX_MAGIC, sizeof (header->magic));
+  header->version = METAINDEX_VERSION;
+  header->byteorder = METAINDEX_BYTEORDER;
+  header->nr_roots = tree->count;
+  header->nr_nodes = w->nr_nodes;
+  header->strings_size = w->strings_size;
+  header->scanned = tree->scanned;
+  header->nr_profiles = w->nr_profiles;
+  header->checksum = fnv1a (FNV_OFFSET_BASIS, w->profiles,
+                            w->nr_profiles * sizeof (metaindex_profile_t));
+  header->checksum = fnv1a (header->checksum, w->nodes,
+                            w->nr_nodes * sizeof (metaindex_node_t));
+  header->checksum = fnv1a (header->checksum, w->strings, w->strings_size);
+
+  return 0;
+}
+
+/* Write what w holds to a temporary file which atomically replaces the
+ * previous index once safely on disk. Called with write_lock held. */
+static int
+writer_write (const metaindex_writer_t *w, const metaindex_header_t *header,
+              const char *filename)
+{
+  char tmpname[PATH_MAX];
+  char dirname_buf[PATH_MAX];
+  int fd;
+
+  snprintf (tmpname, sizeof (tmpname), "%s.tmp", filename);
+  fd = open (tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    perror (tmpname);
+    return -1;
+  }
+
+  if (write_all (fd, header, sizeof (metaindex_header_t)) < 0
+      || write_all (fd, w->profiles,
+                    w->nr_profiles * sizeof (metaindex_profile_t)) < 0
+      || write_all (fd, w->nodes, w->nr_nodes * sizeof (metaindex_node_t)) < 0
+      || write_all (fd, w->strings, w->strings_size) < 0
+      || fsync (fd) < 0)
+  {
+    perror (tmpname);
+    close (fd);
+    unlink (tmpname);
+    return -1;
+  }
+  close (fd);
+
+  if (rename (tmpname, filename) < 0)
+  {
+    perror (filename);
+    unlink (tmpname);
+    return -1;
+  }
+
+  /* make the rename itself durable */
+  snprintf (dirname_buf, sizeof (dirname_buf), "%s", filename);
+  fd = open (dirname (dirname_buf), O_RDONLY);
+  if (fd >= 0)
+  {
+    fsync (fd);
+    close (fd);
+  }
+
+  log_verbose (_("Metadata index saved (%u entries)\n"), w->nr_nodes);
+
+  return 0;
+}
+
+static int
+metaindex_write (meta_tree_t *tree, const char *filename,
+                 pthread_mutex_t *lock)
+{
+  metaindex_writer_t w;
+  metaindex_header_t header;
+  int err;
+
+  err = writer_fill (&w, &header, tree, lock);
+  if (!err)
+  {
+    pthread_mutex_lock (&write_lock);
+    err = writer_write (&w, &header, filename);
+    pthread_mutex_unlock (&write_lock);
+  }
+  writer_free (&w);
+
+  return err;
+}
+
+/**
+ * metaindex_save: write the tree to a temporary file which atomically
+ *  replaces the previous index once safely on disk.
+ */
+int
+metaindex_save (meta_tree_t *tree, const char *filename)
+{
+  return metaindex_write (tree, filename, NULL);
+}
+
+/**
+ * metaindex_checkpoint: save a tree which scan workers are still filling
+ *  in, lock being the one they mark directories listed under. What isn't
+ *  listed yet is saved as such, and listed once the index is loaded.
+ */
+int
+metaindex_checkpoint (meta_tree_t *tree, const char *filename,
+                      pthread_mutex_t *lock)
+{
+  return metaindex_write (tree, filename, lock);
+}
+
+/**
+ * metaindex_snapshot: lay the tree out as saved, for metaindex_image_write
+ *  () to write it once whatever guards the tree is released. NULL if out
+ *  of memory.
+ */
+metaindex_image_t *
+metaindex_snapshot (meta_tree_t *tree)
+{
+  metaindex_image_t *image;
+
+  image = calloc (1, sizeof (metaindex_image_t));
+  if (!image)
+    return NULL;
+
+  if (writer_fill (&image->w, &image->header, tree, NULL) < 0)
+  {
+    metaindex_image_free (image);
+    return NULL;
+  }
+  image->seq = __atomic_add_fetch (&snapshot_seq, 1, __ATOMIC_RELAXED);
+
+  return image;
+}
+
+/**
+ * metaindex_image_write: write a snapshot as metaindex_save () would, unless
+ *  a later one was written meanwhile. The image is left to the caller.
+ */
+int
+metaindex_image_write (metaindex_image_t *image, const char *filename)
+{
+  int err = 0;
+
+  pthread_mutex_lock (&write_lock);
+  if (image->seq > written_seq)
+  {
+    err = writer_write (&image->w, &image->header, filename);
+    if (!err)
+      written_seq = image->seq;
+  }
+  pthread_mutex_unlock (&write_lock);
+
+  return err;
+}
+
+void
+metaindex_image_free (metaindex_image_t *image)
+{
+  writer_free (&image->w);
+  free (image);
+}
+
+static int
+reader_get (metaindex_reader_t *r, meta_entry_t *entry, bool root)
+{
+  const metaindex_node_t *node;
+  uint32_t i;
+
+  if (r->next >= r->nr_nodes)
+    return -1;
+
+  node = &r->nodes[r->next++];
+  if (node->name >= r->strings_size)
+    return -1;
+
+  /* roots own their name, the others borrow it from the strings table */
+  if (root)
+  {
+    entry->name = strdup (r->strings + node->name);
+    if (!entry->name)
+      return -1;
+  }
+  else
+    entry->name = (char *) r->strings + node->name;
+
+  entry->id = 0;
+  entry->rejected = node->count == METAINDEX_REJECTED;
+  entry->dir = NULL;
+
+  if (node->count == METAINDEX_FILE || node->count == METAINDEX_REJECTED)
+  {
+    if (node->profile > r->nr_profiles)
+      return -1;
+    entry->profile = node->profile ? r->profiles[node->profile - 1]
+      : PROFILE_NONE;
+    entry->duration = node->duration;
+    entry->bitrate = node->bitrate;
+    entry->dev = meta_dev_index (node->dev);
+    entry->ino = node->ino;
+    entry->size = node->size;
+    entry->mtime = node->mtime;
+    return 0;
+  }
+
+  if (node->count == METAINDEX_UNLISTED)
+  {
+    entry->dir = meta_dir_new (META_DIR_QUEUED);
+    if (!entry->dir)
+      return -1;
+    entry->dir->oid = node->oid;
+    return 0;
+  }
+
+  if (node->count > r->nr_nodes - r->next)
+    return -1;
+
+  entry->dir = meta_dir_new (META_DIR_LISTED);
+  if (!entry->dir)
+    return -1;
+
+  entry->dir->dev = node->dev;
+  entry->dir->ino = node->ino;
+  entry->dir->mtime = node->mtime;
+  entry->dir->oid = node->oid;
+  if (node->count)
+  {
+    entry->dir->entries = arena_alloc (r->arena,
+                                       node->count * sizeof (meta_entry_t));
+    if (!entry->dir->entries)
+      return -1;
+    memset (entry->dir->entries, 0, node->count * sizeof (meta_entry_t));
+  }
+  entry->dir->arena = true;
+
+  for (i = 0; i < node->count; i++)
+  {
+    entry->dir->count++;
+    if (reader_get (r, &entry->dir->entries[i], false) < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * metaindex_load: map an index file and rebuild the tree it describes.
+ *  Returns NULL if the file is missing, truncated or from another version.
+ */
+meta_tree_t *
+metaindex_load (const char *filename)
+{
+  const metaindex_header_t *header;
+  const metaindex_profile_t *profiles;
+  metaindex_reader_t r;
+  meta_tree_t *tree = NULL;
+  const char *strings;
+  struct stat st;
+  void *map;
+  uint32_t i;
+  int fd;
+
+  fd = open (filename, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  if (fstat (fd, &st) < 0 || (size_t) st.st_size < sizeof (*header))
+  {
+    close (fd);
+    return NULL;
+  }
+
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+  {
+    perror ("mmap");
+    return NULL;
+  }
+
+  header = map;
+  r.profiles = NULL;
+  if (memcmp (header->magic, METAINDEX_MAGIC, sizeof (header->magic))
+      || header->version != METAINDEX_VERSION
+      || header->byteorder != METAINDEX_BYTEORDER
+      || header->nr_profiles > PROFILE_MAX
+      || sizeof (*header) + (uint64_t) header->nr_profiles
+         * sizeof (metaindex_profile_t) + (uint64_t) header->nr_nodes
+         * sizeof (metaindex_node_t) + header->strings_size
+         != (uint64_t) st.st_size)
+  {
+    log_error (_("Ignoring invalid metadata index %s\n"), filename);
+    goto out;
+  }
+
+  profiles = (const metaindex_profile_t *) (header + 1);
+  r.nr_profiles = header->nr_profiles;
+  r.nodes = (const metaindex_node_t *) (profiles + r.nr_profiles);
+  r.nr_nodes = header->nr_nodes;
+  r.next = 0;
+  strings = (const char *) (r.nodes + r.nr_nodes);
+  r.strings_size = header->strings_size;
+
+  if ((r.strings_size && strings[r.strings_size - 1] != '\0')
+      || fnv1a (fnv1a (fnv1a (FNV_OFFSET_BASIS, profiles,
+                              r.nr_profiles * sizeof (metaindex_profile_t)),
+                       r.nodes, r.nr_nodes * sizeof (metaindex_node_t)),
+                strings, r.strings_size) != header->checksum)
+  {
+    log_error (_("Ignoring corrupted metadata index %s\n"), filename);
+    goto out;
+  }
+
+  /* profiles are numbered as they are met, in this run */
+  if (r.nr_profiles)
+  {
+    r.profiles = malloc (r.nr_profiles * sizeof (uint16_t));
+    if (!r.profiles)
+      goto out;
+  }
+  for (i = 0; i < r.nr_profiles; i++)
+  {
+    const metaindex_profile_t *p = &profiles[i];
+
+    if ((p->id != METAINDEX_NONE && p->id >= r.strings_size)
+        || p->mime >= r.strings_size)
+    {
+      log_error (_("Ignoring corrupted metadata index %s\n"), filename);
+      goto out;
+    }
+    r.profiles[i] =
+      profile_intern (p->id != METAINDEX_NONE ? strings + p->id : NULL,
+                      strings + p->mime, p->media_class);
+  }
+
+  tree = meta_tree_new (header->nr_roots);
+  if (!tree)
+    goto out;
+  tree->scanned = header->scanned;
+
+  /* one copy of all names, which outlives the mapping */
+  tree->strings = malloc (r.strings_size ? r.strings_size : 1);
+  if (!tree->strings)
+  {
+    meta_tree_free (tree);
+    tree = NULL;
+    goto out;
+  }
+  memcpy (tree->strings, strings, r.strings_size);
+  r.strings = tree->strings;
+  r.arena = &tree->arena;
+
+  for (i = 0; i < header->nr_roots; i++)
+    if (reader_get (&r, &tree->roots[i], true) < 0)
+      break;
+
+  if (i < header->nr_roots || r.next != r.nr_nodes)
+  {
+    log_error (_("Ignoring corrupted metadata index %s\n"), filename);
+    meta_tree_free (tree);
+    tree = NULL;
+  }
+
+ out:
+  if (r.profiles)
+    free (r.profiles);
+  munmap (map, st.st_size);
+
+  return tree;
+}
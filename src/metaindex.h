@@ -0,0 +1,99 @@
+/*
+ * metaindex.h : GeeXboX uShare persistent metadata index header.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _METAINDEX_H_
+#define _METAINDEX_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "metadata.h"
+
+#define METAINDEX_MAGIC     "uShareIX"
+#define METAINDEX_VERSION   6
+#define METAINDEX_BYTEORDER 0x01020304
+#define METAINDEX_FILE      ((uint32_t) -1)
+#define METAINDEX_UNLISTED  ((uint32_t) -2)
+#define METAINDEX_REJECTED  ((uint32_t) -3)
+#define METAINDEX_NONE      ((uint32_t) -1)
+
+/*
+ * On-disk layout : header, then the media profiles files were found to
+ * be of, then every entry of the tree in depth-first pre-order, then the
+ * NUL separated names. A directory is followed by its `count' children,
+ * so the tree is rebuilt in a single linear pass over the mapped file.
+ * Share roots store their full path as name.
+ */
+typedef struct metaindex_header_s {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteorder;
+  uint32_t nr_roots;
+  uint32_t nr_nodes;
+  uint64_t strings_size;
+  int64_t scanned;
+  uint32_t checksum;            /* FNV-1a of profiles, nodes and names */
+  uint32_t nr_profiles;
+} metaindex_header_t;
+
+typedef struct metaindex_profile_s {
+  uint32_t id;                  /* offset into the names, METAINDEX_NONE if
+                                   the profile has no DLNA name */
+  uint32_t mime;                /* offset into the names */
+  uint32_t media_class;         /* MIME_CLASS_ mask */
+  uint32_t reserved;
+} metaindex_profile_t;
+
+typedef struct metaindex_node_s {
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtime;
+  uint32_t name;                /* offset into the names */
+  uint32_t count;               /* children, METAINDEX_FILE for resources,
+                                   METAINDEX_REJECTED for files libdlna
+                                   couldn't profile, METAINDEX_UNLISTED for
+                                   directories not listed yet (lazy shares,
+                                   interrupted scans) */
+  uint32_t oid;                 /* object id of directories, 0 if none yet */
+  uint32_t profile;             /* of resources, 1 for the first one of the
+                                   profiles, 0 if not known */
+  uint32_t duration;            /* of resources, milliseconds */
+  uint32_t bitrate;             /* of resources, bytes per second */
+} metaindex_node_t;
+
+meta_tree_t *metaindex_load (const char *filename)
+    __attribute__ ((nonnull));
+int metaindex_save (meta_tree_t *tree, const char *filename)
+    __attribute__ ((nonnull));
+int metaindex_checkpoint (meta_tree_t *tree, const char *filename,
+                          pthread_mutex_t *lock)
+    __attribute__ ((nonnull));
+
+/* A tree laid out as saved, to be written after letting go of its lock */
+typedef struct metaindex_image_s metaindex_image_t;
+
+metaindex_image_t *metaindex_snapshot (meta_tree_t *tree)
+    __attribute__ ((nonnull));
+int metaindex_image_write (metaindex_image_t *image, const char *filename)
+    __attribute__ ((nonnull));
+void metaindex_image_free (metaindex_image_t *image)
+    __attribute__ ((nonnull));
+
+#endif /* _METAINDEX_H_ */
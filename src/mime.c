@@ -138,6 +138,66 @@ const struct mime_type_t MIME_Type_List[] = {
   { NULL, NULL, NULL}
 };
 
+/* Find what a file is from its extension alone, NULL if unknown. */
+const struct mime_type_t *
+mime_lookup (const char *filename)
+{
+  const struct mime_type_t *mime;
+  const char *ext;
+
+  ext = strrchr (filename, '.');
+  if (!ext || !*++ext)
+    return NULL;
+
+  for (mime = MIME_Type_List; mime->extension; mime++)
+    if (!strcasecmp (ext, mime->extension))
+      return mime;
+
+  return NULL;
+}
+
+static const struct {
+  const char *name;
+  const char *upnp_class;
+  unsigned int mask;
+} mime_classes[] = {
+  { "video",    UPNP_VIDEO,    MIME_CLASS_VIDEO    },
+  { "audio",    UPNP_AUDIO,    MIME_CLASS_AUDIO    },
+  { "image",    UPNP_PHOTO,    MIME_CLASS_IMAGE    },
+  { "playlist", UPNP_PLAYLIST, MIME_CLASS_PLAYLIST },
+  { "text",     UPNP_TEXT,     MIME_CLASS_TEXT     },
+  { NULL,       NULL,          0                   }
+};
+
+/* Class of a known media type, 0 for none. */
+unsigned int
+mime_class (const struct mime_type_t *mime)
+{
+  int i;
+
+  if (!mime)
+    return 0;
+
+  for (i = 0; mime_classes[i].name; i++)
+    if (!strcmp (mime->mime_class, mime_classes[i].upnp_class))
+      return mime_classes[i].mask;
+
+  return 0;
+}
+
+/* Class from its name ("video", "audio" ...), 0 if unknown. */
+unsigned int
+mime_class_parse (const char *name)
+{
+  int i;
+
+  for (i = 0; mime_classes[i].name; i++)
+    if (!strcasecmp (name, mime_classes[i].name))
+      return mime_classes[i].mask;
+
+  return 0;
+}
+
 char *mime_get_protocol (struct mime_type_t *mime)
 {
   char protocol[512];
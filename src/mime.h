@@ -27,6 +27,16 @@ struct mime_type_t {
   char *mime_protocol;
 };
 
+/* Classes of media, as masks */
+#define MIME_CLASS_VIDEO    (1 << 0)
+#define MIME_CLASS_AUDIO    (1 << 1)
+#define MIME_CLASS_IMAGE    (1 << 2)
+#define MIME_CLASS_PLAYLIST (1 << 3)
+#define MIME_CLASS_TEXT     (1 << 4)
+
+const struct mime_type_t *mime_lookup (const char *filename);
+unsigned int mime_class (const struct mime_type_t *mime);
+unsigned int mime_class_parse (const char *name);
 char *mime_get_protocol (struct mime_type_t *mime);
 
 #endif /* _MIME_H */
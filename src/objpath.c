@@ -0,0 +1,251 @@
+/*
+ * objpath.c : GeeXboX uShare published objects index.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "objpath.h"
+
+#define OBJPATH_DEFAULT_SIZE 1024
+
+static void
+objpath_table_init (objpath_table_t *table)
+{
+  table->slots = NULL;
+  table->size = 0;
+  table->count = 0;
+}
+
+static void
+objpath_table_free (objpath_table_t *table)
+{
+  if (table->slots)
+    free (table->slots);
+  objpath_table_init (table);
+}
+
+void
+objpath_init (objpath_t *set)
+{
+  objpath_table_init (&set->objects);
+  objpath_table_init (&set->prefixes);
+}
+
+void
+objpath_free (objpath_t *set)
+{
+  objpath_table_free (&set->objects);
+  objpath_table_free (&set->prefixes);
+}
+
+static size_t
+objpath_hash (uint32_t id)
+{
+  return (size_t) (((uint64_t) id * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+/* Slot of id, or the free one it would go to. */
+static objpath_slot_t *
+objpath_lookup (objpath_slot_t *slots, size_t size, uint32_t id)
+{
+  size_t i = objpath_hash (id) & (size - 1);
+
+  while (slots[i].id && slots[i].id != id)
+    i = (i + 1) & (size - 1);
+
+  return &slots[i];
+}
+
+static objpath_slot_t *
+objpath_find (const objpath_table_t *table, uint32_t id)
+{
+  objpath_slot_t *slot;
+
+  if (!id || !table->size)
+    return NULL;
+
+  slot = objpath_lookup (table->slots, table->size, id);
+  return slot->id ? slot : NULL;
+}
+
+static bool
+objpath_grow (objpath_table_t *table)
+{
+  size_t size = table->size ? 2 * table->size : OBJPATH_DEFAULT_SIZE;
+  objpath_slot_t *slots;
+  size_t i;
+
+  slots = calloc (size, sizeof (objpath_slot_t));
+  if (!slots)
+    return false;
+
+  for (i = 0; i < table->size; i++)
+    if (table->slots[i].id)
+      *objpath_lookup (slots, size, table->slots[i].id) = table->slots[i];
+
+  if (table->slots)
+    free (table->slots);
+  table->slots = slots;
+  table->size = size;
+
+  return true;
+}
+
+static bool
+objpath_put (objpath_table_t *table, uint32_t id, uint32_t parent,
+             const char *name)
+{
+  objpath_slot_t *slot;
+
+  /* keep the load under 3/4 */
+  if (4 * (table->count + 1) > 3 * table->size && !objpath_grow (table))
+    return false;
+
+  slot = objpath_lookup (table->slots, table->size, id);
+  if (!slot->id)
+    table->count++;
+
+  slot->id = id;
+  slot->parent = parent;
+  slot->name = name;
+
+  return true;
+}
+
+static void
+objpath_delete (objpath_table_t *table, uint32_t id)
+{
+  size_t mask = table->size - 1;
+  size_t i, j, k;
+
+  if (!id || !table->size)
+    return;
+
+  i = objpath_lookup (table->slots, table->size, id) - table->slots;
+  if (!table->slots[i].id)
+    return;
+
+  /* shift back the slots which probed past the one given back,
+   * so that lookups don't stop short of them */
+  for (j = (i + 1) & mask; table->slots[j].id; j = (j + 1) & mask)
+  {
+    k = objpath_hash (table->slots[j].id) & mask;
+    if (i <= j ? i < k && k <= j : i < k || k <= j)
+      continue;
+    table->slots[i] = table->slots[j];
+    i = j;
+  }
+
+  table->slots[i].id = 0;
+  table->slots[i].name = NULL;
+  table->count--;
+}
+
+bool
+objpath_add (objpath_t *set, uint32_t id, uint32_t parent,
+             const char *prefix, const char *name)
+{
+  if (!id)
+    return false;
+
+  if (parent)
+    objpath_delete (&set->prefixes, id);
+  else if (!objpath_put (&set->prefixes, id, 0, prefix))
+    return false;
+
+  if (objpath_put (&set->objects, id, parent, name))
+    return true;
+
+  objpath_delete (&set->prefixes, id);
+  return false;
+}
+
+void
+objpath_rename (objpath_t *set, uint32_t id, const char *prefix,
+                const char *name)
+{
+  objpath_slot_t *slot;
+
+  slot = objpath_find (&set->objects, id);
+  if (!slot)
+    return;
+  slot->name = name;
+
+  slot = objpath_find (&set->prefixes, id);
+  if (slot)
+    slot->name = prefix;
+}
+
+void
+objpath_remove (objpath_t *set, uint32_t id)
+{
+  objpath_delete (&set->objects, id);
+  objpath_delete (&set->prefixes, id);
+}
+
+bool
+objpath_contains (const objpath_t *set, uint32_t id)
+{
+  return objpath_find (&set->objects, id) != NULL;
+}
+
+bool
+objpath_get (const objpath_t *set, uint32_t id, char *buf, size_t size)
+{
+  const objpath_slot_t *slot, *prefix = NULL;
+  size_t len = 0, n;
+  int depth;
+
+  /* how long the path is first, it is then filled in from its end */
+  for (slot = objpath_find (&set->objects, id), depth = 0; slot;
+       slot = objpath_find (&set->objects, slot->parent), depth++)
+  {
+    /* containers can't be nested deeper, whatever the ids went through */
+    if (depth > PATH_MAX / 2)
+      return false;
+    len += strlen (slot->name) + 1;
+    if (!slot->parent)
+    {
+      prefix = objpath_find (&set->prefixes, slot->id);
+      break;
+    }
+  }
+
+  if (!prefix)
+    return false;
+  len += strlen (prefix->name);
+  if (len >= size)
+    return false;
+
+  buf[len] = '\0';
+  for (slot = objpath_find (&set->objects, id); slot;
+       slot = objpath_find (&set->objects, slot->parent))
+  {
+    n = strlen (slot->name);
+    len -= n;
+    memcpy (buf + len, slot->name, n);
+    buf[--len] = '/';
+    if (!slot->parent)
+      break;
+  }
+  memcpy (buf, prefix->name, len);
+
+  return true;
+}
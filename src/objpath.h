@@ -0,0 +1,67 @@
+/*
+ * objpath.h : GeeXboX uShare published objects index header.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _OBJPATH_H_
+#define _OBJPATH_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct objpath_slot_s {
+  uint32_t id;                  /* 0 for a free slot */
+  uint32_t parent;              /* container the object is published in */
+  const char *name;             /* not owned, see objpath_add () */
+} objpath_slot_t;
+
+/* Open addressed hash table of slots, by id. */
+typedef struct objpath_table_s {
+  objpath_slot_t *slots;
+  size_t size;                  /* a power of two, or 0 */
+  size_t count;
+} objpath_table_t;
+
+/* Objects published to the VFS, telling the path of any of them from its
+ * id and those of its containers. Names are those the caller keeps them
+ * under, not copies. Not thread safe. */
+typedef struct objpath_s {
+  objpath_table_t objects;
+  objpath_table_t prefixes;     /* directory of the objects of container 0 */
+} objpath_t;
+
+void objpath_init (objpath_t *set);
+void objpath_free (objpath_t *set);
+
+/* Add object id, published as name in container parent, false if out of
+ * memory. Objects of container 0 are in directory prefix, which is
+ * ignored otherwise. Neither is copied : they have to last as long as id
+ * is in set, or until objpath_rename () is told where they moved to. An
+ * object known already under id is replaced. */
+bool objpath_add (objpath_t *set, uint32_t id, uint32_t parent,
+                  const char *prefix, const char *name);
+void objpath_rename (objpath_t *set, uint32_t id, const char *prefix,
+                     const char *name);
+void objpath_remove (objpath_t *set, uint32_t id);
+bool objpath_contains (const objpath_t *set, uint32_t id);
+
+/* Copy the path of object id to buf of size bytes, false if it isn't
+ * known or doesn't fit. */
+bool objpath_get (const objpath_t *set, uint32_t id, char *buf, size_t size);
+
+#endif /* _OBJPATH_H_ */
@@ -0,0 +1,458 @@
+/*
+ * policy.c : GeeXboX uShare per share scan policies.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fnmatch.h>
+
+#include "policy.h"
+#include "mime.h"
+#include "gettext.h"
+
+#define SHARE_POLICY_SEP    ";"
+#define SHARE_POLICY_LIST   ","
+#define SHARE_GLOB_WILDCARDS "*?["
+
+#ifdef FNM_CASEFOLD
+#define SHARE_GLOB_FLAGS FNM_CASEFOLD
+#else
+#define SHARE_GLOB_FLAGS 0
+#endif /* FNM_CASEFOLD */
+
+static void
+share_policy_clear (share_policy_t *policy)
+{
+  int i;
+
+  if (policy->dir)
+    free (policy->dir);
+  if (policy->spec)
+    free (policy->spec);
+  for (i = 0; i < policy->nr_extensions; i++)
+    free (policy->extensions[i]);
+  if (policy->extensions)
+    free (policy->extensions);
+  for (i = 0; i < policy->nr_excludes; i++)
+    free (policy->excludes[i].pattern);
+  if (policy->excludes)
+    free (policy->excludes);
+  memset (policy, 0, sizeof (share_policy_t));
+}
+
+static bool
+share_glob_compile (share_glob_t *glob, const char *pattern)
+{
+  size_t len = strlen (pattern);
+
+  if (!strpbrk (pattern, SHARE_GLOB_WILDCARDS))
+  {
+    glob->kind = SHARE_GLOB_EXACT;
+    glob->pattern = strdup (pattern);
+  }
+  else if (pattern[0] == '*' && !strpbrk (pattern + 1, SHARE_GLOB_WILDCARDS))
+  {
+    glob->kind = SHARE_GLOB_SUFFIX;
+    glob->pattern = strdup (pattern + 1);
+  }
+  else if (pattern[len - 1] == '*'
+           && strcspn (pattern, SHARE_GLOB_WILDCARDS) == len - 1)
+  {
+    glob->kind = SHARE_GLOB_PREFIX;
+    glob->pattern = strndup (pattern, len - 1);
+  }
+  else
+  {
+    glob->kind = SHARE_GLOB_ANY;
+    glob->pattern = strdup (pattern);
+  }
+
+  if (!glob->pattern)
+    return false;
+  glob->len = strlen (glob->pattern);
+
+  return true;
+}
+
+static bool
+share_glob_match (const share_glob_t *glob, const char *name, size_t len)
+{
+  switch (glob->kind)
+  {
+  case SHARE_GLOB_EXACT:
+    return !strcasecmp (name, glob->pattern);
+  case SHARE_GLOB_PREFIX:
+    return !strncasecmp (name, glob->pattern, glob->len);
+  case SHARE_GLOB_SUFFIX:
+    return len >= glob->len
+      && !strcasecmp (name + len - glob->len, glob->pattern);
+  case SHARE_GLOB_ANY:
+    return !fnmatch (glob->pattern, name, SHARE_GLOB_FLAGS);
+  }
+
+  return false;
+}
+
+/* Parse a size, in bytes or with a K, M or G suffix, -1 if invalid. */
+static off_t
+share_policy_parse_size (const char *value)
+{
+  char *end;
+  long long size;
+
+  size = strtoll (value, &end, 10);
+  if (end == value || size < 0)
+    return -1;
+
+  switch (*end)
+  {
+  case 'G': case 'g':
+    size *= 1024;
+    /* fall through */
+  case 'M': case 'm':
+    size *= 1024;
+    /* fall through */
+  case 'K': case 'k':
+    size *= 1024;
+    end++;
+  }
+
+  return *end ? -1 : (off_t) size;
+}
+
+static bool
+share_policy_parse_list (share_policy_t *policy, const char *key,
+                         char *value)
+{
+  char *token, *buffer;
+
+  for (token = strtok_r (value, SHARE_POLICY_LIST, &buffer); token;
+       token = strtok_r (NULL, SHARE_POLICY_LIST, &buffer))
+  {
+    if (!strcmp (key, "media"))
+    {
+      unsigned int class = mime_class_parse (token);
+
+      if (!class)
+      {
+        fprintf (stderr, _("Warning: unknown media class %s.\n"), token);
+        return false;
+      }
+      policy->classes |= class;
+    }
+    else if (!strcmp (key, "ext"))
+    {
+      char **extensions;
+
+      extensions = realloc (policy->extensions,
+                            (policy->nr_extensions + 1) * sizeof (char *));
+      if (!extensions)
+        return false;
+      policy->extensions = extensions;
+      if (*token == '.')
+        token++;
+      extensions[policy->nr_extensions] = strdup (token);
+      if (!extensions[policy->nr_extensions])
+        return false;
+      policy->nr_extensions++;
+    }
+    else
+    {
+      share_glob_t *excludes;
+
+      excludes = realloc (policy->excludes,
+                          (policy->nr_excludes + 1) * sizeof (share_glob_t));
+      if (!excludes)
+        return false;
+      policy->excludes = excludes;
+      if (!share_glob_compile (&excludes[policy->nr_excludes], token))
+        return false;
+      policy->nr_excludes++;
+    }
+  }
+
+  return true;
+}
+
+static bool
+share_policy_parse_setting (share_policy_t *policy, char *setting)
+{
+  char *value;
+
+  setting += strspn (setting, " \t");
+  value = strchr (setting, '=');
+  if (!value)
+  {
+    fprintf (stderr, _("Warning: no value given to %s.\n"), setting);
+    return false;
+  }
+  *value++ = '\0';
+
+  if (!strcmp (setting, "media") || !strcmp (setting, "ext")
+      || !strcmp (setting, "exclude"))
+    return share_policy_parse_list (policy, setting, value);
+
+  if (!strcmp (setting, "depth"))
+  {
+    char *end;
+
+    policy->max_depth = strtol (value, &end, 10);
+    if (end != value && !*end && policy->max_depth >= 0)
+      return true;
+  }
+  else if (!strcmp (setting, "min_size"))
+  {
+    policy->min_size = share_policy_parse_size (value);
+    if (policy->min_size >= 0)
+      return true;
+  }
+  else if (!strcmp (setting, "max_size"))
+  {
+    policy->max_size = share_policy_parse_size (value);
+    if (policy->max_size >= 0)
+      return true;
+  }
+  else if (!strcmp (setting, "sort"))
+  {
+    policy->sort = !strcmp (value, "natural") ? SORT_NATURAL : SORT_LOCALE;
+    if (policy->sort == SORT_NATURAL || !strcmp (value, "locale"))
+      return true;
+  }
+  else if (!strcmp (setting, "follow_links"))
+  {
+    policy->follow_links = !strcmp (value, "yes");
+    if (policy->follow_links || !strcmp (value, "no"))
+      return true;
+  }
+  else
+  {
+    fprintf (stderr, _("Warning: unknown share policy setting %s.\n"),
+             setting);
+    return false;
+  }
+
+  fprintf (stderr, _("Warning: invalid value %s for %s.\n"), value, setting);
+  return false;
+}
+
+/* The directory is whatever comes before the ':' which precedes the first
+ * setting, so that it may contain ':' itself. */
+static bool
+share_policy_parse (share_policy_t *policy, const char *line)
+{
+  char *settings, *setting, *buffer, *eq, *colon;
+
+  memset (policy, 0, sizeof (share_policy_t));
+  policy->max_depth = -1;
+  policy->follow_links = true;
+  policy->sort = SORT_LOCALE;
+
+  policy->spec = strdup (line);
+  if (!policy->spec)
+    return false;
+
+  eq = strchr (line, '=');
+  for (colon = eq ? eq : (char *) line + strlen (line); colon > line; colon--)
+    if (*colon == ':')
+      break;
+  if (colon == line)
+  {
+    fprintf (stderr, _("Warning: share policy %s isn't of the "
+                       "dir:setting=value form.\n"), line);
+    return false;
+  }
+
+  policy->dir = strndup (line, colon - line);
+  settings = strdup (colon + 1);
+  if (!policy->dir || !settings)
+  {
+    if (settings)
+      free (settings);
+    return false;
+  }
+
+  for (setting = strtok_r (settings, SHARE_POLICY_SEP, &buffer); setting;
+       setting = strtok_r (NULL, SHARE_POLICY_SEP, &buffer))
+    if (!share_policy_parse_setting (policy, setting))
+    {
+      free (settings);
+      return false;
+    }
+  free (settings);
+
+  if (policy->max_size && policy->min_size > policy->max_size)
+  {
+    fprintf (stderr, _("Warning: min_size is over max_size in %s.\n"), line);
+    return false;
+  }
+
+  return true;
+}
+
+/* Shared directories are compared regardless of trailing slashes. */
+static bool
+share_policy_dir_match (const char *a, const char *b)
+{
+  size_t la = strlen (a), lb = strlen (b);
+
+  while (la > 1 && a[la - 1] == '/')
+    la--;
+  while (lb > 1 && b[lb - 1] == '/')
+    lb--;
+
+  return la == lb && !strncmp (a, b, la);
+}
+
+share_policy_list_t *
+share_policy_add (share_policy_list_t *list, const char *line)
+{
+  share_policy_t policy;
+  int i;
+
+  if (!list)
+  {
+    list = calloc (1, sizeof (share_policy_list_t));
+    if (!list)
+      return NULL;
+  }
+  if (!line)
+    return list;
+
+  if (!share_policy_parse (&policy, line))
+  {
+    fprintf (stderr, _("Warning: share policy %s ignored.\n"), line);
+    share_policy_clear (&policy);
+    return list;
+  }
+
+  for (i = 0; i < list->count; i++)
+    if (share_policy_dir_match (list->policies[i].dir, policy.dir))
+    {
+      share_policy_clear (&list->policies[i]);
+      list->policies[i] = policy;
+      return list;
+    }
+
+  {
+    share_policy_t *policies;
+
+    policies = realloc (list->policies,
+                        (list->count + 1) * sizeof (share_policy_t));
+    if (!policies)
+    {
+      share_policy_clear (&policy);
+      return list;
+    }
+    list->policies = policies;
+    list->policies[list->count++] = policy;
+  }
+
+  return list;
+}
+
+share_policy_list_t *
+share_policy_dup (const share_policy_list_t *list)
+{
+  share_policy_list_t *dup;
+  int i;
+
+  if (!list)
+    return NULL;
+
+  dup = share_policy_add (NULL, NULL);
+  for (i = 0; dup && i < list->count; i++)
+    dup = share_policy_add (dup, list->policies[i].spec);
+
+  return dup;
+}
+
+void
+share_policy_free (share_policy_list_t *list)
+{
+  int i;
+
+  if (!list)
+    return;
+
+  for (i = 0; i < list->count; i++)
+    share_policy_clear (&list->policies[i]);
+  if (list->policies)
+    free (list->policies);
+  free (list);
+}
+
+const share_policy_t *
+share_policy_lookup (const share_policy_list_t *list, const char *dir)
+{
+  const share_policy_t *fallback = NULL;
+  int i;
+
+  if (!list || !dir)
+    return NULL;
+
+  for (i = 0; i < list->count; i++)
+  {
+    if (share_policy_dir_match (list->policies[i].dir, dir))
+      return &list->policies[i];
+    if (!strcmp (list->policies[i].dir, SHARE_POLICY_DEFAULT))
+      fallback = &list->policies[i];
+  }
+
+  return fallback;
+}
+
+bool
+share_policy_name (const share_policy_t *policy, const char *name, bool dir)
+{
+  const char *ext;
+  size_t len;
+  int i;
+
+  if (!policy)
+    return true;
+
+  len = strlen (name);
+  for (i = 0; i < policy->nr_excludes; i++)
+    if (share_glob_match (&policy->excludes[i], name, len))
+      return false;
+
+  if (dir || (!policy->classes && !policy->nr_extensions))
+    return true;
+
+  if (policy->classes & mime_class (mime_lookup (name)))
+    return true;
+
+  ext = strrchr (name, '.');
+  if (ext)
+    for (i = 0; i < policy->nr_extensions; i++)
+      if (!strcasecmp (ext + 1, policy->extensions[i]))
+        return true;
+
+  return false;
+}
+
+bool
+share_policy_size (const share_policy_t *policy, off_t size)
+{
+  if (!policy)
+    return true;
+
+  return size >= policy->min_size
+    && (!policy->max_size || size <= policy->max_size);
+}
@@ -0,0 +1,84 @@
+/*
+ * policy.h : GeeXboX uShare per share scan policies header.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _POLICY_H_
+#define _POLICY_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "sortkey.h"
+
+/* Directory a policy applies to when no other one does */
+#define SHARE_POLICY_DEFAULT "*"
+
+typedef enum {
+  SHARE_GLOB_EXACT,             /* no wildcard */
+  SHARE_GLOB_PREFIX,            /* "name*" */
+  SHARE_GLOB_SUFFIX,            /* "*name", such as "*.nfo" */
+  SHARE_GLOB_ANY,               /* anything else, left to fnmatch () */
+} share_glob_kind_t;
+
+/* Exclusion pattern, sorted out once so that most are matched with a
+ * plain string comparison. */
+typedef struct share_glob_s {
+  share_glob_kind_t kind;
+  char *pattern;                /* without the '*' for prefix and suffix */
+  size_t len;
+} share_glob_t;
+
+typedef struct share_policy_s {
+  char *dir;                    /* shared directory, or SHARE_POLICY_DEFAULT */
+  char *spec;                   /* whole line, parsed again by dup */
+  unsigned int classes;         /* MIME_CLASS_* of the files published */
+  char **extensions;            /* further extensions published */
+  int nr_extensions;
+  share_glob_t *excludes;       /* names left out, files or directories */
+  int nr_excludes;
+  int max_depth;                /* levels of sub-directories, -1 for all */
+  off_t min_size;               /* 0 for no limit */
+  off_t max_size;               /* 0 for no limit */
+  bool follow_links;
+  sort_mode_t sort;             /* order the entries are published in */
+} share_policy_t;
+
+typedef struct share_policy_list_s {
+  share_policy_t *policies;
+  int count;
+} share_policy_list_t;
+
+/* Add the policy "dir:setting=value;setting=value..." to list, which is
+ * created when NULL. A policy given for the same directory again
+ * replaces the previous one. */
+share_policy_list_t *share_policy_add (share_policy_list_t *list,
+                                       const char *line);
+share_policy_list_t *share_policy_dup (const share_policy_list_t *list);
+void share_policy_free (share_policy_list_t *list);
+
+/* Policy of a shared directory, as configured, NULL when anything goes. */
+const share_policy_t *share_policy_lookup (const share_policy_list_t *list,
+                                           const char *dir);
+
+/* Whether an entry may be published, from its name alone. The media
+ * classes and extensions only apply to files. */
+bool share_policy_name (const share_policy_t *policy, const char *name,
+                        bool dir);
+bool share_policy_size (const share_policy_t *policy, off_t size);
+
+#endif /* _POLICY_H_ */
@@ -0,0 +1,152 @@
+/*
+ * pool.c : GeeXboX uShare fixed size object pool.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+
+#define POOL_ALIGN 16
+
+#define POOL_ROUND(x, n) (((x) + (n) - 1) & ~((size_t) (n) - 1))
+
+/* The free list is a stack of object indexes. Its head carries a tag
+ * bumped on every change, so that a thread which read the head before
+ * others took and gave back the same object doesn't put back a stale
+ * link. */
+#define POOL_HEAD(tag, index) (((uint64_t) (tag) << 32) | (index))
+#define POOL_HEAD_TAG(head) ((uint32_t) ((head) >> 32))
+#define POOL_HEAD_INDEX(head) ((uint32_t) (head))
+
+static size_t
+pool_page_size (void)
+{
+  long page = sysconf (_SC_PAGESIZE);
+
+  return page > 0 ? (size_t) page : 4096;
+}
+
+bool
+pool_init (pool_t *pool, size_t size, unsigned int count)
+{
+  size_t page = pool_page_size ();
+  unsigned int i;
+  void *base;
+
+  memset (pool, 0, sizeof (pool_t));
+  if (!count)
+    return true;
+
+  size = POOL_ROUND (size ? size : 1, size % page ? POOL_ALIGN : page);
+  base = mmap (NULL, POOL_ROUND (size * count, page), PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED)
+    return false;
+
+  pool->next = malloc (count * sizeof (unsigned int));
+  if (!pool->next)
+  {
+    munmap (base, POOL_ROUND (size * count, page));
+    return false;
+  }
+
+  for (i = 0; i < count; i++)
+    pool->next[i] = i + 1 < count ? i + 2 : 0;
+
+  pool->base = base;
+  pool->size = size;
+  pool->count = count;
+  pool->head = POOL_HEAD (0, 1);
+
+  return true;
+}
+
+void
+pool_free (pool_t *pool)
+{
+  if (pool->base)
+    munmap (pool->base, POOL_ROUND (pool->size * pool->count,
+                                    pool_page_size ()));
+  if (pool->next)
+    free (pool->next);
+  memset (pool, 0, sizeof (pool_t));
+}
+
+void *
+pool_get (pool_t *pool)
+{
+  uint64_t head, first;
+  unsigned int used, peak;
+  uint32_t index;
+
+  head = __atomic_load_n (&pool->head, __ATOMIC_ACQUIRE);
+  do
+  {
+    index = POOL_HEAD_INDEX (head);
+    if (!index)
+    {
+      __atomic_add_fetch (&pool->misses, 1, __ATOMIC_RELAXED);
+      return NULL;
+    }
+    first = POOL_HEAD (POOL_HEAD_TAG (head) + 1,
+                       __atomic_load_n (&pool->next[index - 1],
+                                        __ATOMIC_RELAXED));
+  }
+  while (!__atomic_compare_exchange_n (&pool->head, &head, first, true,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+  __atomic_add_fetch (&pool->gets, 1, __ATOMIC_RELAXED);
+  used = __atomic_add_fetch (&pool->used, 1, __ATOMIC_RELAXED);
+  peak = __atomic_load_n (&pool->peak, __ATOMIC_RELAXED);
+  while (used > peak
+         && !__atomic_compare_exchange_n (&pool->peak, &peak, used, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+
+  return pool->base + (index - 1) * pool->size;
+}
+
+void
+pool_put (pool_t *pool, void *object)
+{
+  uint32_t index = ((char *) object - pool->base) / pool->size + 1;
+  uint64_t head, first;
+
+  /* before the object is back, so that used never goes over count */
+  __atomic_sub_fetch (&pool->used, 1, __ATOMIC_RELAXED);
+
+  head = __atomic_load_n (&pool->head, __ATOMIC_RELAXED);
+  do
+  {
+    __atomic_store_n (&pool->next[index - 1], POOL_HEAD_INDEX (head),
+                      __ATOMIC_RELAXED);
+    first = POOL_HEAD (POOL_HEAD_TAG (head) + 1, index);
+  }
+  while (!__atomic_compare_exchange_n (&pool->head, &head, first, true,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+bool
+pool_owns (const pool_t *pool, const void *object)
+{
+  return pool->base && (const char *) object >= pool->base
+    && (const char *) object < pool->base + pool->size * pool->count;
+}
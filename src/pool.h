@@ -0,0 +1,53 @@
+/*
+ * pool.h : GeeXboX uShare fixed size object pool header.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A fixed number of same sized objects, allocated once and handed out
+ * and back by any thread without locking. Objects are page aligned when
+ * their size is a multiple of the page size. */
+typedef struct pool_s {
+  char *base;                   /* the objects, mapped at once */
+  size_t size;                  /* of an object, rounded */
+  unsigned int count;
+  unsigned int *next;           /* free list links, object index + 1 */
+  uint64_t head;                /* tag << 32 | index + 1 of the first free */
+  unsigned int used;
+  unsigned int peak;
+  unsigned long gets;           /* objects handed out */
+  unsigned long misses;         /* asked for while all were in use */
+} pool_t;
+
+/* false if out of memory, the pool then being empty. */
+bool pool_init (pool_t *pool, size_t size, unsigned int count);
+void pool_free (pool_t *pool);
+
+/* An object, NULL when they are all in use. */
+void *pool_get (pool_t *pool);
+void pool_put (pool_t *pool, void *object);
+
+/* Whether object was handed out by pool rather than allocated otherwise. */
+bool pool_owns (const pool_t *pool, const void *object);
+
+#endif /* _POOL_H_ */
@@ -0,0 +1,211 @@
+/*
+ * prefetch.c : GeeXboX uShare disk ordered media header read ahead.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif /* __linux__ */
+
+#include "prefetch.h"
+
+#define PREFETCH_DEFAULT_CAPACITY PREFETCH_WINDOW
+
+void
+prefetch_init (prefetch_t *pf, scan_io_t *io)
+{
+  memset (pf, 0, sizeof (prefetch_t));
+  pf->io = io;
+}
+
+static void
+prefetch_clear (prefetch_t *pf)
+{
+  int i;
+
+  for (i = 0; i < pf->count; i++)
+  {
+    if (pf->items[i].fd >= 0)
+      close (pf->items[i].fd);
+    free (pf->items[i].path);
+  }
+  pf->count = 0;
+}
+
+void
+prefetch_free (prefetch_t *pf)
+{
+  prefetch_clear (pf);
+  if (pf->items)
+    free (pf->items);
+  pf->items = NULL;
+  pf->capacity = 0;
+}
+
+bool
+prefetch_add (prefetch_t *pf, const char *path, dev_t dev, ino_t ino)
+{
+  prefetch_item_t *item;
+
+  if (pf->count == pf->capacity)
+  {
+    int capacity = pf->capacity ? 2 * pf->capacity : PREFETCH_DEFAULT_CAPACITY;
+    prefetch_item_t *items;
+
+    items = realloc (pf->items, capacity * sizeof (prefetch_item_t));
+    if (!items)
+      return false;
+    pf->items = items;
+    pf->capacity = capacity;
+  }
+
+  item = &pf->items[pf->count];
+  item->path = strdup (path);
+  if (!item->path)
+    return false;
+  item->dev = dev;
+  item->ino = ino;
+  item->physical = 0;
+  item->mapped = false;
+  item->fd = -1;
+  pf->count++;
+
+  return true;
+}
+
+static int
+prefetch_inode_cmp (const void *a, const void *b)
+{
+  const prefetch_item_t *ia = (const prefetch_item_t *) a;
+  const prefetch_item_t *ib = (const prefetch_item_t *) b;
+
+  if (ia->dev != ib->dev)
+    return ia->dev < ib->dev ? -1 : 1;
+  if (ia->ino != ib->ino)
+    return ia->ino < ib->ino ? -1 : 1;
+  return 0;
+}
+
+/* Files whose data couldn't be located stay in inode order, ahead of
+ * the others : filesystems tend to allocate both the same way. */
+static int
+prefetch_disk_cmp (const void *a, const void *b)
+{
+  const prefetch_item_t *ia = (const prefetch_item_t *) a;
+  const prefetch_item_t *ib = (const prefetch_item_t *) b;
+
+  if (ia->dev != ib->dev)
+    return ia->dev < ib->dev ? -1 : 1;
+  if (ia->mapped != ib->mapped)
+    return ia->mapped ? 1 : -1;
+  if (ia->mapped && ia->physical != ib->physical)
+    return ia->physical < ib->physical ? -1 : 1;
+  return prefetch_inode_cmp (a, b);
+}
+
+static void
+prefetch_open (prefetch_item_t *item)
+{
+#ifdef O_NOATIME
+  item->fd = open (item->path, O_RDONLY | O_CLOEXEC | O_NOATIME);
+  /* only allowed to the owner of the file */
+  if (item->fd < 0 && errno == EPERM)
+#endif /* O_NOATIME */
+    item->fd = open (item->path, O_RDONLY | O_CLOEXEC);
+  if (item->fd < 0)
+    return;
+
+#ifdef FS_IOC_FIEMAP
+  {
+    struct {
+      struct fiemap map;
+      struct fiemap_extent extent;
+    } fm;
+
+    memset (&fm, 0, sizeof (fm));
+    fm.map.fm_start = 0;
+    fm.map.fm_length = PREFETCH_SIZE;
+    fm.map.fm_extent_count = 1;
+    if (!ioctl (item->fd, FS_IOC_FIEMAP, &fm.map)
+        && fm.map.fm_mapped_extents
+        && !(fm.extent.fe_flags & FIEMAP_EXTENT_UNKNOWN))
+    {
+      item->physical = fm.extent.fe_physical;
+      item->mapped = true;
+    }
+  }
+#endif /* FS_IOC_FIEMAP */
+}
+
+/* Opening the files reads their inodes, which is done in inode order.
+ * Their headers are then read in the order of their location on disk
+ * when the filesystem tells it, so that the disk head sweeps them in
+ * one pass instead of seeking back and forth. */
+void
+prefetch_run (prefetch_t *pf)
+{
+  struct timespec start;
+  int i;
+
+  /* a single file isn't worth the extra open (), and while streaming
+   * the disk is better left to the streams than read ahead of need */
+  if (pf->count < 2 || (pf->io && scan_io_streaming (pf->io)))
+  {
+    prefetch_clear (pf);
+    return;
+  }
+
+  qsort (pf->items, pf->count, sizeof (prefetch_item_t), prefetch_inode_cmp);
+
+  for (i = 0; i < pf->count; i++)
+  {
+    scan_io_begin (pf->io, 1, &start);
+    prefetch_open (&pf->items[i]);
+    scan_io_end (pf->io, &start);
+  }
+
+  qsort (pf->items, pf->count, sizeof (prefetch_item_t), prefetch_disk_cmp);
+
+  for (i = 0; i < pf->count; i++)
+  {
+    prefetch_item_t *item = &pf->items[i];
+
+    if (item->fd < 0)
+      continue;
+
+    scan_io_begin (pf->io, PREFETCH_SIZE / PREFETCH_OP_SIZE, &start);
+#ifdef __linux__
+    readahead (item->fd, 0, PREFETCH_SIZE);
+#else
+    posix_fadvise (item->fd, 0, PREFETCH_SIZE, POSIX_FADV_WILLNEED);
+#endif /* __linux__ */
+    scan_io_end (pf->io, &start);
+
+    pf->files++;
+    if (item->mapped)
+      pf->mapped++;
+  }
+
+  prefetch_clear (pf);
+}
@@ -0,0 +1,64 @@
+/*
+ * prefetch.h : GeeXboX uShare disk ordered media header read ahead header.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _PREFETCH_H_
+#define _PREFETCH_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "scanio.h"
+
+/* Files whose headers are read ahead at once */
+#define PREFETCH_WINDOW 64
+/* What profiling a file mostly reads of it */
+#define PREFETCH_SIZE (256 * 1024)
+/* Read ahead counts against the scan I/O budget as an operation per */
+#define PREFETCH_OP_SIZE (64 * 1024)
+
+typedef struct prefetch_item_s {
+  char *path;
+  dev_t dev;
+  ino_t ino;
+  uint64_t physical;            /* disk offset of the header, when known */
+  bool mapped;
+  int fd;
+} prefetch_item_t;
+
+/* Files about to be profiled, whose headers are read in disk order first
+ * so that profiling them in publication order doesn't seek all over. */
+typedef struct prefetch_s {
+  prefetch_item_t *items;
+  int count;
+  int capacity;
+  scan_io_t *io;                /* optional, paces the reads */
+  unsigned long files;          /* headers read ahead */
+  unsigned long mapped;         /* of which the disk offset was known */
+} prefetch_t;
+
+void prefetch_init (prefetch_t *pf, scan_io_t *io);
+void prefetch_free (prefetch_t *pf);
+
+bool prefetch_add (prefetch_t *pf, const char *path, dev_t dev, ino_t ino);
+/* Read the headers of the files added so far ahead, unless streams are
+ * being served, and forget them. */
+void prefetch_run (prefetch_t *pf);
+
+#endif /* _PREFETCH_H_ */
@@ -95,10 +95,7 @@ process_cgi (ushare_t *ut, char *cgiargs)
     refresh = 1;
 
   if (refresh && ut->contentlist)
-  {
-    free_metadata_list (ut);
-    build_metadata_list (ut);
-  }
+    rescan_metadata_list (ut);
 
   if (ut->presentation)
     buffer_free (ut->presentation);
@@ -125,10 +122,20 @@ build_presentation_page (ushare_t *ut)
 {
   int i;
   char *mycodeset = NULL;
+  scan_progress_t progress;
 
   if (!ut)
     return -1;
 
+  /* updated by the scan meanwhile */
+  progress.running = __atomic_load_n (&ut->scan_progress.running,
+                                      __ATOMIC_ACQUIRE);
+  progress.dirs = __atomic_load_n (&ut->scan_progress.dirs, __ATOMIC_RELAXED);
+  progress.pending = __atomic_load_n (&ut->scan_progress.pending,
+                                      __ATOMIC_RELAXED);
+  progress.files = __atomic_load_n (&ut->scan_progress.files,
+                                    __ATOMIC_RELAXED);
+
   if (ut->presentation)
     buffer_free (ut->presentation);
   ut->presentation = buffer_new ();
@@ -150,6 +157,9 @@ build_presentation_page (ushare_t *ut)
                  "<meta http-equiv=\"pragma\" content=\"no-cache\"/>");
   buffer_append (ut->presentation,
                  "<meta http-equiv=\"expires\" content=\"1970-01-01\"/>");
+  if (progress.running)
+    buffer_append (ut->presentation,
+                   "<meta http-equiv=\"refresh\" content=\"5\"/>");
   buffer_append (ut->presentation, "</head>");
   buffer_append (ut->presentation, "<body>");
   buffer_append (ut->presentation, "<h1 align=\"center\">");
@@ -168,6 +178,13 @@ build_presentation_page (ushare_t *ut)
                   _("Device UDN"), ut->udn);
   //buffer_appendf (ut->presentation, "<b>%s :</b> %d<br/>",
   //              _("Number of shared files and directories"), ut->nr_entries);
+  if (progress.running)
+    buffer_appendf (ut->presentation,
+                    "<b>%s :</b> %lu %s, %lu %s, %lu %s<br/>",
+                    _("Scanning shares"),
+                    progress.dirs, _("directories done"),
+                    progress.pending, _("queued"),
+                    progress.files, _("files indexed"));
   buffer_append (ut->presentation, "</center><br/>");
 
   buffer_appendf (ut->presentation,
@@ -0,0 +1,315 @@
+/*
+ * profile.c : GeeXboX uShare media profiles.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <dlna.h>
+
+#include "profile.h"
+#include "mime.h"
+
+typedef struct profile_s {
+  char *id;                     /* DLNA.ORG_PN, NULL for none */
+  char *mime;
+  unsigned int media_class;     /* MIME_CLASS_ mask */
+#ifdef HAVE_DLNA_VFS_ITEM
+  dlna_profile_t dlna;          /* handed to libdlna, which keeps it */
+#endif /* HAVE_DLNA_VFS_ITEM */
+} profile_t;
+
+/* Profiles met so far, by index, the first one being PROFILE_NONE. */
+static profile_t *profiles[PROFILE_MAX + 1];
+static uint16_t nr_profiles = 1;
+static pthread_mutex_t profiles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool
+profile_str_eq (const char *a, const char *b)
+{
+  return a ? b && !strcmp (a, b) : !b;
+}
+
+#ifdef HAVE_DLNA_VFS_ITEM
+static dlna_media_class_t
+profile_dlna_class (unsigned int media_class)
+{
+  switch (media_class)
+  {
+  case MIME_CLASS_VIDEO:
+    return DLNA_CLASS_AV;
+  case MIME_CLASS_AUDIO:
+    return DLNA_CLASS_AUDIO;
+  case MIME_CLASS_IMAGE:
+    return DLNA_CLASS_IMAGE;
+  case MIME_CLASS_PLAYLIST:
+    return DLNA_CLASS_COLLECTION;
+  default:
+    return DLNA_CLASS_UNKNOWN;
+  }
+}
+
+static unsigned int
+profile_mime_class (dlna_media_class_t media_class)
+{
+  switch (media_class)
+  {
+  case DLNA_CLASS_AV:
+    return MIME_CLASS_VIDEO;
+  case DLNA_CLASS_AUDIO:
+    return MIME_CLASS_AUDIO;
+  case DLNA_CLASS_IMAGE:
+    return MIME_CLASS_IMAGE;
+  case DLNA_CLASS_COLLECTION:
+    return MIME_CLASS_PLAYLIST;
+  default:
+    return 0;
+  }
+}
+#endif /* HAVE_DLNA_VFS_ITEM */
+
+static profile_t *
+profile_new (const char *id, const char *mime, unsigned int media_class)
+{
+  profile_t *p;
+
+  p = calloc (1, sizeof (profile_t));
+  if (!p)
+    return NULL;
+
+  p->id = id ? strdup (id) : NULL;
+  p->mime = strdup (mime);
+  p->media_class = media_class;
+  if ((id && !p->id) || !p->mime)
+  {
+    if (p->id)
+      free (p->id);
+    if (p->mime)
+      free (p->mime);
+    free (p);
+    return NULL;
+  }
+
+#ifdef HAVE_DLNA_VFS_ITEM
+  p->dlna.id = p->id;
+  p->dlna.mime = p->mime;
+  p->dlna.label = "";
+  p->dlna.media_class = profile_dlna_class (media_class);
+#endif /* HAVE_DLNA_VFS_ITEM */
+
+  return p;
+}
+
+uint16_t
+profile_intern (const char *id, const char *mime, unsigned int media_class)
+{
+  uint16_t i;
+
+  if (!mime)
+    return PROFILE_NONE;
+
+  /* only a few dozens of them, met once per probe */
+  pthread_mutex_lock (&profiles_lock);
+  for (i = 1; i < nr_profiles; i++)
+    if (profiles[i]->media_class == media_class
+        && profile_str_eq (profiles[i]->id, id)
+        && !strcmp (profiles[i]->mime, mime))
+      break;
+
+  if (i == nr_profiles)
+  {
+    if (i <= PROFILE_MAX
+        && (profiles[i] = profile_new (id, mime, media_class)))
+      nr_profiles++;
+    else
+      i = PROFILE_NONE;
+  }
+  pthread_mutex_unlock (&profiles_lock);
+
+  return i;
+}
+
+static const profile_t *
+profile_find (uint16_t profile)
+{
+  const profile_t *p = NULL;
+
+  pthread_mutex_lock (&profiles_lock);
+  if (profile != PROFILE_NONE && profile < nr_profiles)
+    p = profiles[profile];
+  pthread_mutex_unlock (&profiles_lock);
+
+  return p;
+}
+
+bool
+profile_get (uint16_t profile, const char **id, const char **mime,
+             unsigned int *media_class)
+{
+  const profile_t *p = profile_find (profile);
+
+  if (!p)
+    return false;
+
+  *id = p->id;
+  *mime = p->mime;
+  *media_class = p->media_class;
+
+  return true;
+}
+
+uint16_t
+profile_count (void)
+{
+  uint16_t count;
+
+  pthread_mutex_lock (&profiles_lock);
+  count = nr_profiles;
+  pthread_mutex_unlock (&profiles_lock);
+
+  return count;
+}
+
+uint16_t
+profile_guess (const char *name)
+{
+  const struct mime_type_t *mime = mime_lookup (name);
+  const char *type, *end;
+  char buf[128];
+
+  if (!mime)
+    return PROFILE_NONE;
+
+  /* protocol info is "http-get:*:<MIME type>:" */
+  type = strchr (mime->mime_protocol, ':');
+  type = type ? strchr (type + 1, ':') : NULL;
+  end = type ? strchr (type + 1, ':') : NULL;
+  if (!end || (size_t) (end - type - 1) >= sizeof (buf))
+    return PROFILE_NONE;
+  memcpy (buf, type + 1, end - type - 1);
+  buf[end - type - 1] = '\0';
+
+  return profile_intern (NULL, buf, mime_class (mime));
+}
+
+#ifdef HAVE_DLNA_VFS_ITEM
+/* Keep what libdlna found the file of item to be. */
+static void
+profile_info_found (profile_info_t *info, const dlna_item_t *item)
+{
+  unsigned int h, m, s, ms = 0;
+
+  info->profile = PROFILE_NONE;
+  info->duration = 0;
+  info->bitrate = 0;
+
+  if (item->profile)
+    info->profile =
+      profile_intern (item->profile->id, item->profile->mime,
+                      profile_mime_class (item->profile->media_class));
+
+  if (item->properties)
+  {
+    /* H:MM:SS.mmm, as libdlna writes it for res@duration */
+    if (sscanf (item->properties->duration, "%u:%u:%u.%u",
+                &h, &m, &s, &ms) >= 3)
+      info->duration = ((h * 60 + m) * 60 + s) * 1000 + ms;
+    info->bitrate = item->properties->bitrate;
+  }
+}
+
+/* Item of the file at path, as found when it was probed before. */
+static dlna_item_t *
+profile_item_new (char *path, off_t size, const profile_info_t *info)
+{
+  profile_t *p = (profile_t *) profile_find (info->profile);
+  dlna_item_t *item;
+
+  if (!p)
+    return NULL;
+
+  item = calloc (1, sizeof (dlna_item_t));
+  if (!item)
+    return NULL;
+
+  item->filename = strdup (path);
+  item->filesize = size;
+  item->properties = calloc (1, sizeof (dlna_properties_t));
+  item->profile = &p->dlna;
+  if (!item->filename || !item->properties)
+  {
+    dlna_item_free (item);
+    return NULL;
+  }
+
+  if (info->duration)
+    snprintf (item->properties->duration,
+              sizeof (item->properties->duration), "%u:%02u:%02u.%03u",
+              info->duration / 3600000, info->duration / 60000 % 60,
+              info->duration / 1000 % 60, info->duration % 1000);
+  item->properties->bitrate = info->bitrate;
+
+  return item;
+}
+#endif /* HAVE_DLNA_VFS_ITEM */
+
+bool
+profile_publish_known (void)
+{
+#ifdef HAVE_DLNA_VFS_ITEM
+  return true;
+#else
+  return false;
+#endif /* HAVE_DLNA_VFS_ITEM */
+}
+
+uint32_t
+profile_publish (dlna_t *dlna, char *name, char *path, off_t size,
+                 uint32_t parent, profile_info_t *info)
+{
+#ifdef HAVE_DLNA_VFS_ITEM
+  dlna_item_t *item = NULL;
+  uint32_t id;
+
+  if (info->profile != PROFILE_NONE)
+    item = profile_item_new (path, size, info);
+
+  if (!item)
+  {
+    item = dlna_item_new (dlna, path);
+    if (!item)
+    {
+      info->profile = PROFILE_NONE;
+      return 0;
+    }
+    profile_info_found (info, item);
+  }
+
+  /* the VFS keeps the item from then on */
+  id = dlna_vfs_add_resource (dlna, name, item, parent);
+  if (!id)
+    dlna_item_free (item);
+
+  return id;
+#else
+  /* libdlna 0.3.0 only takes paths, which it probes and keeps to itself */
+  info->profile = PROFILE_NONE;
+  return dlna_vfs_add_resource (dlna, name, path, size, parent);
+#endif /* HAVE_DLNA_VFS_ITEM */
+}
@@ -0,0 +1,67 @@
+/*
+ * profile.h : GeeXboX uShare media profiles header.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <dlna.h>
+
+/* Profile of the files libdlna didn't tell one for (yet) */
+#define PROFILE_NONE 0
+/* Profiles are told apart by a 12 bits index */
+#define PROFILE_MAX 4095
+
+/* What probing a file found, kept so that it isn't probed again as long
+ * as the file doesn't change. */
+typedef struct profile_info_s {
+  uint16_t profile;             /* PROFILE_NONE if not known */
+  uint32_t duration;            /* milliseconds, 0 if not known */
+  uint32_t bitrate;             /* bytes per second, 0 if not known */
+} profile_info_t;
+
+/* Index of the profile of DLNA id (NULL for none), MIME type mime and of
+ * MIME_CLASS_ class, added the first time it is met. PROFILE_NONE if
+ * out of memory or indexes. Profiles are never given back. */
+uint16_t profile_intern (const char *id, const char *mime,
+                         unsigned int media_class);
+/* Fill in what profile is, false if it isn't known. */
+bool profile_get (uint16_t profile, const char **id, const char **mime,
+                  unsigned int *media_class);
+/* Profiles known so far, PROFILE_NONE included. */
+uint16_t profile_count (void);
+
+/* Profile of the file name only going by its extension, with neither DLNA
+ * name nor properties, PROFILE_NONE if it isn't one of a media. */
+uint16_t profile_guess (const char *name);
+
+/* Whether libdlna can be handed a known profile, rather than always
+ * probing files as they are published. */
+bool profile_publish_known (void);
+
+/* Publish the file at path as name in container parent. libdlna is handed
+ * the profile in info when it is known and it can be, otherwise it probes
+ * the file, and what it found is set in info. Returns the object id, 0 if
+ * libdlna found no profile for it. */
+uint32_t profile_publish (dlna_t *dlna, char *name, char *path, off_t size,
+                          uint32_t parent, profile_info_t *info);
+
+#endif /* _PROFILE_H_ */
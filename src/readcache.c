@@ -0,0 +1,410 @@
+/*
+ * readcache.c : GeeXboX uShare shared media read cache.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "readcache.h"
+#include "minmax.h"
+
+#define READ_CACHE_MIN_BUCKETS 16
+
+struct read_chunk_s {
+  read_key_t key;
+  off_t index;                  /* of the chunk in the file */
+  char *data;
+  size_t len;                   /* less than READ_CACHE_CHUNK at the end */
+  int users;                    /* streams copying from it, or reading it */
+  bool loading;                 /* being read from disk */
+  read_chunk_t *hash_next;
+  read_chunk_t *newer;
+  read_chunk_t *older;
+};
+
+static size_t
+read_cache_hash (const read_key_t *key, off_t index, size_t nr_buckets)
+{
+  uint64_t h;
+
+  h = (uint64_t) key->ino * 0x9e3779b97f4a7c15ULL;
+  h ^= (uint64_t) key->dev + 0x7f4a7c159e3779b9ULL + (h << 6) + (h >> 2);
+  h ^= (uint64_t) index * 0xbf58476d1ce4e5b9ULL;
+
+  return (size_t) (h ^ (h >> 31)) & (nr_buckets - 1);
+}
+
+static bool
+read_key_equal (const read_key_t *a, const read_key_t *b)
+{
+  return a->ino == b->ino && a->dev == b->dev
+    && a->mtime == b->mtime && a->size == b->size;
+}
+
+static read_chunk_t *
+read_cache_find (read_cache_t *cache, const read_key_t *key, off_t index)
+{
+  read_chunk_t *chunk;
+
+  if (!cache->nr_buckets)
+    return NULL;
+
+  for (chunk = cache->buckets[read_cache_hash (key, index,
+                                               cache->nr_buckets)];
+       chunk; chunk = chunk->hash_next)
+    if (chunk->index == index && read_key_equal (&chunk->key, key))
+      return chunk;
+
+  return NULL;
+}
+
+static void
+read_cache_hash_add (read_cache_t *cache, read_chunk_t *chunk)
+{
+  size_t h = read_cache_hash (&chunk->key, chunk->index, cache->nr_buckets);
+
+  chunk->hash_next = cache->buckets[h];
+  cache->buckets[h] = chunk;
+}
+
+static void
+read_cache_lru_add (read_cache_t *cache, read_chunk_t *chunk)
+{
+  chunk->older = cache->newest;
+  chunk->newer = NULL;
+  if (cache->newest)
+    cache->newest->newer = chunk;
+  else
+    cache->oldest = chunk;
+  cache->newest = chunk;
+}
+
+static void
+read_cache_lru_remove (read_cache_t *cache, read_chunk_t *chunk)
+{
+  if (chunk->newer)
+    chunk->newer->older = chunk->older;
+  else
+    cache->newest = chunk->older;
+  if (chunk->older)
+    chunk->older->newer = chunk->newer;
+  else
+    cache->oldest = chunk->newer;
+}
+
+static void
+read_cache_remove (read_cache_t *cache, read_chunk_t *chunk)
+{
+  read_chunk_t **prev;
+
+  prev = &cache->buckets[read_cache_hash (&chunk->key, chunk->index,
+                                          cache->nr_buckets)];
+  while (*prev != chunk)
+    prev = &(*prev)->hash_next;
+  *prev = chunk->hash_next;
+
+  read_cache_lru_remove (cache, chunk);
+  cache->size -= READ_CACHE_CHUNK;
+}
+
+static void
+read_chunk_free (read_chunk_t *chunk)
+{
+  free (chunk->data);
+  free (chunk);
+}
+
+/* Take the least recently used chunk no stream is using out of the
+ * cache, NULL if they all are in use. */
+static read_chunk_t *
+read_cache_evict (read_cache_t *cache)
+{
+  read_chunk_t *chunk;
+
+  for (chunk = cache->oldest; chunk; chunk = chunk->newer)
+    if (!chunk->users)
+    {
+      read_cache_remove (cache, chunk);
+      return chunk;
+    }
+
+  return NULL;
+}
+
+void
+read_cache_init (read_cache_t *cache)
+{
+  memset (cache, 0, sizeof (read_cache_t));
+  pthread_mutex_init (&cache->lock, NULL);
+  pthread_cond_init (&cache->loaded, NULL);
+}
+
+void
+read_cache_free (read_cache_t *cache)
+{
+  read_chunk_t *chunk, *older;
+
+  for (chunk = cache->newest; chunk; chunk = older)
+  {
+    older = chunk->older;
+    read_chunk_free (chunk);
+  }
+  if (cache->buckets)
+    free (cache->buckets);
+  pthread_cond_destroy (&cache->loaded);
+  pthread_mutex_destroy (&cache->lock);
+}
+
+void
+read_cache_reset (read_cache_t *cache)
+{
+  pthread_mutex_lock (&cache->lock);
+  cache->served = 0;
+  cache->disk_bytes = 0;
+  cache->disk_reads = 0;
+  cache->hits = 0;
+  cache->shared = 0;
+  pthread_mutex_unlock (&cache->lock);
+}
+
+void
+read_cache_set_budget (read_cache_t *cache, size_t budget)
+{
+  read_chunk_t **buckets, *chunk;
+  size_t nr_buckets = READ_CACHE_MIN_BUCKETS;
+
+  /* a budget that doesn't hold a chunk turns the cache off */
+  if (budget < READ_CACHE_CHUNK)
+    budget = 0;
+  while (nr_buckets < 2 * (budget / READ_CACHE_CHUNK))
+    nr_buckets *= 2;
+
+  pthread_mutex_lock (&cache->lock);
+  cache->budget = budget;
+
+  if (budget && nr_buckets != cache->nr_buckets)
+  {
+    buckets = calloc (nr_buckets, sizeof (read_chunk_t *));
+    if (buckets)
+    {
+      if (cache->buckets)
+        free (cache->buckets);
+      cache->buckets = buckets;
+      cache->nr_buckets = nr_buckets;
+      for (chunk = cache->newest; chunk; chunk = chunk->older)
+        read_cache_hash_add (cache, chunk);
+    }
+    else if (!cache->buckets)
+      cache->budget = 0;
+  }
+
+  while (cache->size > cache->budget && (chunk = read_cache_evict (cache)))
+    read_chunk_free (chunk);
+  pthread_mutex_unlock (&cache->lock);
+}
+
+static ssize_t
+read_cache_pread (int fd, char *buf, size_t len, off_t pos)
+{
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < len)
+  {
+    n = pread (fd, buf + done, len - done, pos + done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return done ? (ssize_t) done : -1;
+    if (!n)
+      break;
+    done += n;
+  }
+
+  return done;
+}
+
+/* Read straight from disk, without the cache. */
+static ssize_t
+read_cache_direct (read_cache_t *cache, int fd, char *buf, size_t len,
+                   off_t pos)
+{
+  ssize_t n;
+
+  n = read_cache_pread (fd, buf, len, pos);
+
+  pthread_mutex_lock (&cache->lock);
+  cache->disk_reads++;
+  if (n > 0)
+  {
+    cache->disk_bytes += n;
+    cache->served += n;
+  }
+  pthread_mutex_unlock (&cache->lock);
+
+  return n;
+}
+
+/* The chunk at index, found in the cache or read from disk, and held
+ * until read_cache_release (). NULL if it can't be cached. */
+static read_chunk_t *
+read_cache_get (read_cache_t *cache, int fd, const read_key_t *key,
+                off_t index)
+{
+  read_chunk_t *chunk;
+  ssize_t n;
+
+  pthread_mutex_lock (&cache->lock);
+  chunk = read_cache_find (cache, key, index);
+  if (chunk && chunk->loading)
+  {
+    /* another stream is reading it, share its read */
+    cache->shared++;
+    do
+    {
+      pthread_cond_wait (&cache->loaded, &cache->lock);
+      chunk = read_cache_find (cache, key, index);
+    }
+    while (chunk && chunk->loading);
+  }
+
+  if (chunk)
+  {
+    cache->hits++;
+    chunk->users++;
+    read_cache_lru_remove (cache, chunk);
+    read_cache_lru_add (cache, chunk);
+    pthread_mutex_unlock (&cache->lock);
+    return chunk;
+  }
+
+  if (!cache->budget)
+  {
+    pthread_mutex_unlock (&cache->lock);
+    return NULL;
+  }
+
+  /* reuse the least recently used chunk once the budget is spent */
+  if (cache->size + READ_CACHE_CHUNK > cache->budget)
+    chunk = read_cache_evict (cache);
+  else
+  {
+    chunk = malloc (sizeof (read_chunk_t));
+    if (chunk)
+    {
+      chunk->data = malloc (READ_CACHE_CHUNK);
+      if (!chunk->data)
+      {
+        free (chunk);
+        chunk = NULL;
+      }
+    }
+  }
+  if (!chunk)
+  {
+    pthread_mutex_unlock (&cache->lock);
+    return NULL;
+  }
+
+  chunk->key = *key;
+  chunk->index = index;
+  chunk->len = 0;
+  chunk->users = 1;
+  chunk->loading = true;
+  read_cache_hash_add (cache, chunk);
+  read_cache_lru_add (cache, chunk);
+  cache->size += READ_CACHE_CHUNK;
+  pthread_mutex_unlock (&cache->lock);
+
+  n = read_cache_pread (fd, chunk->data,
+                        (size_t) MIN (READ_CACHE_CHUNK,
+                                      key->size - index * READ_CACHE_CHUNK),
+                        index * READ_CACHE_CHUNK);
+
+  pthread_mutex_lock (&cache->lock);
+  cache->disk_reads++;
+  chunk->loading = false;
+  if (n > 0)
+  {
+    cache->disk_bytes += n;
+    chunk->len = n;
+  }
+  else
+  {
+    read_cache_remove (cache, chunk);
+    read_chunk_free (chunk);
+    chunk = NULL;
+  }
+  pthread_cond_broadcast (&cache->loaded);
+  pthread_mutex_unlock (&cache->lock);
+
+  return chunk;
+}
+
+static void
+read_cache_release (read_cache_t *cache, read_chunk_t *chunk, size_t served)
+{
+  pthread_mutex_lock (&cache->lock);
+  chunk->users--;
+  cache->served += served;
+  /* chunks kept past a budget cut as they were in use */
+  while (cache->size > cache->budget && (chunk = read_cache_evict (cache)))
+    read_chunk_free (chunk);
+  pthread_mutex_unlock (&cache->lock);
+}
+
+ssize_t
+read_cache_read (read_cache_t *cache, int fd, const read_key_t *key,
+                 char *buf, size_t len, off_t pos)
+{
+  read_chunk_t *chunk;
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < len && pos < key->size)
+  {
+    off_t index = pos / READ_CACHE_CHUNK;
+    size_t offset = pos % READ_CACHE_CHUNK;
+
+    chunk = read_cache_get (cache, fd, key, index);
+    if (!chunk)
+    {
+      /* the rest of the read, the cache being off, full or failing */
+      n = read_cache_direct (cache, fd, buf + done, len - done, pos);
+      if (n < 0)
+        return done ? (ssize_t) done : -1;
+      return done + n;
+    }
+
+    n = offset < chunk->len ? (ssize_t) MIN (len - done, chunk->len - offset)
+      : 0;
+    memcpy (buf + done, chunk->data + offset, n);
+    read_cache_release (cache, chunk, n);
+
+    /* the file is shorter than when it was opened */
+    if (!n)
+      break;
+    done += n;
+    pos += n;
+  }
+
+  return done;
+}
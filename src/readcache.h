@@ -0,0 +1,73 @@
+/*
+ * readcache.h : GeeXboX uShare shared media read cache header.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _READCACHE_H_
+#define _READCACHE_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/* Unit the cache reads media files by */
+#define READ_CACHE_CHUNK (256 * 1024)
+
+/* What tells a file apart, its mtime and size changing with its
+ * contents. */
+typedef struct read_key_s {
+  dev_t dev;
+  ino_t ino;
+  time_t mtime;
+  off_t size;
+} read_key_t;
+
+typedef struct read_chunk_s read_chunk_t;
+
+/* Chunks of the media files being served, shared by all the streams of a
+ * file, the least recently used being dropped once over budget. */
+typedef struct read_cache_s {
+  pthread_mutex_t lock;
+  pthread_cond_t loaded;        /* a chunk was read from disk */
+  read_chunk_t **buckets;
+  size_t nr_buckets;            /* a power of two, or 0 */
+  read_chunk_t *newest;
+  read_chunk_t *oldest;
+  size_t budget;                /* bytes, 0 to read straight from disk */
+  size_t size;                  /* bytes held */
+  uint64_t served;              /* bytes handed to streams */
+  uint64_t disk_bytes;          /* bytes read from disk */
+  unsigned long disk_reads;
+  unsigned long hits;           /* chunks found in the cache */
+  unsigned long shared;         /* chunks waited for while being read */
+} read_cache_t;
+
+void read_cache_init (read_cache_t *cache);
+void read_cache_free (read_cache_t *cache);
+void read_cache_reset (read_cache_t *cache);
+
+/* Change the budget, dropping chunks until the cache fits in. */
+void read_cache_set_budget (read_cache_t *cache, size_t budget);
+
+/* Read up to len bytes at pos of the file open as fd, either from the
+ * cache or from disk, filling the cache. Returns the bytes read, fewer
+ * only at the end of the file, or -1 on error. */
+ssize_t read_cache_read (read_cache_t *cache, int fd, const read_key_t *key,
+                         char *buf, size_t len, off_t pos);
+
+#endif /* _READCACHE_H_ */
@@ -0,0 +1,257 @@
+/*
+ * scanio.c : GeeXboX uShare scan I/O policy.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif /* __linux__ */
+
+#include "scanio.h"
+
+#if defined(__linux__) && defined(SYS_ioprio_set)
+/* from linux/ioprio.h, which isn't meant for userspace */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_IDLE (IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT)
+#endif
+
+/* Cheaper, and precise enough to tell seconds apart */
+#ifdef CLOCK_MONOTONIC_COARSE
+#define SCAN_IO_COARSE_CLOCK CLOCK_MONOTONIC_COARSE
+#else
+#define SCAN_IO_COARSE_CLOCK CLOCK_MONOTONIC
+#endif
+
+static double
+timespec_diff (const struct timespec *a, const struct timespec *b)
+{
+  return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+static void
+timespec_add (struct timespec *ts, double seconds)
+{
+  long nsec = ts->tv_nsec + (long) ((seconds - (time_t) seconds) * 1e9);
+
+  ts->tv_sec += (time_t) seconds + nsec / 1000000000;
+  ts->tv_nsec = nsec % 1000000000;
+}
+
+void
+scan_io_init (scan_io_t *io)
+{
+  memset (io, 0, sizeof (scan_io_t));
+  pthread_mutex_init (&io->lock, NULL);
+}
+
+void
+scan_io_free (scan_io_t *io)
+{
+  pthread_mutex_destroy (&io->lock);
+}
+
+void
+scan_io_reset (scan_io_t *io)
+{
+  pthread_mutex_lock (&io->lock);
+  io->streams = 0;
+  io->ops = 0;
+  io->throttled = 0;
+  io->backoffs = 0;
+  io->stalls = 0;
+  io->waited = 0;
+  pthread_mutex_unlock (&io->lock);
+}
+
+void
+scan_io_set (scan_io_t *io, bool idle, int rate, int stream_rate)
+{
+  pthread_mutex_lock (&io->lock);
+  io->idle = idle;
+  io->rate = rate;
+  io->stream_rate = stream_rate;
+  pthread_mutex_unlock (&io->lock);
+}
+
+/* Threads have their own I/O priority on Linux, so that only the
+ * scanning ones give way to streaming. */
+int
+scan_io_thread (scan_io_t *io)
+{
+#ifdef IOPRIO_IDLE
+  bool idle = false;
+  int prio;
+
+  if (io)
+  {
+    pthread_mutex_lock (&io->lock);
+    idle = io->idle;
+    pthread_mutex_unlock (&io->lock);
+  }
+  if (!idle)
+    return -1;
+
+  prio = syscall (SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+  if (prio < 0 || prio == IOPRIO_IDLE
+      || syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_IDLE) < 0)
+    return -1;
+
+  return prio;
+#else
+  (void) io;
+  return -1;
+#endif /* IOPRIO_IDLE */
+}
+
+void
+scan_io_thread_restore (int prio)
+{
+#ifdef IOPRIO_IDLE
+  if (prio >= 0)
+    syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, prio);
+#else
+  (void) prio;
+#endif /* IOPRIO_IDLE */
+}
+
+/* Called with io->lock held. */
+static void
+scan_io_stream_seen (scan_io_t *io)
+{
+  clock_gettime (CLOCK_MONOTONIC, &io->stream_seen);
+  __atomic_store_n (&io->stream_sec, io->stream_seen.tv_sec, __ATOMIC_RELAXED);
+}
+
+void
+scan_io_stream (scan_io_t *io)
+{
+  pthread_mutex_lock (&io->lock);
+  scan_io_stream_seen (io);
+  io->streams++;
+  pthread_mutex_unlock (&io->lock);
+}
+
+void
+scan_io_stream_alive (scan_io_t *io)
+{
+  struct timespec now;
+
+  /* a second off doesn't matter against SCAN_IO_STREAM_IDLE */
+  clock_gettime (SCAN_IO_COARSE_CLOCK, &now);
+  if (now.tv_sec == __atomic_load_n (&io->stream_sec, __ATOMIC_RELAXED))
+    return;
+
+  pthread_mutex_lock (&io->lock);
+  scan_io_stream_seen (io);
+  pthread_mutex_unlock (&io->lock);
+}
+
+/* Called with io->lock held. */
+static bool
+scan_io_streaming_at (const scan_io_t *io, const struct timespec *now)
+{
+  return (io->stream_seen.tv_sec || io->stream_seen.tv_nsec)
+    && timespec_diff (now, &io->stream_seen) < SCAN_IO_STREAM_IDLE;
+}
+
+bool
+scan_io_streaming (scan_io_t *io)
+{
+  struct timespec now;
+  bool streaming;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  pthread_mutex_lock (&io->lock);
+  streaming = scan_io_streaming_at (io, &now);
+  pthread_mutex_unlock (&io->lock);
+
+  return streaming;
+}
+
+/* Operations are given evenly spaced start times, whatever the thread
+ * issuing them : a thread books the next slot, and sleeps until then. */
+void
+scan_io_begin (scan_io_t *io, unsigned int ops, struct timespec *start)
+{
+  struct timespec now, slot;
+  double wait = 0;
+  int rate;
+
+  if (!io)
+    return;
+
+  if (ops)
+  {
+    clock_gettime (CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock (&io->lock);
+    io->ops += ops;
+    rate = io->rate;
+    if (scan_io_streaming_at (io, &now))
+    {
+      io->backoffs += ops;
+      if (io->stream_rate && (!rate || io->stream_rate < rate))
+        rate = io->stream_rate;
+    }
+
+    if (rate)
+    {
+      slot = timespec_diff (&io->next, &now) > 0 ? io->next : now;
+      wait = timespec_diff (&slot, &now);
+      io->next = slot;
+      timespec_add (&io->next, (double) ops / rate);
+      if (wait > 0)
+      {
+        io->throttled += ops;
+        io->waited += wait;
+      }
+    }
+    pthread_mutex_unlock (&io->lock);
+
+    if (wait > 0)
+      while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &slot, NULL)
+             == EINTR)
+        ;
+  }
+
+  if (start)
+    clock_gettime (CLOCK_MONOTONIC, start);
+}
+
+void
+scan_io_end (scan_io_t *io, const struct timespec *start)
+{
+  struct timespec now;
+
+  if (!io)
+    return;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  if (timespec_diff (&now, start) * 1000 < SCAN_IO_STALL_MS)
+    return;
+
+  pthread_mutex_lock (&io->lock);
+  io->stalls++;
+  pthread_mutex_unlock (&io->lock);
+}
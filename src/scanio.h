@@ -0,0 +1,75 @@
+/*
+ * scanio.h : GeeXboX uShare scan I/O policy header.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _SCANIO_H_
+#define _SCANIO_H_
+
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+
+/* A scan operation taking longer than this is counted as a stall */
+#define SCAN_IO_STALL_MS 100
+/* Streams are considered active this long after the last media request */
+#define SCAN_IO_STREAM_IDLE 30
+
+/* How much disk time scans may take, shared by every scanning thread. */
+typedef struct scan_io_s {
+  bool idle;                    /* idle I/O class for scanning threads */
+  int rate;                     /* operations per second, 0 for no limit */
+  int stream_rate;              /* same, while streams are active */
+  pthread_mutex_t lock;
+  struct timespec next;         /* when the next operation may start */
+  struct timespec stream_seen;  /* last media request */
+  time_t stream_sec;            /* its second, read without the lock */
+  unsigned long streams;        /* media requests seen */
+  unsigned long ops;            /* operations issued by scans */
+  unsigned long throttled;      /* operations delayed by the budget */
+  unsigned long backoffs;       /* operations issued while streaming */
+  unsigned long stalls;         /* operations slower than SCAN_IO_STALL_MS */
+  double waited;                /* seconds spent delayed */
+} scan_io_t;
+
+void scan_io_init (scan_io_t *io);
+void scan_io_free (scan_io_t *io);
+void scan_io_reset (scan_io_t *io);
+/* Change the policy, scans in progress follow it from their next
+ * operation on, or their next thread for the I/O class. */
+void scan_io_set (scan_io_t *io, bool idle, int rate, int stream_rate);
+
+/* Move the calling thread to the idle I/O class when asked to, and
+ * return the class it was in for scan_io_thread_restore (), -1 if none. */
+int scan_io_thread (scan_io_t *io);
+void scan_io_thread_restore (int prio);
+
+/* Note a media request, scans back off for a while. */
+void scan_io_stream (scan_io_t *io);
+/* Note that a stream is still being served, without counting a request.
+ * Meant to be called for every chunk sent, only takes the lock once a
+ * second. */
+void scan_io_stream_alive (scan_io_t *io);
+bool scan_io_streaming (scan_io_t *io);
+
+/* Wait until ops more operations fit in the budget, then note in start
+ * (unless NULL) when they began. io may be NULL, which doesn't wait. */
+void scan_io_begin (scan_io_t *io, unsigned int ops, struct timespec *start);
+/* Count the operations begun at start as a stall if they took too long. */
+void scan_io_end (scan_io_t *io, const struct timespec *start);
+
+#endif /* _SCANIO_H_ */
@@ -0,0 +1,265 @@
+/*
+ * sortkey.c : GeeXboX uShare entry name collation.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <wctype.h>
+
+#include "sortkey.h"
+
+/* Longest run of digits given a single length byte */
+#define SORT_DIGITS_MAX 255
+/* Keys of most names fit in there */
+#define SORT_KEY_SIZE 1024
+
+typedef struct sort_item_s {
+  const char *name;
+  const char *key;
+  size_t offset;                /* of the key, while the key block grows */
+  size_t len;
+  int index;
+} sort_item_t;
+
+static void
+sort_key_put (char *key, size_t size, size_t *len, unsigned char c)
+{
+  if (*len < size)
+    key[*len] = (char) c;
+  (*len)++;
+}
+
+/* Decode the UTF-8 sequence at s, -1 if invalid. */
+static long
+sort_utf8_decode (const unsigned char *s, int *n)
+{
+  long c;
+  int i;
+
+  if (s[0] < 0xc2 || s[0] > 0xf4)
+    return -1;
+
+  *n = s[0] >= 0xf0 ? 4 : s[0] >= 0xe0 ? 3 : 2;
+  c = s[0] & (0x7f >> *n);
+  for (i = 1; i < *n; i++)
+  {
+    if ((s[i] & 0xc0) != 0x80)
+      return -1;
+    c = (c << 6) | (s[i] & 0x3f);
+  }
+
+  return c;
+}
+
+static void
+sort_utf8_put (char *key, size_t size, size_t *len, long c)
+{
+  if (c < 0x80)
+    sort_key_put (key, size, len, c);
+  else if (c < 0x800)
+  {
+    sort_key_put (key, size, len, 0xc0 | (c >> 6));
+    sort_key_put (key, size, len, 0x80 | (c & 0x3f));
+  }
+  else if (c < 0x10000)
+  {
+    sort_key_put (key, size, len, 0xe0 | (c >> 12));
+    sort_key_put (key, size, len, 0x80 | ((c >> 6) & 0x3f));
+    sort_key_put (key, size, len, 0x80 | (c & 0x3f));
+  }
+  else
+  {
+    sort_key_put (key, size, len, 0xf0 | (c >> 18));
+    sort_key_put (key, size, len, 0x80 | ((c >> 12) & 0x3f));
+    sort_key_put (key, size, len, 0x80 | ((c >> 6) & 0x3f));
+    sort_key_put (key, size, len, 0x80 | (c & 0x3f));
+  }
+}
+
+/* Letters are case folded, and runs of digits turned into '0', their
+ * length and the digits without leading zeros : a shorter number, which
+ * is a smaller one, then sorts first, as if all were padded to the same
+ * width. UTF-8 keeps code point order byte-wise. */
+static size_t
+sort_key_natural (const char *name, char *key, size_t size)
+{
+  const unsigned char *s = (const unsigned char *) name;
+  size_t len = 0;
+
+  while (*s)
+  {
+    if (*s >= '0' && *s <= '9')
+    {
+      size_t digits;
+
+      while (*s == '0' && s[1] >= '0' && s[1] <= '9')
+        s++;
+      for (digits = 0; s[digits] >= '0' && s[digits] <= '9'; digits++)
+        ;
+
+      while (digits)
+      {
+        size_t run = digits > SORT_DIGITS_MAX ? SORT_DIGITS_MAX : digits;
+
+        sort_key_put (key, size, &len, '0');
+        sort_key_put (key, size, &len, run);
+        for (digits -= run; run; run--)
+          sort_key_put (key, size, &len, *s++);
+      }
+    }
+    else if (*s < 0x80)
+    {
+      sort_key_put (key, size, &len,
+                    *s >= 'A' && *s <= 'Z' ? *s - 'A' + 'a' : *s);
+      s++;
+    }
+    else
+    {
+      long c;
+      int n;
+
+      c = sort_utf8_decode (s, &n);
+      if (c < 0)
+      {
+        sort_key_put (key, size, &len, *s++);
+        continue;
+      }
+      sort_utf8_put (key, size, &len, towlower ((wint_t) c));
+      s += n;
+    }
+  }
+
+  if (len < size)
+    key[len] = '\0';
+
+  return len;
+}
+
+size_t
+sort_key (sort_mode_t mode, const char *name, char *key, size_t size)
+{
+  if (mode == SORT_NATURAL)
+    return sort_key_natural (name, key, size);
+
+  return strxfrm (key, name, size);
+}
+
+static int
+sort_key_cmp (const char *a, size_t alen, const char *b, size_t blen)
+{
+  int cmp;
+
+  cmp = memcmp (a, b, alen < blen ? alen : blen);
+  if (cmp)
+    return cmp;
+
+  return alen < blen ? -1 : alen > blen;
+}
+
+int
+sort_cmp (sort_mode_t mode, const char *a, const char *b)
+{
+  char ka[SORT_KEY_SIZE], kb[SORT_KEY_SIZE];
+  size_t alen, blen;
+  int cmp;
+
+  if (mode == SORT_LOCALE)
+    cmp = strcoll (a, b);
+  else
+  {
+    alen = sort_key_natural (a, ka, SORT_KEY_SIZE);
+    blen = sort_key_natural (b, kb, SORT_KEY_SIZE);
+    /* keys of NAME_MAX long names fit, whatever they are made of */
+    if (alen >= SORT_KEY_SIZE)
+      alen = SORT_KEY_SIZE - 1;
+    if (blen >= SORT_KEY_SIZE)
+      blen = SORT_KEY_SIZE - 1;
+    cmp = sort_key_cmp (ka, alen, kb, blen);
+  }
+
+  return cmp ? cmp : strcmp (a, b);
+}
+
+static int
+sort_item_cmp (const void *a, const void *b)
+{
+  const sort_item_t *ia = (const sort_item_t *) a;
+  const sort_item_t *ib = (const sort_item_t *) b;
+  int cmp;
+
+  cmp = sort_key_cmp (ia->key, ia->len, ib->key, ib->len);
+
+  return cmp ? cmp : strcmp (ia->name, ib->name);
+}
+
+int *
+sort_names (sort_mode_t mode, const char *const *names, int count)
+{
+  sort_item_t *items;
+  char *keys;
+  size_t size = SORT_KEY_SIZE, used = 0;
+  int *order = NULL;
+  int i;
+
+  items = malloc (count * sizeof (sort_item_t));
+  keys = malloc (size);
+  if (!items || !keys)
+    goto out;
+
+  for (i = 0; i < count; i++)
+  {
+    size_t len;
+
+    len = sort_key (mode, names[i], keys + used, size - used);
+    if (len >= size - used)
+    {
+      size_t grow = 2 * size > used + len + 1 ? 2 * size : used + len + 1;
+      char *k;
+
+      k = realloc (keys, grow);
+      if (!k)
+        goto out;
+      keys = k;
+      size = grow;
+      len = sort_key (mode, names[i], keys + used, size - used);
+    }
+
+    items[i].name = names[i];
+    items[i].offset = used;
+    items[i].len = len;
+    items[i].index = i;
+    used += len + 1;
+  }
+
+  for (i = 0; i < count; i++)
+    items[i].key = keys + items[i].offset;
+  qsort (items, count, sizeof (sort_item_t), sort_item_cmp);
+
+  order = malloc (count * sizeof (int));
+  if (order)
+    for (i = 0; i < count; i++)
+      order[i] = items[i].index;
+
+ out:
+  if (keys)
+    free (keys);
+  if (items)
+    free (items);
+
+  return order;
+}
@@ -0,0 +1,43 @@
+/*
+ * sortkey.h : GeeXboX uShare entry name collation header.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _SORTKEY_H_
+#define _SORTKEY_H_
+
+#include <stddef.h>
+
+typedef enum {
+  SORT_LOCALE,                  /* strcoll () order */
+  SORT_NATURAL,                 /* case folded, numbers by their value */
+} sort_mode_t;
+
+/* Write the sort key of name to key, as strxfrm () does : returns its
+ * length, and key is only complete when that is less than size. Keys
+ * compare as bytes in the order of the names. */
+size_t sort_key (sort_mode_t mode, const char *name, char *key, size_t size);
+
+/* Compare two names as their keys do, then byte-wise, so that only the
+ * same names compare equal. */
+int sort_cmp (sort_mode_t mode, const char *a, const char *b);
+
+/* Order of count names, as a malloc'ed array of their indexes, NULL if
+ * out of memory. Each key is computed once. */
+int *sort_names (sort_mode_t mode, const char *const *names, int count);
+
+#endif /* _SORTKEY_H_ */
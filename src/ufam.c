@@ -110,9 +110,7 @@ ufam_thread (void *arg)
           entry = (struct upnp_entry_t *) fe.userdata;
           if (entry)
             log_verbose(_("ufam - dir %s has changed\n"), entry->fullpath);
-          /* TODO : rebuild metadat_list for this dir instead of rebuild from scratch */
-          free_metadata_list (ut);
-          build_metadata_list (ut);
+          rescan_metadata_list (ut);
           break;
       }
     }
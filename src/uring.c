@@ -0,0 +1,289 @@
+/*
+ * uring.c : GeeXboX uShare io_uring based batched statx.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_IO_URING
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+/* Rings are used through the raw system calls, which keeps uShare free
+ * of any liburing dependency : one ring per scanning thread, only ever
+ * touched by that thread. */
+struct uring_s {
+  int fd;
+  unsigned int depth;
+  unsigned int tail;            /* local copy of the submission tail */
+  unsigned int queued;          /* prepared, not submitted yet */
+  unsigned int inflight;        /* submitted, not reaped yet */
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+
+  void *cq_ring;
+  size_t cq_ring_size;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_cqe *cqes;
+};
+
+static int
+uring_setup (unsigned int entries, struct io_uring_params *p)
+{
+  return syscall (__NR_io_uring_setup, entries, p);
+}
+
+static int
+uring_enter (int fd, unsigned int to_submit, unsigned int min_complete,
+             unsigned int flags)
+{
+  return syscall (__NR_io_uring_enter, fd, to_submit, min_complete,
+                  flags, NULL, 0);
+}
+
+static bool
+uring_supports_statx (int fd)
+{
+  struct io_uring_probe *probe;
+  size_t size;
+  bool supported = false;
+
+  size = sizeof (*probe) + 256 * sizeof (struct io_uring_probe_op);
+  probe = calloc (1, size);
+  if (!probe)
+    return false;
+
+  if (!syscall (__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256)
+      && probe->last_op >= IORING_OP_STATX)
+    supported = probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED;
+
+  free (probe);
+
+  return supported;
+}
+
+/**
+ * uring_new: set up a ring keeping up to depth requests in flight.
+ *  Returns NULL when the kernel has no (usable) io_uring.
+ */
+uring_t *
+uring_new (unsigned int depth)
+{
+  struct io_uring_params p;
+  uring_t *ring;
+
+  ring = calloc (1, sizeof (uring_t));
+  if (!ring)
+    return NULL;
+
+  memset (&p, 0, sizeof (p));
+  ring->fd = uring_setup (depth, &p);
+  if (ring->fd < 0)
+  {
+    free (ring);
+    return NULL;
+  }
+
+  fcntl (ring->fd, F_SETFD, FD_CLOEXEC);
+  if (!uring_supports_statx (ring->fd))
+    goto err;
+
+  /* the completion queue is at least as large as the submission one,
+   * so that whatever is in flight can't overflow it */
+  ring->depth = p.sq_entries;
+
+  ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+  ring->cq_ring_size = p.cq_off.cqes
+    + p.cq_entries * sizeof (struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (ring->cq_ring_size > ring->sq_ring_size)
+      ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+
+  ring->sq_ring = mmap (NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED)
+    goto err;
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ring = ring->sq_ring;
+  else
+  {
+    ring->cq_ring = mmap (NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd,
+                          IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED)
+      goto err_sq;
+  }
+
+  ring->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+  ring->sqes = mmap (NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    goto err_cq;
+
+  ring->sq_head = (unsigned int *) ((char *) ring->sq_ring + p.sq_off.head);
+  ring->sq_tail = (unsigned int *) ((char *) ring->sq_ring + p.sq_off.tail);
+  ring->sq_mask =
+    (unsigned int *) ((char *) ring->sq_ring + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned int *) ((char *) ring->sq_ring + p.sq_off.array);
+
+  ring->cq_head = (unsigned int *) ((char *) ring->cq_ring + p.cq_off.head);
+  ring->cq_tail = (unsigned int *) ((char *) ring->cq_ring + p.cq_off.tail);
+  ring->cq_mask =
+    (unsigned int *) ((char *) ring->cq_ring + p.cq_off.ring_mask);
+  ring->cqes =
+    (struct io_uring_cqe *) ((char *) ring->cq_ring + p.cq_off.cqes);
+  ring->tail = *ring->sq_tail;
+
+  return ring;
+
+ err_cq:
+  if (ring->cq_ring != ring->sq_ring)
+    munmap (ring->cq_ring, ring->cq_ring_size);
+ err_sq:
+  munmap (ring->sq_ring, ring->sq_ring_size);
+ err:
+  close (ring->fd);
+  free (ring);
+
+  return NULL;
+}
+
+void
+uring_free (uring_t *ring)
+{
+  if (!ring)
+    return;
+
+  munmap (ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != ring->sq_ring)
+    munmap (ring->cq_ring, ring->cq_ring_size);
+  munmap (ring->sq_ring, ring->sq_ring_size);
+  close (ring->fd);
+  free (ring);
+}
+
+unsigned int
+uring_room (const uring_t *ring)
+{
+  return ring->depth - ring->queued - ring->inflight;
+}
+
+/**
+ * uring_prep_statx: queue a statx () of name, relative to dirfd, whose
+ *  completion is going to be reported along with data.
+ */
+bool
+uring_prep_statx (uring_t *ring, int dirfd, const char *name,
+                  struct statx *stx, uint64_t data)
+{
+  struct io_uring_sqe *sqe;
+  unsigned int index;
+
+  if (!uring_room (ring))
+    return false;
+
+  index = ring->tail & *ring->sq_mask;
+
+  sqe = &ring->sqes[index];
+  memset (sqe, 0, sizeof (*sqe));
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = dirfd;
+  sqe->addr = (uint64_t) (uintptr_t) name;
+  sqe->len = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_INO | STATX_SIZE
+             | STATX_MTIME;
+  sqe->off = (uint64_t) (uintptr_t) stx;
+  sqe->statx_flags = AT_STATX_SYNC_AS_STAT;
+  sqe->user_data = data;
+
+  ring->sq_array[index] = index;
+  ring->tail++;
+  ring->queued++;
+
+  return true;
+}
+
+/**
+ * uring_submit: hand the queued requests to the kernel, and wait for at
+ *  least wait of the requests in flight to complete.
+ */
+int
+uring_submit (uring_t *ring, unsigned int wait)
+{
+  int n;
+
+  /* make the sqes visible before the new tail */
+  __atomic_store_n (ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+
+  do
+    n = uring_enter (ring->fd, ring->queued, wait,
+                     wait ? IORING_ENTER_GETEVENTS : 0);
+  while (n < 0 && errno == EINTR);
+
+  if (n < 0)
+    return -1;
+
+  ring->queued -= n;
+  ring->inflight += n;
+
+  return n;
+}
+
+/**
+ * uring_reap: get one completed request, if any.
+ */
+bool
+uring_reap (uring_t *ring, uint64_t *data, int *res)
+{
+  struct io_uring_cqe *cqe;
+  unsigned int head;
+
+  head = *ring->cq_head;
+  if (head == __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE))
+    return false;
+
+  cqe = &ring->cqes[head & *ring->cq_mask];
+  *data = cqe->user_data;
+  *res = cqe->res;
+
+  __atomic_store_n (ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  ring->inflight--;
+
+  return true;
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,44 @@
+/*
+ * uring.h : GeeXboX uShare io_uring based batched statx header.
+ * Originally developped for the GeeXboX project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#ifdef HAVE_IO_URING
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+typedef struct uring_s uring_t;
+
+uring_t *uring_new (unsigned int depth);
+void uring_free (uring_t *ring);
+
+/* number of requests which can still be queued */
+unsigned int uring_room (const uring_t *ring);
+
+bool uring_prep_statx (uring_t *ring, int dirfd, const char *name,
+                       struct statx *stx, uint64_t data);
+int uring_submit (uring_t *ring, unsigned int wait);
+bool uring_reap (uring_t *ring, uint64_t *data, int *res);
+
+#endif /* HAVE_IO_URING */
+
+#endif /* _URING_H_ */
@@ -44,6 +44,8 @@
 #include <sys/stat.h>
 #include <stdbool.h>
 #include <fcntl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 
 #ifdef HAVE_IFADDRS_H
 #include <ifaddrs.h>
@@ -60,6 +62,7 @@
 #include "config.h"
 #include "ushare.h"
 #include "metadata.h"
+#include "metaindex.h"
 #include "util_iconv.h"
 #include "content.h"
 #include "cfgparser.h"
@@ -67,6 +70,7 @@
 #include "trace.h"
 #include "buffer.h"
 #include "ctrl_telnet.h"
+#include "http.h"
 #ifdef HAVE_FAM
 #include "ufam.h"
 #endif /* HAVE_FAM */
@@ -84,6 +88,8 @@ ushare_new (void)
   ut->interface = strdup (DEFAULT_USHARE_IFACE);
   ut->model_name = strdup (DEFAULT_USHARE_NAME);
   ut->contentlist = NULL;
+  ut->lazylist = NULL;
+  ut->policies = NULL;
   ut->init = 0;
   ut->udn = NULL;
   ut->port = 0; /* Randomly attributed by libupnp */
@@ -99,7 +105,30 @@ ushare_new (void)
   ut->caps = DLNA_CAPABILITY_UPNP_AV;
   ut->verbose = false;
   ut->daemon = false;
+  ut->benchmark = false;
   ut->override_iconv_err = false;
+  ut->mmap_read = false;
+  ut->scan_threads = DEFAULT_USHARE_SCAN_THREADS;
+  ut->scan_queue_depth = DEFAULT_USHARE_SCAN_QUEUE_DEPTH;
+  ut->lazy_depth = DEFAULT_USHARE_LAZY_DEPTH;
+  ut->index_file = NULL;
+  ut->checkpoint_interval = DEFAULT_USHARE_CHECKPOINT_INTERVAL;
+  ut->metadata = NULL;
+  ut->metadata_generation = 0;
+  ut->metadata_thread_running = false;
+  ut->metadata_cancel = false;
+  ut->metadata_rescan = false;
+  memset (&ut->scan_progress, 0, sizeof (scan_progress_t));
+  memset (&ut->probes, 0, sizeof (probe_t));
+  scan_io_init (&ut->scan_io);
+  ut->scan_io.idle = true;
+  ut->scan_io.rate = DEFAULT_USHARE_SCAN_RATE;
+  ut->scan_io.stream_rate = DEFAULT_USHARE_SCAN_STREAM_RATE;
+  ut->stream_pool = DEFAULT_USHARE_STREAM_POOL;
+  memset (&ut->stream_handles, 0, sizeof (pool_t));
+  memset (&ut->stream_buffers, 0, sizeof (pool_t));
+  ut->read_cache_size = DEFAULT_USHARE_READ_CACHE;
+  read_cache_init (&ut->read_cache);
   ut->cfg_file = NULL;
 #ifdef HAVE_FAM
   ut->ufam = ufam_init ();
@@ -107,6 +136,9 @@ ushare_new (void)
 
   pthread_mutex_init (&ut->termination_mutex, NULL);
   pthread_cond_init (&ut->termination_cond, NULL);
+  ut->terminating = false;
+  pthread_mutex_init (&ut->metadata_lock, NULL);
+  pthread_cond_init (&ut->probes.cond, NULL);
 
   return ut;
 }
@@ -125,6 +157,10 @@ ushare_free (ushare_t *ut)
     free (ut->model_name);
   if (ut->contentlist)
     content_free (ut->contentlist);
+  if (ut->lazylist)
+    content_free (ut->lazylist);
+  if (ut->policies)
+    share_policy_free (ut->policies);
   if (ut->udn)
     free (ut->udn);
   if (ut->presentation)
@@ -134,14 +170,24 @@ ushare_free (ushare_t *ut)
   ut->dlna = NULL;
   if (ut->cfg_file)
     free (ut->cfg_file);
+  if (ut->index_file)
+    free (ut->index_file);
+  if (ut->metadata)
+    meta_tree_free (ut->metadata);
 
 #ifdef HAVE_FAM
   if (ut->ufam)
     ufam_free (ut->ufam);
 #endif /* HAVE_FAM */
 
+  pthread_cond_destroy (&ut->probes.cond);
+  scan_io_free (&ut->scan_io);
+  pool_free (&ut->stream_handles);
+  pool_free (&ut->stream_buffers);
+  read_cache_free (&ut->read_cache);
   pthread_cond_destroy (&ut->termination_cond);
   pthread_mutex_destroy (&ut->termination_mutex);
+  pthread_mutex_destroy (&ut->metadata_lock);
 
   free (ut);
 }
@@ -150,6 +196,7 @@ static void
 ushare_signal_exit (void)
 {
   pthread_mutex_lock (&ut->termination_mutex);
+  ut->terminating = true;
   pthread_cond_signal (&ut->termination_cond);
   pthread_mutex_unlock (&ut->termination_mutex);
 }
@@ -169,15 +216,11 @@ finish_upnp (ushare_t *ut)
   return 0;
 }
 
-static int
-init_upnp (ushare_t *ut)
+/* Set libdlna up, media profiles included, short of the UPnP service. */
+static void
+init_dlna (ushare_t *ut)
 {
-  int res;
-  extern dlna_http_callback_t ushare_http_callbacks;
   dlna_org_flags_t flags;
-  
-  if (!ut || !ut->name || !ut->udn)
-    return -1;
 
   flags = DLNA_ORG_FLAG_STREAMING_TRANSFER_MODE |
           DLNA_ORG_FLAG_BACKGROUND_TRANSFERT_MODE |
@@ -198,7 +241,8 @@ init_upnp (ushare_t *ut)
   dlna_device_set_model_number (ut->dlna, "001");
   dlna_device_set_model_url (ut->dlna, "http://ushare.geexbox.org/");
   dlna_device_set_serial_number (ut->dlna, "USHARE-01");
-  dlna_device_set_uuid (ut->dlna, ut->udn);
+  if (ut->udn)
+    dlna_device_set_uuid (ut->dlna, ut->udn);
   dlna_device_set_presentation_url (ut->dlna, "ushare.html");
 
   dlna_set_capability_mode (ut->dlna, ut->caps);
@@ -206,6 +250,18 @@ init_upnp (ushare_t *ut)
     log_info (_("Starting in DLNA compliant profile ...\n"));
   if (ut->caps == DLNA_CAPABILITY_UPNP_AV_XBOX)
     log_info (_("Starting in XboX 360 compliant profile ...\n"));
+}
+
+static int
+init_upnp (ushare_t *ut)
+{
+  int res;
+  extern dlna_http_callback_t ushare_http_callbacks;
+
+  if (!ut || !ut->name || !ut->udn)
+    return -1;
+
+  init_dlna (ut);
 
   dlna_set_interface (ut->dlna, ut->interface);
   dlna_set_port (ut->dlna, ut->port);
@@ -419,13 +475,7 @@ restart_upnp (ushare_t *ut)
 }
 
 static void
-UPnPBreak (int s __attribute__ ((unused)))
-{
-  ushare_signal_exit ();
-}
-
-static void
-reload_config (int s __attribute__ ((unused)))
+reload_config (void)
 {
   ushare_t *ut2;
   bool reload = false;
@@ -437,7 +487,11 @@ reload_config (int s __attribute__ ((unused)))
     return;
 
   if (parse_config_file (ut2) < 0)
+  {
+    ushare_free (ut2);
     return;
+  }
+  ut2->contentlist = content_drop_nested (ut2->contentlist);
 
   if (ut->name && strcmp (ut->name, ut2->name))
   {
@@ -452,7 +506,8 @@ reload_config (int s __attribute__ ((unused)))
     if (!has_iface (ut2->interface))
     {
       ushare_free (ut2);
-      raise (SIGINT);
+      ushare_signal_exit ();
+      return;
     }
     else
     {
@@ -463,6 +518,14 @@ reload_config (int s __attribute__ ((unused)))
     }
   }
 
+  /* the index isn't saved anymore when the new configuration has none */
+  pthread_mutex_lock (&ut->metadata_lock);
+  if (ut->index_file)
+    free (ut->index_file);
+  ut->index_file = ut2->index_file;
+  ut2->index_file = NULL;
+  pthread_mutex_unlock (&ut->metadata_lock);
+
   if (ut->port != ut2->port)
   {
     ut->port = ut2->port;
@@ -474,26 +537,64 @@ reload_config (int s __attribute__ ((unused)))
     if (restart_upnp (ut) < 0)
     {
       ushare_free (ut2);
-      raise (SIGINT);
+      ushare_signal_exit ();
+      return;
     }
   }
 
+  pthread_mutex_lock (&ut->metadata_lock);
   if (ut->contentlist)
     content_free (ut->contentlist);
   ut->contentlist = ut2->contentlist;
   ut2->contentlist = NULL;
+  if (ut->lazylist)
+    content_free (ut->lazylist);
+  ut->lazylist = ut2->lazylist;
+  ut2->lazylist = NULL;
+  if (ut->policies)
+    share_policy_free (ut->policies);
+  ut->policies = ut2->policies;
+  ut2->policies = NULL;
+  ut->lazy_depth = ut2->lazy_depth;
+  ut->checkpoint_interval = ut2->checkpoint_interval;
+  pthread_mutex_unlock (&ut->metadata_lock);
+
+  scan_io_set (&ut->scan_io, ut2->scan_io.idle, ut2->scan_io.rate,
+               ut2->scan_io.stream_rate);
+  __atomic_store_n (&ut->mmap_read, ut2->mmap_read, __ATOMIC_RELAXED);
+  ut->read_cache_size = ut2->read_cache_size;
+  read_cache_set_budget (&ut->read_cache, (size_t) ut->read_cache_size << 20);
   ushare_free (ut2);
 
   if (ut->contentlist)
-  {
-    free_metadata_list (ut);
-    build_metadata_list (ut);
-  }
+    rescan_metadata_list (ut);
   else
   {
     log_error (_("Error: no content directory to be shared.\n"));
-    raise (SIGINT);
+    ushare_signal_exit ();
+  }
+}
+
+/* Signals are blocked in every thread but this one, which takes them
+ * synchronously : a reload is then free to lock and allocate, as it
+ * does, rather than running from within a signal handler. */
+static void *
+signal_thread (void *arg)
+{
+  sigset_t *signals = (sigset_t *) arg;
+  int s;
+
+  while (!sigwait (signals, &s))
+  {
+    pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+    if (s == SIGHUP)
+      reload_config ();
+    else
+      ushare_signal_exit ();
+    pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
   }
+
+  return NULL;
 }
 
 inline void
@@ -534,9 +635,283 @@ ushare_kill (ctrl_telnet_client_t *client,
   ushare_signal_exit ();
 }
 
+static void
+ushare_expand (ctrl_telnet_client_t *client, int argc, char **argv)
+{
+  int count;
+
+  if (argc != 2)
+  {
+    ctrl_telnet_client_send (client, _("Usage: expand <directory>\n"));
+    return;
+  }
+
+  count = expand_metadata_dir (ut, argv[1]);
+  if (count < 0)
+    ctrl_telnet_client_sendf (client, _("%s is not a shared directory\n"),
+                              argv[1]);
+  else
+    ctrl_telnet_client_sendf (client, _("%d new entries published\n"), count);
+}
+
+static void
+ushare_rebuild (ctrl_telnet_client_t *client,
+                int argc __attribute__((unused)),
+                char **argv __attribute__((unused)))
+{
+  build_metadata_list (ut);
+  ctrl_telnet_client_send (client, _("Rebuilding the metadata list\n"));
+}
+
+static void
+ushare_probes (ctrl_telnet_client_t *client,
+               int argc __attribute__((unused)),
+               char **argv __attribute__((unused)))
+{
+  unsigned long total = ut->probes.probed + ut->probes.cached;
+
+  ctrl_telnet_client_sendf (client,
+                            _("%lu files probed, %lu probes avoided "
+                              "(%.1f%% avoided)\n"),
+                            ut->probes.probed, ut->probes.cached,
+                            total ? 100.0 * ut->probes.cached / total
+                            : 0.0);
+  if (ut->probes.deferred)
+    ctrl_telnet_client_sendf (client,
+                              _("%lu files left out on their extension, "
+                                "%lu waiting to be probed\n"),
+                              ut->probes.skipped, ut->probes.pending);
+  if (ut->probes.prefetched)
+    ctrl_telnet_client_sendf (client,
+                              _("%lu file headers read ahead in disk order, "
+                                "%lu of them by their disk location\n"),
+                              ut->probes.prefetched, ut->probes.located);
+}
+
+static void
+ushare_scanio (ctrl_telnet_client_t *client, int argc, char **argv)
+{
+  scan_io_t *io = &ut->scan_io;
+
+  if (argc == 2 && !strcmp (argv[1], "reset"))
+  {
+    scan_io_reset (io);
+    ctrl_telnet_client_send (client, _("Scan I/O counters reset\n"));
+    return;
+  }
+
+  pthread_mutex_lock (&io->lock);
+  ctrl_telnet_client_sendf (client,
+                            _("%lu scan operations, %lu throttled "
+                              "(%.1f s waited), %lu while streaming\n"),
+                            io->ops, io->throttled, io->waited, io->backoffs);
+  ctrl_telnet_client_sendf (client,
+                            _("%lu stalls over %d ms (%.2f%%), "
+                              "%lu media requests\n"),
+                            io->stalls, SCAN_IO_STALL_MS,
+                            io->ops ? 100.0 * io->stalls / io->ops : 0.0,
+                            io->streams);
+  pthread_mutex_unlock (&io->lock);
+
+  ctrl_telnet_client_sendf (client, _("Streams %s\n"),
+                            scan_io_streaming (io) ? _("active, scans back off")
+                            : _("idle"));
+}
+
+static void
+ushare_stream_pool (ctrl_telnet_client_t *client, const char *name,
+                    const pool_t *pool)
+{
+  ctrl_telnet_client_sendf (client,
+                            _("%s: %u of %u in use, at most %u, "
+                              "%lu handed out, %lu allocated when none "
+                              "was left\n"),
+                            name, pool->used, pool->count, pool->peak,
+                            pool->gets, pool->misses);
+}
+
+static void
+ushare_streams (ctrl_telnet_client_t *client, int argc, char **argv)
+{
+  read_cache_t *cache = &ut->read_cache;
+
+  if (argc == 2 && !strcmp (argv[1], "reset"))
+  {
+    read_cache_reset (cache);
+    ctrl_telnet_client_send (client, _("Read counters reset\n"));
+    return;
+  }
+
+  ushare_stream_pool (client, _("Stream handles"), &ut->stream_handles);
+  ushare_stream_pool (client, _("Stream buffers"), &ut->stream_buffers);
+
+  pthread_mutex_lock (&cache->lock);
+  ctrl_telnet_client_sendf (client,
+                            _("%llu MB served, %llu MB read from disk "
+                              "in %lu reads (%.2f reads per MB served)\n"),
+                            (unsigned long long) (cache->served >> 20),
+                            (unsigned long long) (cache->disk_bytes >> 20),
+                            cache->disk_reads,
+                            cache->served ? (double) cache->disk_reads
+                            * (1 << 20) / cache->served : 0.0);
+  ctrl_telnet_client_sendf (client,
+                            _("Read cache: %zu of %zu MB used, %lu chunks "
+                              "found, %lu shared while being read\n"),
+                            cache->size >> 20, cache->budget >> 20,
+                            cache->hits, cache->shared);
+  pthread_mutex_unlock (&cache->lock);
+}
+
+static void
+benchmark_count (const meta_dir_t *dir, unsigned long *dirs,
+                 unsigned long *files)
+{
+  int i;
+
+  for (i = 0; i < dir->count; i++)
+    if (!dir->entries[i].dir)
+      (*files)++;
+    else
+    {
+      (*dirs)++;
+      benchmark_count (dir->entries[i].dir, dirs, files);
+    }
+}
+
+/* Size of the index of the scanned tree, written to a scratch file when
+ * none is configured. */
+static off_t
+benchmark_index_size (ushare_t *ut)
+{
+  char scratch[] = "/tmp/ushare-benchmark-XXXXXX";
+  const char *file = ut->index_file;
+  struct stat st;
+  off_t size = 0;
+  int fd;
+
+  if (!file)
+  {
+    fd = mkstemp (scratch);
+    if (fd < 0)
+      return 0;
+    close (fd);
+    file = scratch;
+
+    pthread_mutex_lock (&ut->metadata_lock);
+    if (ut->metadata && metaindex_save (ut->metadata, file) < 0)
+      file = NULL;
+    pthread_mutex_unlock (&ut->metadata_lock);
+  }
+
+  if (file && !stat (file, &st))
+    size = st.st_size;
+  if (!ut->index_file)
+    unlink (scratch);
+
+  return size;
+}
+
+/* Resident set size, in KiB, -1 if it can't be told. */
+static long
+benchmark_rss (void)
+{
+  long pages = -1;
+#ifdef __linux__
+  FILE *statm;
+
+  statm = fopen ("/proc/self/statm", "r");
+  if (!statm)
+    return -1;
+  if (fscanf (statm, "%*d %ld", &pages) != 1)
+    pages = -1;
+  fclose (statm);
+#endif /* __linux__ */
+
+  return pages < 0 ? -1 : pages * (sysconf (_SC_PAGESIZE) / 1024);
+}
+
+/* Build the metadata of the configured shares, probing included but
+ * without any UPnP service, and tell how it went. The tree is then built
+ * again and torn down, to tell what memory each generation gives back. */
+static int
+benchmark_scan (ushare_t *ut)
+{
+  struct timeval start, end;
+  struct rusage usage;
+  unsigned long dirs = 0, files = 0;
+  double elapsed;
+  off_t index_size;
+  long rss_built, rss_rebuilt, rss_freed;
+  int i;
+
+  init_dlna (ut);
+  scan_io_reset (&ut->scan_io);
+
+  gettimeofday (&start, NULL);
+  build_metadata_list (ut);
+  wait_metadata_list (ut);
+  gettimeofday (&end, NULL);
+
+  elapsed = (end.tv_sec - start.tv_sec)
+    + (end.tv_usec - start.tv_usec) / 1000000.0;
+  getrusage (RUSAGE_SELF, &usage);
+  rss_built = benchmark_rss ();
+
+  pthread_mutex_lock (&ut->metadata_lock);
+  for (i = 0; ut->metadata && i < ut->metadata->count; i++)
+    if (ut->metadata->roots[i].dir)
+    {
+      dirs++;
+      benchmark_count (ut->metadata->roots[i].dir, &dirs, &files);
+    }
+  pthread_mutex_unlock (&ut->metadata_lock);
+  index_size = benchmark_index_size (ut);
+
+  printf (_("Scan benchmark :\n"));
+  printf (_("  wall time         : %.3f s\n"), elapsed);
+  printf (_("  directories       : %lu\n"), dirs);
+  printf (_("  files             : %lu (%.0f files/s)\n"), files,
+          elapsed > 0 ? files / elapsed : 0.0);
+  printf (_("  file system calls : %lu (statx through io_uring included, "
+            "%lu throttled)\n"), ut->scan_io.ops, ut->scan_io.throttled);
+  printf (_("  media probed      : %lu, %lu probes avoided\n"),
+          ut->probes.probed, ut->probes.cached);
+  printf (_("  cpu time          : %.3f s user, %.3f s system\n"),
+          usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0,
+          usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0);
+  printf (_("  peak RSS          : %ld KiB\n"), usage.ru_maxrss);
+  printf (_("  index             : %lld bytes, %.1f bytes per file\n"),
+          (long long) index_size,
+          files ? (double) index_size / files : 0.0);
+
+  /* a new generation is merged into the first one */
+  build_metadata_list (ut);
+  wait_metadata_list (ut);
+  finish_metadata_list (ut);
+  rss_rebuilt = benchmark_rss ();
+
+  gettimeofday (&start, NULL);
+  free_metadata_list (ut);
+  gettimeofday (&end, NULL);
+  rss_freed = benchmark_rss ();
+
+  printf (_("  RSS               : %ld KiB built, %ld KiB rebuilt, "
+            "%ld KiB torn down\n"), rss_built, rss_rebuilt, rss_freed);
+  printf (_("  teardown          : %.3f s\n"), (end.tv_sec - start.tv_sec)
+          + (end.tv_usec - start.tv_usec) / 1000000.0);
+
+  dlna_uninit (ut->dlna);
+  ut->dlna = NULL;
+
+  return 0;
+}
+
 int
 main (int argc, char **argv)
 {
+  pthread_t signals_thread;
+  sigset_t signals;
+
   ut = ushare_new ();
   if (!ut)
     return EXIT_FAILURE;
@@ -557,6 +932,7 @@ main (int argc, char **argv)
     fprintf (stderr, _("Warning: can't parse file \"%s\".\n"),
              ut->cfg_file ? ut->cfg_file : SYSCONFDIR "/" USHARE_CONFIG_FILE);
   }
+  ut->contentlist = content_drop_nested (ut->contentlist);
 
   if (ut->daemon)
   {
@@ -571,6 +947,14 @@ main (int argc, char **argv)
     return EXIT_FAILURE;
   }
 
+  if (ut->benchmark)
+  {
+    benchmark_scan (ut);
+    ushare_free (ut);
+    finish_iconv ();
+    return EXIT_SUCCESS;
+  }
+
   if (!has_iface (ut->interface))
   {
     ushare_free (ut);
@@ -601,8 +985,11 @@ main (int argc, char **argv)
     display_headers ();
   }
 
-  signal (SIGINT, UPnPBreak);
-  signal (SIGHUP, reload_config);
+  /* before any thread is started, so that they all inherit the mask */
+  sigemptyset (&signals);
+  sigaddset (&signals, SIGINT);
+  sigaddset (&signals, SIGHUP);
+  pthread_sigmask (SIG_BLOCK, &signals, NULL);
 
   if (ut->use_telnet)
   {
@@ -614,8 +1001,23 @@ main (int argc, char **argv)
     
     ctrl_telnet_register ("kill", ushare_kill,
                           _("Terminates the uShare server"));
+    ctrl_telnet_register ("expand", ushare_expand,
+                          _("Scans a directory of a lazy share"));
+    ctrl_telnet_register ("rebuild", ushare_rebuild,
+                          _("Scans all shares again from scratch"));
+    ctrl_telnet_register ("probes", ushare_probes,
+                          _("Shows how many media probes the index avoided"));
+    ctrl_telnet_register ("scanio", ushare_scanio,
+                          _("Shows the scan I/O counters, or resets them"));
+    ctrl_telnet_register ("streams", ushare_streams,
+                          _("Shows the stream pools and read counters, "
+                            "or resets the latter"));
   }
   
+  if (!http_pools_init (ut, ut->stream_pool))
+    log_error (_("Warning: cannot allocate the stream pools.\n"));
+  read_cache_set_budget (&ut->read_cache, (size_t) ut->read_cache_size << 20);
+
   if (init_upnp (ut) < 0)
   {
     finish_upnp (ut);
@@ -625,13 +1027,25 @@ main (int argc, char **argv)
 
   build_metadata_list (ut);
 
-  /* Let main sleep until it's time to die... */
-  pthread_mutex_lock (&ut->termination_mutex);
-  pthread_cond_wait (&ut->termination_cond, &ut->termination_mutex);
-  pthread_mutex_unlock (&ut->termination_mutex);
+  if (pthread_create (&signals_thread, NULL, signal_thread, &signals))
+  {
+    log_error (_("Error: failed to create the signal thread.\n"));
+  }
+  else
+  {
+    /* Let main sleep until it's time to die... */
+    pthread_mutex_lock (&ut->termination_mutex);
+    while (!ut->terminating)
+      pthread_cond_wait (&ut->termination_cond, &ut->termination_mutex);
+    pthread_mutex_unlock (&ut->termination_mutex);
+
+    pthread_cancel (signals_thread);
+    pthread_join (signals_thread, NULL);
+  }
 
   if (ut->use_telnet)
     ctrl_telnet_stop ();
+  finish_metadata_list (ut);
   finish_upnp (ut);
   ushare_free (ut);
   finish_iconv ();
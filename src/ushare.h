@@ -29,17 +29,49 @@
 
 #include "content.h"
 #include "buffer.h"
+#include "scanio.h"
+#include "policy.h"
+#include "pool.h"
+#include "readcache.h"
 
 #define VIRTUAL_DIR "/web"
 #define DEFAULT_UUID "898f9738-d930-4db4-a3cf"
 
 #define UPNP_MAX_CONTENT_LENGTH 4096
 
+/* Progress of the running full scan, as seen by the walk publishing it.
+ * Read from other threads, only ever accessed atomically. */
+typedef struct scan_progress_s {
+  bool running;
+  unsigned long dirs;           /* directories listed and published */
+  unsigned long pending;        /* directories found, not listed yet */
+  unsigned long files;          /* files published */
+} scan_progress_t;
+
+/* Media profiling, done by libdlna when a file is published. In deferred
+ * mode, files are first sorted out on their extension, and those which
+ * may be media are published later on by the probe thread. */
+typedef struct probe_s {
+  bool deferred;
+  unsigned long probed;         /* files profiled by libdlna */
+  unsigned long cached;         /* probes avoided, outcome kept in the index */
+  unsigned long skipped;        /* files left out on their extension */
+  unsigned long pending;        /* files waiting for the probe thread */
+  unsigned long prefetched;     /* headers read ahead in disk order */
+  unsigned long located;        /* of which the disk location was known */
+  pthread_t thread;
+  bool running;
+  bool stop;
+  pthread_cond_t cond;          /* pending files, or stop, with metadata_lock */
+} probe_t;
+
 typedef struct ushare_s {
   char *name;
   char *interface;
   char *model_name;
   content_list_t *contentlist;
+  content_list_t *lazylist;
+  share_policy_list_t *policies;
   int init;
   char *udn;
   unsigned short port;
@@ -52,10 +84,33 @@ typedef struct ushare_s {
   dlna_capability_mode_t caps;
   bool verbose;
   bool daemon;
+  bool benchmark;
   bool override_iconv_err;
+  bool mmap_read;               /* atomic, changed on reload */
+  int scan_threads;
+  int scan_queue_depth;
+  int lazy_depth;
+  char *index_file;
+  int checkpoint_interval;
+  struct meta_tree_s *metadata;
+  unsigned int metadata_generation;
+  pthread_mutex_t metadata_lock;
+  pthread_t metadata_thread;
+  bool metadata_thread_running;
+  bool metadata_cancel;
+  bool metadata_rescan;         /* asked for while the first scan ran */
+  scan_progress_t scan_progress;
+  probe_t probes;
+  scan_io_t scan_io;
+  int stream_pool;
+  pool_t stream_handles;
+  pool_t stream_buffers;
+  int read_cache_size;
+  read_cache_t read_cache;
   char *cfg_file;
   pthread_mutex_t termination_mutex;
   pthread_cond_t termination_cond;
+  bool terminating;             /* under termination_mutex */
 #ifdef HAVE_FAM
   ufam_t *ufam;
 #endif /* HAVE_FAM */